@@ -0,0 +1,320 @@
+/*******************************************************************************
+ *  The memory allocator behind a Filesystem. Nodes of the same kind are       *
+ *  carved out of large slabs one after another, so creating one is usually   *
+ *  just a pointer bump and neighbouring entries sit next to each other in     *
+ *  memory. Names and index tables come from a small set of size classes that  *
+ *  work the same way. Since every slab belongs to one filesystem, the whole   *
+ *  filesystem can be released by freeing its slabs.                           *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* The size of the slabs a cache allocates, unless its objects are so big that
+ * fewer than SLAB_MIN_OBJECTS would fit. */
+#define SLAB_SIZE 65536
+#define SLAB_MIN_OBJECTS 16
+
+/* Objects are aligned to this many bytes, as are the headers placed in front
+ * of slabs and large blocks. */
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/* Adds the given number of bytes held from the system to an arena's total, 
+ * or takes them away if the flag is set. The caller holds the arena's 
+ * large_lock. */
+static void reserve(Arena *, size_t, int);
+
+/* Prepares an empty cache of an arena for objects of the given size. */
+static void cache_init(Arena *, Slab_cache *, size_t);
+
+/* Adds the bytes a cache has handed out and been given back to stats, and
+ * returns how many of its objects are allocated. */
+static unsigned long cache_stats(Slab_cache *, Stats *);
+
+/* Frees every slab of a cache, which cannot be used again. */
+static void cache_release(Slab_cache *);
+
+/* Returns the size class that an allocation of the given size comes from, or 
+ * -1 if it is too large for any of them. */
+static int size_class(size_t);
+
+/* Allocates memory, exiting the program if there is none left. */
+static void *alloc_or_exit(size_t);
+
+/* Creates an arena with no slabs. Slabs are only allocated once a cache is
+ * first used. */
+Arena *arena_new(void)
+{
+    Arena *arena = alloc_or_exit(sizeof(Arena));
+    int i;
+    
+    cache_init(arena, &arena->files, sizeof(File));
+    cache_init(arena, &arena->dirs, sizeof(Directory));
+    for (i = 0; i < CHILD_MAX_LEVEL - 1; i++)
+        cache_init(arena, &arena->children[i], 
+                   sizeof(Child) + i * sizeof(Child *));
+    for (i = 0; i < ARENA_CLASSES; i++)
+        cache_init(arena, &arena->classes[i], 
+                   i < 16 ? (size_t) (i + 1) * 16 : (size_t) 512 << (i - 16));
+    arena->large = NULL;
+    arena->large_allocated = 0;
+    arena->large_freed = 0;
+    arena->reserved = 0;
+    arena->peak = 0;
+    mutex_init(&arena->large_lock);
+    return arena;
+}
+
+/* Returns an object from the cache, reusing a freed one if there is one. */
+void *slab_alloc(Slab_cache *cache)
+{
+    void *object;
+    Slab *slab;
+    size_t size;
+    
+    mutex_lock(&cache->lock);
+    cache->allocs++;
+    if (cache->free_list != NULL)
+    {
+        object = cache->free_list;
+        cache->free_list = *(void **) object;
+        mutex_unlock(&cache->lock);
+        return object;
+    }
+    
+    /* Start a new slab once the current one is used up. */
+    if (cache->bump == NULL || cache->bump + cache->size > cache->limit)
+    {
+        size = SLAB_SIZE;
+        if (size < SLAB_MIN_OBJECTS * cache->size)
+            size = SLAB_MIN_OBJECTS * cache->size;
+        
+        slab = alloc_or_exit(ALIGN_UP(sizeof(Slab)) + size);
+        mutex_lock(&cache->arena->large_lock);
+        reserve(cache->arena, ALIGN_UP(sizeof(Slab)) + size, 0);
+        mutex_unlock(&cache->arena->large_lock);
+        slab->next = cache->slabs;
+        slab->size = size;
+        cache->slabs = slab;
+        cache->bump = (char *) slab + ALIGN_UP(sizeof(Slab));
+        cache->limit = cache->bump + size;
+    }
+    
+    object = cache->bump;
+    cache->bump += cache->size;
+    mutex_unlock(&cache->lock);
+    return object;
+}
+
+/* Returns an object to the cache it was allocated from. */
+void slab_free(Slab_cache *cache, void *object)
+{
+    if (object != NULL)
+    {
+        mutex_lock(&cache->lock);
+        cache->frees++;
+        *(void **) object = cache->free_list;
+        cache->free_list = object;
+        mutex_unlock(&cache->lock);
+    }
+}
+
+/* Allocates size bytes from the size class that fits them, or as a large
+ * block of their own. */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    int class = size_class(size);
+    Large *large;
+    
+    if (class >= 0)
+        return slab_alloc(&arena->classes[class]);
+    
+    large = alloc_or_exit(ALIGN_UP(sizeof(Large)) + size);
+    large->prev = NULL;
+    mutex_lock(&arena->large_lock);
+    arena->large_allocated += size;
+    reserve(arena, ALIGN_UP(sizeof(Large)) + size, 0);
+    large->next = arena->large;
+    if (arena->large != NULL)
+        arena->large->prev = large;
+    arena->large = large;
+    mutex_unlock(&arena->large_lock);
+    return (char *) large + ALIGN_UP(sizeof(Large));
+}
+
+/* Frees memory returned by arena_alloc(), which must be given the same size
+ * it was allocated with. */
+void arena_free(Arena *arena, void *ptr, size_t size)
+{
+    int class = size_class(size);
+    Large *large;
+    
+    if (ptr == NULL)
+        return;
+    
+    if (class >= 0)
+    {
+        slab_free(&arena->classes[class], ptr);
+        return;
+    }
+    
+    large = (Large *) ((char *) ptr - ALIGN_UP(sizeof(Large)));
+    mutex_lock(&arena->large_lock);
+    if (large->prev == NULL)
+        arena->large = large->next;
+    else
+        large->prev->next = large->next;
+    if (large->next != NULL)
+        large->next->prev = large->prev;
+    arena->large_freed += size;
+    reserve(arena, ALIGN_UP(sizeof(Large)) + size, 1);
+    mutex_unlock(&arena->large_lock);
+    free(large);
+}
+
+/* Copies a string into memory from the arena. It is freed with arena_free()
+ * and a size of strlen() + 1. */
+char *arena_strdup(Arena *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/* Copies the first len characters of a string, which need not be terminated,
+ * into memory from the arena, adding a terminator. */
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* Stores in stats how many ordered index nodes are allocated, how many bytes
+ * have been handed out and given back, and how many the arena holds from 
+ * the system, now and at most. The caches are locked one at a time, so the
+ * totals may be from slightly different moments. */
+void arena_stats(Arena *arena, Stats *stats)
+{
+    int i;
+    
+    mutex_lock(&arena->large_lock);
+    stats->allocated = arena->large_allocated;
+    stats->freed = arena->large_freed;
+    stats->reserved = arena->reserved;
+    stats->peak = arena->peak;
+    mutex_unlock(&arena->large_lock);
+    
+    cache_stats(&arena->files, stats);
+    cache_stats(&arena->dirs, stats);
+    stats->children = 0;
+    for (i = 0; i < CHILD_MAX_LEVEL - 1; i++)
+        stats->children += cache_stats(&arena->children[i], stats);
+    for (i = 0; i < ARENA_CLASSES; i++)
+        cache_stats(&arena->classes[i], stats);
+}
+
+/* Frees the arena and everything that was ever allocated from it. */
+void arena_destroy(Arena *arena)
+{
+    Large *large, *next;
+    int i;
+    
+    if (arena == NULL)
+        return;
+    
+    cache_release(&arena->files);
+    cache_release(&arena->dirs);
+    for (i = 0; i < CHILD_MAX_LEVEL - 1; i++)
+        cache_release(&arena->children[i]);
+    for (i = 0; i < ARENA_CLASSES; i++)
+        cache_release(&arena->classes[i]);
+    
+    for (large = arena->large; large != NULL; large = next)
+    {
+        next = large->next;
+        free(large);
+    }
+    mutex_destroy(&arena->large_lock);
+    free(arena);
+}
+
+static void reserve(Arena *arena, size_t size, int release)
+{
+    if (release)
+        arena->reserved -= size;
+    else if ((arena->reserved += size) > arena->peak)
+        arena->peak = arena->reserved;
+}
+
+static void cache_init(Arena *arena, Slab_cache *cache, size_t size)
+{
+    mutex_init(&cache->lock);
+    cache->arena = arena;
+    cache->size = ALIGN_UP(size);
+    cache->allocs = 0;
+    cache->frees = 0;
+    cache->free_list = NULL;
+    cache->bump = NULL;
+    cache->limit = NULL;
+    cache->slabs = NULL;
+}
+
+static unsigned long cache_stats(Slab_cache *cache, Stats *stats)
+{
+    unsigned long live;
+    
+    mutex_lock(&cache->lock);
+    stats->allocated += cache->allocs * cache->size;
+    stats->freed += cache->frees * cache->size;
+    live = cache->allocs - cache->frees;
+    mutex_unlock(&cache->lock);
+    return live;
+}
+
+static void cache_release(Slab_cache *cache)
+{
+    Slab *slab, *next;
+    
+    for (slab = cache->slabs; slab != NULL; slab = next)
+    {
+        next = slab->next;
+        free(slab);
+    }
+    mutex_destroy(&cache->lock);
+}
+
+static int size_class(size_t size)
+{
+    int class = 16;
+    size_t limit = 512;
+    
+    if (size == 0)
+        size = 1;
+    if (size <= 256)
+        return (int) ((size + 15) / 16) - 1;
+    if (size > ARENA_MAX_SMALL)
+        return -1;
+    
+    while (limit < size)
+    {
+        limit <<= 1;
+        class++;
+    }
+    return class;
+}
+
+static void *alloc_or_exit(size_t size)
+{
+    void *ptr = malloc(size);
+    
+    if (ptr == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    return ptr;
+}
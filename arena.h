@@ -0,0 +1,78 @@
+#ifndef _arena_h
+#define _arena_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+/* The number of size classes used for variably sized allocations (names and
+ * index tables): multiples of 16 bytes up to 256, then powers of two up to
+ * ARENA_MAX_SMALL. Anything larger gets a block of its own. */
+#define ARENA_CLASSES 20
+#define ARENA_MAX_SMALL 4096
+
+/* A block of memory carved up by one slab cache. */
+typedef struct slab
+{
+    struct slab *next;
+    size_t size;
+}Slab;
+
+/* A cache of equally sized objects. Objects are handed out by bumping a 
+ * pointer through the current slab, and freed objects are kept on a free list 
+ * (threaded through the objects themselves) for reuse. Each cache has its own
+ * lock, so threads allocating different kinds of object do not wait for each
+ * other, and counts the objects handed out and given back under it. It knows
+ * the arena it belongs to, which counts the slabs it holds. */
+typedef struct
+{
+    Mutex lock;
+    struct arena *arena;
+    size_t size;
+    unsigned long allocs;
+    unsigned long frees;
+    void *free_list;
+    char *bump;
+    char *limit;
+    Slab *slabs;
+}Slab_cache;
+
+/* A large allocation with its own block, kept on a doubly linked list so that
+ * it can be released on its own or along with the whole arena. */
+typedef struct large
+{
+    struct large *prev;
+    struct large *next;
+}Large;
+
+/* All the memory of one filesystem: a slab cache per kind of node, one per
+ * height of ordered index node, size classes for names and index tables, and
+ * the list of large blocks, with the bytes of them handed out and given back.
+ * reserved is the bytes of slabs and large blocks held from the system, and
+ * peak the most there have been. These have a lock of their own. Destroying
+ * the arena releases every node, name and table of the filesystem by freeing
+ * its slabs, without visiting the tree. */
+typedef struct arena
+{
+    Slab_cache files;
+    Slab_cache dirs;
+    Slab_cache children[CHILD_MAX_LEVEL - 1];
+    Slab_cache classes[ARENA_CLASSES];
+    Large *large;
+    unsigned long large_allocated;
+    unsigned long large_freed;
+    unsigned long reserved;
+    unsigned long peak;
+    Mutex large_lock;
+}Arena;
+
+Arena *arena_new(void);
+void *slab_alloc(Slab_cache *);
+void slab_free(Slab_cache *, void *);
+void *arena_alloc(Arena *, size_t);
+void arena_free(Arena *, void *, size_t);
+char *arena_strdup(Arena *, const char *);
+char *arena_strndup(Arena *, const char *, size_t);
+void arena_stats(Arena *, Stats *);
+void arena_destroy(Arena *);
+
+#endif
@@ -0,0 +1,477 @@
+/*******************************************************************************
+ *  The contents of files. Each file owns a list of extents, runs of          *
+ *  consecutive blocks from its filesystem's block pool, in file order. When   *
+ *  a file grows, its last extent is extended in place if the blocks after it  *
+ *  are free, so a file written sequentially usually ends up in a few large    *
+ *  extents, and reads and writes copy whole extents at a time. A copy of a    *
+ *  file shares its extents, which are counted, until either is changed.      *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block-store.h"
+#include "arena.h"
+
+/* The ways file_copy() can move data between a file and a buffer. */
+typedef enum {COPY_IN, COPY_OUT, COPY_ZERO} Copy_mode;
+
+/* Returns the address of a block. */
+static char *block_data(Block_store *, unsigned long);
+
+/* Allocates the given block range if all of it is free, returning 1, or
+ * returns 0 and allocates nothing. */
+static int blocks_take(Block_store *, unsigned long, unsigned long);
+
+/* Allocates one run of at most the given number of blocks (and at most a 
+ * chunk), storing its first block and length. */
+static void blocks_alloc(Block_store *, unsigned long, unsigned long *, 
+                         unsigned long *);
+
+/* Returns a range of blocks to the pool. */
+static void blocks_free(Block_store *, unsigned long, unsigned long);
+
+/* Gives a file at least the given number of blocks. */
+static void file_reserve(Block_store *, File *, unsigned long);
+
+/* Copies the first len bytes of a file that is still in an image, or whose
+ * extents other files share, into blocks of its own, so that it can be 
+ * changed, and makes that its size. */
+static void file_unshare(Block_store *, File *, size_t);
+
+/* Writes the first len bytes of one file, which must have them, into an 
+ * empty file. */
+static void file_fill(Block_store *, File *, const File *, size_t);
+
+/* Moves len bytes at an offset of a file, which must all lie in its blocks,
+ * into or out of a buffer, or zeroes them. */
+static void file_copy(Block_store *, const File *, size_t, char *, size_t,
+                      Copy_mode);
+
+/* Creates an empty block pool. Chunks are added as they are needed. */
+Block_store *blocks_new(Arena *arena)
+{
+    Block_store *store = arena_alloc(arena, sizeof(Block_store));
+    
+    store->arena = arena;
+    memset(store->chunks, 0, sizeof(store->chunks));
+    store->chunk_count = 0;
+    store->free_runs = NULL;
+    mutex_init(&store->lock);
+    return store;
+}
+
+/* Makes a new file empty. */
+void file_init(File *file)
+{
+    file->size = 0;
+    file->blocks = 0;
+    file->extents = NULL;
+    file->extent_count = 0;
+    file->extent_cap = 0;
+    file->mapped = NULL;
+    file->refs = NULL;
+}
+
+/* Makes a new file read its contents from size bytes of a mapped image. They
+ * are only copied into blocks when the file is first changed. */
+void file_map(File *file, const char *data, size_t size)
+{
+    file_init(file);
+    file->mapped = data;
+    file->size = size;
+}
+
+/* Writes len bytes of data at an offset of a file, growing the file if they 
+ * go past its end. Any gap between the old end and the offset reads as 
+ * zeroes. */
+void file_write(Block_store *store, File *file, size_t offset, 
+                const char *data, size_t len)
+{
+    size_t end = offset + len;
+    
+    file_unshare(store, file, file->size);
+    if (end > file->size)
+    {
+        file_reserve(store, file, (end + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        if (offset > file->size)
+            file_copy(store, file, file->size, NULL, offset - file->size, 
+                      COPY_ZERO);
+        file->size = end;
+    }
+    file_copy(store, file, offset, (char *) data, len, COPY_IN);
+}
+
+/* Reads up to len bytes at an offset of a file into buf, returning how many 
+ * there were before the end of the file. */
+size_t file_read(Block_store *store, const File *file, size_t offset, 
+                 char *buf, size_t len)
+{
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+    
+    if (file->mapped != NULL)
+        memcpy(buf, file->mapped + offset, len);
+    else
+        file_copy(store, file, offset, buf, len, COPY_OUT);
+    return len;
+}
+
+/* Sets the size of a file, freeing the blocks past a new, smaller end, or
+ * zero filling up to a new, larger one. */
+void file_truncate(Block_store *store, File *file, size_t size)
+{
+    unsigned long keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE, drop;
+    Extent *last;
+    
+    file_unshare(store, file, size);
+    if (size > file->size)
+    {
+        file_reserve(store, file, keep);
+        file_copy(store, file, file->size, NULL, size - file->size, COPY_ZERO);
+    }
+    
+    /* Free whole extents, then part of the last one kept, from the end. */
+    mutex_lock(&store->lock);
+    while (file->blocks > keep)
+    {
+        last = &file->extents[file->extent_count - 1];
+        drop = file->blocks - keep;
+        if (drop > last->count)
+            drop = last->count;
+        
+        blocks_free(store, last->start + last->count - drop, drop);
+        last->count -= drop;
+        file->blocks -= drop;
+        if (last->count == 0)
+            file->extent_count--;
+    }
+    mutex_unlock(&store->lock);
+    file->size = size;
+}
+
+/* Frees all the blocks and the extent list of a file that is being 
+ * removed, unless other files still share them. A file still in an image 
+ * has neither. */
+void file_release(Block_store *store, File *file)
+{
+    unsigned long i;
+    
+    mutex_lock(&store->lock);
+    if (file->refs != NULL && --*file->refs > 0)
+    {
+        mutex_unlock(&store->lock);
+        file_init(file);
+        return;
+    }
+    if (file->refs != NULL)
+        arena_free(store->arena, file->refs, sizeof(unsigned long));
+    for (i = 0; i < file->extent_count; i++)
+        blocks_free(store, file->extents[i].start, file->extents[i].count);
+    mutex_unlock(&store->lock);
+    arena_free(store->arena, file->extents, file->extent_cap * sizeof(Extent));
+    file_init(file);
+}
+
+/* Makes a new, empty file hold the same contents as another, in constant
+ * time. A file that is still in an image shares its data there; any other 
+ * file's extents are shared, and counted, until one of the files is changed
+ * or removed. The count is kept under the store's lock, since copies of one
+ * file may be made, and changed, under the locks of different 
+ * directories. */
+void file_clone(Block_store *store, File *file, File *from)
+{
+    if (from->mapped != NULL)
+    {
+        file_map(file, from->mapped, from->size);
+        return;
+    }
+    if (from->extent_count == 0)
+    {
+        file_init(file);
+        return;
+    }
+    
+    mutex_lock(&store->lock);
+    if (from->refs == NULL)
+    {
+        from->refs = arena_alloc(store->arena, sizeof(unsigned long));
+        *from->refs = 1;
+    }
+    (*from->refs)++;
+    *file = *from;
+    mutex_unlock(&store->lock);
+}
+
+static char *block_data(Block_store *store, unsigned long block)
+{
+    unsigned long chunk = block / CHUNK_BLOCKS;
+    
+    return store->chunks[chunk / CHUNK_PAGE][chunk % CHUNK_PAGE] + 
+           (block % CHUNK_BLOCKS) * BLOCK_SIZE;
+}
+
+static int blocks_take(Block_store *store, unsigned long start, 
+                       unsigned long count)
+{
+    Free_run **link = &store->free_runs, *run, *rest;
+    
+    /* Find the free run containing start. */
+    while (*link != NULL && (*link)->start + (*link)->count <= start)
+        link = &(*link)->next;
+    run = *link;
+    if (run == NULL || run->start > start || 
+        run->start + run->count < start + count)
+        return 0;
+    
+    /* Cut the range out of the run, splitting it if the range is in the
+     * middle. */
+    if (run->start + run->count > start + count && run->start < start)
+    {
+        rest = arena_alloc(store->arena, sizeof(Free_run));
+        rest->start = start + count;
+        rest->count = run->start + run->count - rest->start;
+        rest->next = run->next;
+        run->next = rest;
+        run->count = start - run->start;
+    }
+    else if (run->start == start)
+    {
+        run->start += count;
+        run->count -= count;
+        if (run->count == 0)
+        {
+            *link = run->next;
+            arena_free(store->arena, run, sizeof(Free_run));
+        }
+    }
+    else
+        run->count -= count;
+    return 1;
+}
+
+static void blocks_alloc(Block_store *store, unsigned long want, 
+                         unsigned long *start, unsigned long *count)
+{
+    Free_run *run, *best = NULL;
+    char ***page;
+    
+    if (want > CHUNK_BLOCKS)
+        want = CHUNK_BLOCKS;
+    
+    /* First fit, falling back to the largest run if none is big enough. Runs
+     * are only merged within a chunk, so a free run never crosses one. */
+    for (run = store->free_runs; run != NULL; run = run->next)
+    {
+        if (run->count >= want)
+        {
+            best = run;
+            break;
+        }
+        if (best == NULL || run->count > best->count)
+            best = run;
+    }
+    
+    /* Add a chunk if nothing free is big enough. */
+    if (best == NULL || best->count < want)
+    {
+        if (store->chunk_count == (unsigned long) CHUNK_PAGES * CHUNK_PAGE)
+        {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        page = &store->chunks[store->chunk_count / CHUNK_PAGE];
+        if (*page == NULL)
+            *page = arena_alloc(store->arena, CHUNK_PAGE * sizeof(char *));
+        (*page)[store->chunk_count % CHUNK_PAGE] = 
+            arena_alloc(store->arena, CHUNK_BLOCKS * BLOCK_SIZE);
+        blocks_free(store, store->chunk_count * CHUNK_BLOCKS, CHUNK_BLOCKS);
+        store->chunk_count++;
+        
+        for (best = store->free_runs; best->next != NULL; best = best->next)
+            ;
+    }
+    
+    *start = best->start;
+    *count = best->count < want ? best->count : want;
+    blocks_take(store, *start, *count);
+}
+
+static void blocks_free(Block_store *store, unsigned long start, 
+                        unsigned long count)
+{
+    Free_run **link = &store->free_runs, *run, *prev = NULL;
+    
+    if (count == 0)
+        return;
+    while (*link != NULL && (*link)->start < start)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    
+    /* Merge with the run before and after when they touch and are in the 
+     * same chunk. */
+    if (prev != NULL && prev->start + prev->count == start &&
+        prev->start / CHUNK_BLOCKS == start / CHUNK_BLOCKS)
+    {
+        prev->count += count;
+        run = prev;
+    }
+    else
+    {
+        run = arena_alloc(store->arena, sizeof(Free_run));
+        run->start = start;
+        run->count = count;
+        run->next = *link;
+        *link = run;
+    }
+    
+    if (run->next != NULL && run->start + run->count == run->next->start &&
+        run->start / CHUNK_BLOCKS == run->next->start / CHUNK_BLOCKS)
+    {
+        prev = run->next;
+        run->count += prev->count;
+        run->next = prev->next;
+        arena_free(store->arena, prev, sizeof(Free_run));
+    }
+}
+
+static void file_reserve(Block_store *store, File *file, unsigned long blocks)
+{
+    Extent *last, *extents;
+    unsigned long need, room, start, count;
+    
+    mutex_lock(&store->lock);
+    while (file->blocks < blocks)
+    {
+        need = blocks - file->blocks;
+        
+        /* Grow the last extent in place, as far as its chunk allows. */
+        if (file->extent_count > 0)
+        {
+            last = &file->extents[file->extent_count - 1];
+            room = (last->start + last->count) % CHUNK_BLOCKS;
+            if (room > 0)
+                room = CHUNK_BLOCKS - room;
+            if (room > need)
+                room = need;
+            if (room > 0 && blocks_take(store, last->start + last->count, room))
+            {
+                last->count += room;
+                file->blocks += room;
+                continue;
+            }
+        }
+        
+        /* Otherwise start a new extent. */
+        blocks_alloc(store, need, &start, &count);
+        if (file->extent_count == file->extent_cap)
+        {
+            extents = arena_alloc(store->arena, (file->extent_cap * 2 + 1) * 
+                                  sizeof(Extent));
+            if (file->extent_count > 0)
+                memcpy(extents, file->extents, 
+                       file->extent_count * sizeof(Extent));
+            arena_free(store->arena, file->extents, 
+                       file->extent_cap * sizeof(Extent));
+            file->extents = extents;
+            file->extent_cap = file->extent_cap * 2 + 1;
+        }
+        file->extents[file->extent_count].start = start;
+        file->extents[file->extent_count].count = count;
+        file->extent_count++;
+        file->blocks += count;
+    }
+    mutex_unlock(&store->lock);
+}
+
+static void file_unshare(Block_store *store, File *file, size_t len)
+{
+    const char *mapped = file->mapped;
+    File shared;
+    
+    if (len > file->size)
+        len = file->size;
+    if (mapped != NULL)
+    {
+        file->mapped = NULL;
+        file->size = 0;
+        file_write(store, file, 0, mapped, len);
+        return;
+    }
+    if (file->refs == NULL)
+        return;
+    
+    /* A file left alone with its extents keeps them. Otherwise they are only
+     * let go of once copied, since whichever file is then left alone with 
+     * them may change them in place. */
+    mutex_lock(&store->lock);
+    if (*file->refs == 1)
+    {
+        mutex_unlock(&store->lock);
+        arena_free(store->arena, file->refs, sizeof(unsigned long));
+        file->refs = NULL;
+        return;
+    }
+    mutex_unlock(&store->lock);
+    
+    shared = *file;
+    file_init(file);
+    file_fill(store, file, &shared, len);
+    file_release(store, &shared);
+}
+
+static void file_fill(Block_store *store, File *file, const File *from, 
+                      size_t size)
+{
+    size_t done = 0, len;
+    unsigned long i;
+    
+    file_reserve(store, file, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    for (i = 0; i < from->extent_count && done < size; i++)
+    {
+        len = from->extents[i].count * BLOCK_SIZE;
+        if (len > size - done)
+            len = size - done;
+        file_write(store, file, done, 
+                   block_data(store, from->extents[i].start), len);
+        done += len;
+    }
+}
+
+static void file_copy(Block_store *store, const File *file, size_t offset, 
+                      char *buf, size_t len, Copy_mode mode)
+{
+    size_t extent_start = 0, extent_bytes, skip, n;
+    unsigned long i;
+    char *data;
+    
+    for (i = 0; i < file->extent_count && len > 0; i++)
+    {
+        extent_bytes = file->extents[i].count * BLOCK_SIZE;
+        if (offset < extent_start + extent_bytes)
+        {
+            /* The extent's blocks are contiguous, so its part of the range
+             * is copied in one go. */
+            skip = offset - extent_start;
+            n = extent_bytes - skip < len ? extent_bytes - skip : len;
+            data = block_data(store, file->extents[i].start) + skip;
+            
+            if (mode == COPY_IN)
+                memcpy(data, buf, n);
+            else if (mode == COPY_OUT)
+                memcpy(buf, data, n);
+            else
+                memset(data, 0, n);
+            
+            if (buf != NULL)
+                buf += n;
+            offset += n;
+            len -= n;
+        }
+        extent_start += extent_bytes;
+    }
+}
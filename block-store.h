@@ -0,0 +1,53 @@
+#ifndef _block_store_h
+#define _block_store_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+/* File contents are stored in blocks of BLOCK_SIZE bytes. Blocks are carved
+ * out of chunks of CHUNK_BLOCKS contiguous blocks, and a run of blocks never
+ * crosses a chunk, so every extent of a file is one contiguous piece of 
+ * memory. */
+#define BLOCK_SIZE 4096
+#define CHUNK_BLOCKS 256
+
+/* Chunks are found through a table of pages of CHUNK_PAGE chunk pointers, 
+ * which, unlike one growing array, never moves. This allows for CHUNK_PAGES
+ * pages, a terabyte of blocks. */
+#define CHUNK_PAGE 512
+#define CHUNK_PAGES 2048
+
+/* A run of free blocks. The free runs are kept sorted by block number, and
+ * adjacent runs are merged when blocks are freed. */
+typedef struct free_run
+{
+    unsigned long start;
+    unsigned long count;
+    struct free_run *next;
+}Free_run;
+
+/* The block pool of one filesystem. All of its memory comes from the 
+ * filesystem's arena. The lock guards the free runs, adding chunks, and the
+ * counts of files sharing extents; the blocks of a file are only read or 
+ * written under the lock of the directory the file is in, shared blocks are
+ * never written, and the chunk table is never moved, so copying data needs
+ * no lock of the store's. */
+typedef struct block_store
+{
+    struct arena *arena;
+    char **chunks[CHUNK_PAGES];
+    unsigned long chunk_count;
+    Free_run *free_runs;
+    Mutex lock;
+}Block_store;
+
+Block_store *blocks_new(struct arena *);
+void file_init(File *);
+void file_map(File *, const char *, size_t);
+void file_write(Block_store *, File *, size_t, const char *, size_t);
+size_t file_read(Block_store *, const File *, size_t, char *, size_t);
+void file_truncate(Block_store *, File *, size_t);
+void file_release(Block_store *, File *);
+void file_clone(Block_store *, File *, File *);
+
+#endif
@@ -1,79 +1,384 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "filesystem.h"
+#include "trace.h"
 #include "memory-checking.h"
 
 /* This driver uses some features of C I/O that won't be explained in the
  * course.  You don't need to read or to understand this code (unless you
  * want to).
  *
- * Note that it imposes a limit of 511 characters for an input line, and 80
- * characters for any individual argument.  These limits are NOT part of
- * your code- the project does not specify any maximum length for an
- * argument- but are just part of this driver.
+ * Input is read in large blocks and split into lines and arguments in
+ * place, so there is no limit on the length of a line or of an argument.
+ * All output, including what the filesystem functions print, goes through
+ * one large stdout buffer, which is flushed whenever the driver has to wait
+ * for more input.
  *
  * Lastly note that the project tests may or may not use this driver (or
  * some may and some might not).
  */
 
-#define LINE_MAX 512
-#define WORD_MAX (80 + 1)
-
-static int command_idx(char name[]);
+#define INPUT_SIZE (64 * 1024)
+#define OUTPUT_SIZE (1024 * 1024)
+#define PROMPT "% "
+
+/* how many of the latest calls "trace on" keeps */
+#define TRACE_EVENTS 65536
+
+/* the input buffer: the bytes from start up to end have been read but not
+   yet used, and eof is set once there is nothing more to read */
+typedef struct {
+  char *buf;
+  size_t size, start, end;
+  int eof;
+} Input;
+
+/* one line of the output of ls -R: either the heading of a directory,
+   whose full path is all of path, or an entry of the directory named by
+   the first dir_len characters of path, whose own name starts at name */
+typedef struct {
+  char *path;
+  size_t dir_len, name;
+  int is_dir;
+} Listed;
+
+/* the lines of ls -R, collected (under lock, since the walk may report
+   entries from several threads at once) and then sorted */
+typedef struct {
+  Listed *lines;
+  size_t count, cap;
+  pthread_mutex_t lock;
+} Listing;
+
+static int command_idx(const char name[], size_t length);
+static int next_line(Input *input, char **line, size_t *length);
+static int split_line(char line[], size_t length, char *words[]);
+static void print3(const char first[], const char second[],
+                   const char third[]);
+static void print_path(void *context, const char path[], int is_dir);
+static void add_line(Listing *listing, const char path[], size_t dir_len,
+                     size_t name, int is_dir);
+static void collect(void *context, const char path[], int is_dir);
+static int compare_lines(const void *first, const void *second);
+static int list_recursively(Filesystem filesystem, const char arg[],
+                            int threads);
+static void print_stats(Filesystem filesystem);
 
 /* these are all the commands the driver recognizes, which include a few that
    are not functions appearing in filesystem.h */
 enum COMMANDS {LOGOUT, EXIT, MKFS, TOUCH, MKDIR, CD, LS, PWD, RM, RENAME, RMFS,
-               SET, UNSET} commands;
+               SET, UNSET, FIND, DU, STATS, TRACE, CP, MV, LOAD,
+               SNAP} commands;
 static char *command_names[]= {"logout", "exit", "mkfs", "touch", "mkdir",
                                "cd", "ls", "pwd", "rm", "rename", "rmfs",
-                               "set", "unset"};
+                               "set", "unset", "find", "du", "stats",
+                               "trace", "cp", "mv", "load", "snap"};
+
+/* the names stats prints for the operations the filesystem counts, in the
+   order of Stat_op */
+static char *stat_names[STAT_OPS]= {"touch", "mkdir", "cd", "ls", "pwd",
+                                    "walk", "du", "complete", "rm",
+                                    "re_name", "write_file", "read_file",
+                                    "append_file", "truncate_file", "copy",
+                                    "move", "open_dir", "read_dir",
+                                    "snapshot"};
+
+/* stdout's buffer */
+static char output[OUTPUT_SIZE];
 
 /* convert command names to indices that match the value of one of the enum
    constants in COMMANDS; an unrecognized command name results in -1 being
-   returned */
-static int command_idx(char name[]) {
-  int i= 0, pos= -1;
-
-  while (i < sizeof(command_names) / sizeof(command_names[0]) && pos == -1)
-    if (strcmp(name, command_names[i]) == 0)
-      pos= i;
-    else i++;
+   returned.  The length and first letter (or two) of a name single out
+   the only command it can be, so just that one is compared. */
+static int command_idx(const char name[], size_t length) {
+  int pos= -1;
+
+  switch (length) {
+    case 2: pos= name[0] == 'c' ? (name[1] == 'd' ? CD : CP)
+                 : name[0] == 'l' ? LS
+                 : name[0] == 'd' ? DU : name[0] == 'm' ? MV : RM;
+            break;
+    case 3: pos= name[0] == 'p' ? PWD : SET;
+            break;
+    case 4: pos= name[0] == 'e' ? EXIT : name[0] == 'f' ? FIND
+                 : name[0] == 'l' ? LOAD : name[0] == 's' ? SNAP
+                 : name[1] == 'k' ? MKFS : RMFS;
+            break;
+    case 5: pos= name[0] == 't' ? (name[1] == 'o' ? TOUCH : TRACE)
+                 : name[0] == 'm' ? MKDIR : name[0] == 's' ? STATS : UNSET;
+            break;
+    case 6: pos= name[0] == 'l' ? LOGOUT : RENAME;
+            break;
+    default: return -1;
+  }
 
-  /* returns -1 if the command name was not found */
+  if (memcmp(name, command_names[pos], length) != 0)
+    pos= -1;
   return pos;
 }
 
+/* find the next line of input, reading more as needed, and store where it
+   starts and its length (including its newline, if it has one); 0 is
+   returned once there are no more lines.  A line and the byte after it may
+   be changed by the caller until the next call. */
+static int next_line(Input *input, char **line, size_t *length) {
+  char *newline;
+  ssize_t count;
+
+  while (1) {
+    newline= memchr(input->buf + input->start, '\n',
+                    input->end - input->start);
+
+    if (newline != NULL || (input->eof && input->start < input->end)) {
+      *line= input->buf + input->start;
+      *length= newline != NULL ? (size_t) (newline - *line) + 1
+                               : input->end - input->start;
+      input->start+= *length;
+      return 1;
+    }
+    if (input->eof)
+      return 0;
+
+    /* move the partial line to the front, making room for it to grow if it
+       fills the whole buffer (one byte past the end is always kept free) */
+    memmove(input->buf, input->buf + input->start, input->end - input->start);
+    input->end-= input->start;
+    input->start= 0;
+    if (input->end == input->size) {
+      input->buf= realloc(input->buf, input->size * 2 + 1);
+      if (input->buf == NULL) {
+        printf("Memory allocation failed!\n");
+        exit(1);
+      }
+      input->size*= 2;
+    }
+
+    /* whatever has been printed so far is shown before waiting for input */
+    fflush(stdout);
+    count= read(STDIN_FILENO, input->buf + input->end,
+                input->size - input->end);
+    if (count <= 0)
+      input->eof= 1;
+    else input->end+= count;
+  }
+}
+
+/* split a line into words separated by whitespace, terminating each one in
+   place; the first three are stored and the number of words is returned */
+static int split_line(char line[], size_t length, char *words[]) {
+  size_t i= 0;
+  int count= 0;
+
+  while (i < length) {
+    if (isspace((unsigned char) line[i])) {
+      i++;
+      continue;
+    }
+
+    if (count < 3)
+      words[count]= line + i;
+    count++;
+    while (i < length && !isspace((unsigned char) line[i]))
+      i++;
+    line[i++]= '\0';  /* may be the byte after the line */
+  }
+
+  return count;
+}
+
+static void print3(const char first[], const char second[],
+                   const char third[]) {
+  fputs(first, stdout);
+  fputs(second, stdout);
+  fputs(third, stdout);
+}
+
+/* print one path found by find; a single printf() keeps the lines of
+   different threads apart */
+static void print_path(void *context, const char path[], int is_dir) {
+  printf("%s\n", path);
+}
+
+static void add_line(Listing *listing, const char path[], size_t dir_len,
+                     size_t name, int is_dir) {
+  Listed *line;
+
+  if (listing->count == listing->cap) {
+    listing->cap= listing->cap == 0 ? 64 : listing->cap * 2;
+    listing->lines= realloc(listing->lines, listing->cap * sizeof(Listed));
+    if (listing->lines == NULL) {
+      printf("Memory allocation failed!\n");
+      exit(1);
+    }
+  }
+
+  line= &listing->lines[listing->count++];
+  line->path= malloc(strlen(path) + 1);
+  if (line->path == NULL) {
+    printf("Memory allocation failed!\n");
+    exit(1);
+  }
+  strcpy(line->path, path);
+  line->dir_len= dir_len;
+  line->name= name;
+  line->is_dir= is_dir;
+}
+
+/* record one path found by ls -R: a directory gets a heading of its own,
+   and everything but the directory being listed is an entry of the
+   directory it is in (the root being the only one whose path ends in /) */
+static void collect(void *context, const char path[], int is_dir) {
+  Listing *listing= context;
+  size_t length= strlen(path), slash= length;
+
+  while (slash > 0 && path[slash - 1] != '/')
+    slash--;
+
+  pthread_mutex_lock(&listing->lock);
+  if (listing->count > 0 || !is_dir)
+    add_line(listing, path, slash > 1 ? slash - 1 : 1, slash, is_dir);
+  if (is_dir)
+    add_line(listing, path, length, length, 1);
+  pthread_mutex_unlock(&listing->lock);
+}
+
+/* order the lines of ls -R by directory, comparing paths a component at a
+   time (so a directory's sub directories follow it directly), with each
+   heading first and then the entries by name */
+static int compare_lines(const void *first, const void *second) {
+  const Listed *a= first, *b= second;
+  size_t i;
+  int x, y;
+
+  for (i= 0; i < a->dir_len && i < b->dir_len; i++) {
+    x= a->path[i] == '/' ? 0 : (unsigned char) a->path[i] + 1;
+    y= b->path[i] == '/' ? 0 : (unsigned char) b->path[i] + 1;
+    if (x != y)
+      return x - y;
+  }
+  if (a->dir_len != b->dir_len)
+    return a->dir_len < b->dir_len ? -1 : 1;
+  return strcmp(a->path + a->name, b->path + b->name);
+}
+
+/* list a directory and everything below it, a directory at a time, like
+   ls -R; -1 is returned if arg does not exist */
+static int list_recursively(Filesystem filesystem, const char arg[],
+                            int threads) {
+  Listing listing;
+  Listed *line;
+  size_t i;
+  int result;
+
+  listing.lines= NULL;
+  listing.count= listing.cap= 0;
+  pthread_mutex_init(&listing.lock, NULL);
+  result= walk(filesystem, arg, collect, &listing, threads);
+  pthread_mutex_destroy(&listing.lock);
+
+  if (listing.count > 0)
+    qsort(listing.lines, listing.count, sizeof(Listed), compare_lines);
+  for (i= 0; i < listing.count; i++) {
+    line= &listing.lines[i];
+    if (listing.count == 1 && !line->is_dir)
+      printf("%s\n", arg);  /* a file is listed as it was named */
+    else if (line->path[line->name] == '\0') {
+      if (i > 0)
+        putchar('\n');
+      fwrite(line->path, 1, line->dir_len, stdout);
+      fputs(":\n", stdout);
+    }
+    else printf("%s%s\n", line->path + line->name, line->is_dir ? "/" : "");
+    free(line->path);
+  }
+  free(listing.lines);
+
+  return result;
+}
+
+/* print what fs_stats() reports: the calls of each operation that has been
+   called and the errors they returned, then the totals */
+static void print_stats(Filesystem filesystem) {
+  Stats stats;
+  int op, code;
+
+  fs_stats(filesystem, &stats);
+  for (op= 0; op < STAT_OPS; op++) {
+    if (stats.ops.calls[op] == 0)
+      continue;
+    printf("%-14s %lu calls", stat_names[op], stats.ops.calls[op]);
+    for (code= 0; code < STAT_CODES; code++)
+      printf(", %lu x %d", stats.ops.errors[op][code], -code - 1);
+    putchar('\n');
+  }
+  printf("%lu entries scanned, %lu names compared\n", stats.ops.scanned,
+         stats.ops.compares);
+  printf("%lu files, %lu directories, %lu index nodes\n", stats.files,
+         stats.dirs, stats.children);
+  printf("%lu bytes allocated, %lu freed, %lu in use\n", stats.allocated,
+         stats.freed, stats.allocated - stats.freed);
+  printf("%lu bytes reserved, %lu at most\n", stats.reserved, stats.peak);
+  printf("%lu long names pooled for %lu entries in %lu bytes (%lu as "
+         "copies)\n", stats.names, stats.name_refs, stats.name_bytes,
+         stats.name_copy_bytes);
+}
+
 int main() {
   Filesystem filesystem;
-  char line[LINE_MAX]= "", command[WORD_MAX]= "", temp[WORD_MAX],
-       arg1[WORD_MAX]= "", arg2[WORD_MAX]= "", prompt[WORD_MAX]= "%";
-  int verbose= 0, length= 0, num_matched= 0, argument_error, done= 0;
-
+  Tracer *tracer= NULL;
+  Input input;
+  char *line, *words[3], *command, *arg1, *arg2;
+  Usage usage;
+  size_t length;
+  int verbose= 0, num_matched= 0, argument_error, done= 0, threads;
+
+  setvbuf(stdout, output, _IOFBF, sizeof(output));
   setup_memory_checking();
 
-  printf("%s ", prompt);
-  /* continue reading lines until the end of the input */
-  while (!done && fgets(line, sizeof(line) - sizeof(*line), stdin) != NULL) {
+  input.buf= malloc(INPUT_SIZE + 1);
+  if (input.buf == NULL) {
+    printf("Memory allocation failed!\n");
+    exit(1);
+  }
+  input.size= INPUT_SIZE;
+  input.start= input.end= 0;
+  input.eof= 0;
 
-    temp[0]= '\0';
-    sscanf(line, "%[ \t\n]%n", temp, &length);
+  /* find and ls -R walk the filesystem with a thread per processor */
+  threads= (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads= 1;
+
+  fputs(PROMPT, stdout);
+  /* continue reading lines until the end of the input */
+  while (!done && next_line(&input, &line, &length)) {
 
-    if (strcmp(temp, "") != 0 && length == strlen(temp))
-      printf("%s ", prompt);  /* ignore empty input lines */
+    if (line[0] == ' ' || line[0] == '\t' || line[0] == '\n')
+      fputs(PROMPT, stdout);  /* ignore lines starting with whitespace */
 
       else {
 
-        /* num_matched is the number of format specifiers that were matched */
-        num_matched= sscanf(line, "%s %s %s %s", command, arg1, arg2, temp);
         if (verbose == 1)
-          printf("%s", line);
+          fwrite(line, 1, length, stdout);
+
+        /* num_matched is the number of words on the line; missing
+           arguments are empty strings */
+        num_matched= split_line(line, length, words);
+        command= num_matched > 0 ? words[0] : "";
+        arg1= num_matched > 1 ? words[1] : "";
+        arg2= num_matched > 2 ? words[2] : "";
 
         /* argument_error will be 1 if the wrong number of arguments are
            given for any command */
         argument_error= 0;
 
-        switch(command_idx(command)) {
+        switch(command_idx(command, strlen(command))) {
 
           case LOGOUT:
           case EXIT:
@@ -86,8 +391,28 @@ int main() {
           /* call mkfs() if the line began with "mkfs" with no following
              arguments */
           case MKFS:
-            if (num_matched == 1)
+            if (num_matched == 1) {
               mkfs(&filesystem);
+              if (tracer != NULL)
+                fs_trace(filesystem, tracer);  /* keep tracing */
+            }
+            else argument_error= 1;
+            break;
+
+          /* call build_fs() if the line began with "load" and had one
+             following argument, the name of a manifest; if build_fs()
+             returns -1 or -2 print an appropriate error message */
+          case LOAD:
+            if (num_matched == 2) {
+              switch (build_fs(&filesystem, arg1)) {
+                case -1: print3(arg1, ": Cannot read manifest.\n", "");
+                         break;
+                case -2: print3(arg1, ": Some paths were left out.\n", "");
+                         /* the rest were loaded */
+                default: if (tracer != NULL)
+                           fs_trace(filesystem, tracer);  /* keep tracing */
+              }
+            }
             else argument_error= 1;
             break;
 
@@ -99,7 +424,7 @@ int main() {
               argument_error= 1;
             else
               if (touch(&filesystem, arg1) == -1)
-                printf("Missing or invalid operand.\n");
+                fputs("Missing or invalid operand.\n", stdout);
             break;
 
           /* call mkdir() if the line began with "mkdir" and had one
@@ -110,10 +435,10 @@ int main() {
               argument_error= 1;
             else
               switch (mkdir(&filesystem, arg1)) {
-                case -1: printf("Missing or invalid operand.\n");
+                case -1: fputs("Missing or invalid operand.\n", stdout);
                          break;
-                case -2: printf("Cannot create directory %s: File exists.\n",
-                                arg1);
+                case -2: print3("Cannot create directory ", arg1,
+                                ": File exists.\n");
                          break;
                 default: break;  /* no-op; 0 return is expected */
               }
@@ -127,9 +452,9 @@ int main() {
               argument_error= 1;
             else
               switch (cd(&filesystem, arg1)) {
-                case -1: printf("%s: No such file or directory.\n", arg1);
+                case -1: print3(arg1, ": No such file or directory.\n", "");
                          break;
-                case -2: printf("%s: Not a directory.\n", arg1);
+                case -2: print3(arg1, ": Not a directory.\n", "");
                          break;
                 default: break;  /* no-op; 0 return is expected */
               }
@@ -137,13 +462,21 @@ int main() {
 
           /* call ls() if the line began with "ls" and had one following
              argument; if ls() returns -1 print an appropriate error
-             message */
+             message.  "ls -R", with or without an argument after it,
+             lists everything below its argument too, using walk() */
           case LS:
-            if (num_matched != 1 && num_matched != 2)
+            if (num_matched > 1 && strcmp(arg1, "-R") == 0) {
+              if (num_matched > 3)
+                argument_error= 1;
+              else
+                if (list_recursively(filesystem, arg2, threads) == -1)
+                  print3(arg2, ": No such file or directory.\n", "");
+            }
+            else if (num_matched != 1 && num_matched != 2)
               argument_error= 1;
             else
               if (ls(filesystem, arg1) == -1)
-                printf("%s: No such file or directory.\n", arg1);
+                print3(arg1, ": No such file or directory.\n", "");
             break;
 
           /* call pwd() if the line began with "pwd" with no following
@@ -162,11 +495,11 @@ int main() {
               argument_error= 1;
             else
               switch (rm(&filesystem, arg1)) {
-                case -1: printf("%s: No such file or directory.\n", arg1);
+                case -1: print3(arg1, ": No such file or directory.\n", "");
                          break;
-                case -2: printf("Cannot remove directory '%s'.\n", arg1);
+                case -2: print3("Cannot remove directory '", arg1, "'.\n");
                          break;
-                case -3: printf("Missing or invalid operand.\n");
+                case -3: fputs("Missing or invalid operand.\n", stdout);
                          break;
                 default: break;  /* no-op; 0 return is expected */
               }
@@ -180,14 +513,81 @@ int main() {
               argument_error= 1;
             else
               switch (re_name(&filesystem, arg1, arg2)) {
-                case -1: printf("%s: No such file or directory.\n", arg1);
+                case -1: print3(arg1, ": No such file or directory.\n", "");
                          break;
-                case -2: printf("Missing or invalid operand.\n");
+                case -2: fputs("Missing or invalid operand.\n", stdout);
                          break;
-                case -3: printf("File or directory %s already exists.\n",
-                                arg1);
+                case -3: print3("File or directory ", arg1,
+                                " already exists.\n");
                          break;
-                case -4: printf("%s and %s are the same file.\n", arg1, arg2);
+                case -4: print3(arg1, " and ", arg2);
+                         fputs(" are the same file.\n", stdout);
+                         break;
+                default: break;  /* no-op; 0 return is expected */
+              }
+            break;
+
+          /* call copy() if the line began with "cp" with two following
+             arguments; if it returns an error code (-1 through -4) print
+             an appropriate error message */
+          case CP:
+            if (num_matched != 3)
+              argument_error= 1;
+            else
+              switch (copy(&filesystem, arg1, arg2)) {
+                case -1: print3("Cannot copy ", arg1, " to ");
+                         print3(arg2, ": No such file or directory.\n", "");
+                         break;
+                case -2: fputs("Missing or invalid operand.\n", stdout);
+                         break;
+                case -3: print3("File or directory ", arg2,
+                                " already exists.\n");
+                         break;
+                case -4: print3("Cannot copy ", arg1, " into itself.\n");
+                         break;
+                default: break;  /* no-op; 0 return is expected */
+              }
+            break;
+
+          /* call move() if the line began with "mv" with two following
+             arguments; if it returns an error code (-1 through -5) print
+             an appropriate error message */
+          case MV:
+            if (num_matched != 3)
+              argument_error= 1;
+            else
+              switch (move(&filesystem, arg1, arg2)) {
+                case -1: print3("Cannot move ", arg1, " to ");
+                         print3(arg2, ": No such file or directory.\n", "");
+                         break;
+                case -2: fputs("Missing or invalid operand.\n", stdout);
+                         break;
+                case -3: print3("File or directory ", arg2,
+                                " already exists.\n");
+                         break;
+                case -4: print3("Cannot move ", arg1, " into itself.\n");
+                         break;
+                case -5: print3("Cannot move directory '", arg1, "'.\n");
+                         break;
+                default: break;  /* no-op; 0 return is expected */
+              }
+            break;
+
+          /* call snapshot() if the line began with "snap" with one
+             following argument; if it returns an error code (-1 through
+             -3) print an appropriate error message */
+          case SNAP:
+            if (num_matched != 2)
+              argument_error= 1;
+            else
+              switch (snapshot(&filesystem, arg1)) {
+                case -1: print3("Cannot make snapshot ", arg1,
+                                ": No such file or directory.\n");
+                         break;
+                case -2: fputs("Missing or invalid operand.\n", stdout);
+                         break;
+                case -3: print3("File or directory ", arg1,
+                                " already exists.\n");
                          break;
                 default: break;  /* no-op; 0 return is expected */
               }
@@ -217,27 +617,80 @@ int main() {
             else argument_error= 1;
             break;
 
+          /* call walk() if the line began with "find", with or without
+             one following argument, printing the full path of everything
+             found, in no particular order; if walk() returns -1 print an
+             appropriate error message */
+          case FIND:
+            if (num_matched != 1 && num_matched != 2)
+              argument_error= 1;
+            else
+              if (walk(filesystem, arg1, print_path, NULL, threads) == -1)
+                print3(arg1, ": No such file or directory.\n", "");
+            break;
+
+          /* call du() if the line began with "du", with or without one
+             following argument, and print what is below it; if du()
+             returns -1 print an appropriate error message */
+          case DU:
+            if (num_matched != 1 && num_matched != 2)
+              argument_error= 1;
+            else
+              if (du(filesystem, arg1, &usage) == -1)
+                print3(arg1, ": No such file or directory.\n", "");
+              else printf("%lu files, %lu directories, %lu bytes of names, "
+                          "%lu levels\n", usage.files, usage.dirs,
+                          usage.name_bytes, usage.depth);
+            break;
+
+          /* call print_stats() if the line was just "stats" */
+          case STATS:
+            if (num_matched == 1)
+              print_stats(filesystem);
+            else argument_error= 1;
+            break;
+
+          /* "trace on" starts recording the latest calls, "trace off"
+             stops and forgets them, and "trace" followed by anything else
+             writes those recorded so far to that file as a Chrome trace;
+             print an appropriate error message if it cannot be written */
+          case TRACE:
+            if (num_matched != 2)
+              argument_error= 1;
+            else if (strcmp(arg1, "on") == 0) {
+              if (tracer == NULL) {
+                tracer= trace_new(TRACE_EVENTS);
+                fs_trace(filesystem, tracer);
+              }
+            } else if (strcmp(arg1, "off") == 0) {
+              fs_trace(filesystem, NULL);
+              trace_free(tracer);
+              tracer= NULL;
+            } else if (tracer == NULL)
+              fputs("Tracing is off.\n", stdout);
+            else if (trace_dump(tracer, arg1) == -1)
+              print3(arg1, ": Cannot write trace.\n", "");
+            break;
+
           /* error message for a command not matching one of the function
              names */
-          default: printf("%s: Command not found.\n", command);
+          default: print3(command, ": Command not found.\n", "");
             break;
         }
 
         /* error message for a command with the wrong number of arguments */
         if (argument_error)
-          printf("Invalid arguments.\n");
+          fputs("Invalid arguments.\n", stdout);
 
         if (verbose == 1)
-          printf("\n");
-        printf("%s ", prompt);
-
-        /* sscanf() will fail if the line read is empty, in which case the
-           prior command will be executed again unless it's first cleared
-           out */
-        arg1[0]= arg2[0]= command[0]= '\0';
+          putchar('\n');
+        fputs(PROMPT, stdout);
       }
   }
 
+  trace_free(tracer);
+  free(input.buf);
+  fflush(stdout);
   check_memory_leak();
 
   return 0;
@@ -0,0 +1,158 @@
+/*******************************************************************************
+ *  Epoch based reclamation, which lets threads look through a tree without   *
+ *  taking any of its locks. Every operation runs inside an epoch: on the way *
+ *  in its session records the tree's current epoch, and on the way out it    *
+ *  clears it again, both stores to memory that no other session writes.      *
+ *  Whatever is taken out of the tree while other threads may still be        *
+ *  looking at it is retired instead of freed, and freed once the tree's      *
+ *  epoch has moved on twice, by which time every thread that could have      *
+ *  reached it has left. The epoch only moves on when every session inside    *
+ *  one has reached the current epoch.                                         *
+ ******************************************************************************/
+
+#include <stddef.h>
+#include "epoch.h"
+#include "arena.h"
+
+/* Moves the tree's epoch on if every session inside an epoch is in the
+ * current one, then frees the objects retired by the session, and those left
+ * by ended sessions, that no thread can reach any more. */
+static void reclaim(Tree *, Session *);
+
+/* Frees every object on a list, returning how many there were. */
+static unsigned long release_all(Tree *, Retired *);
+
+/* Records that the session is looking into the tree. The record must be seen
+ * before anything in the tree is read: a thread moving the epoch on either
+ * sees it, or has already made whatever it retired unreachable. */
+void epoch_enter(Tree *tree, Session *session)
+{
+    __atomic_store_n(&session->epoch, LOAD(tree->epoch), __ATOMIC_RELAXED);
+    FENCE();
+}
+
+/* Records that the session has let go of everything it found in the tree,
+ * and frees what it has retired once enough has built up. */
+void epoch_leave(Tree *tree, Session *session)
+{
+    PUBLISH(session->epoch, 0);
+    if (session->retired_count >= session->reclaim_at)
+    {
+        reclaim(tree, session);
+        session->reclaim_at = session->retired_count + EPOCH_BATCH;
+    }
+}
+
+/* Frees an object, which the session has just made unreachable from the
+ * tree, once no other thread can still be looking at it. */
+void epoch_retire(Tree *tree, Session *session, Release release, void *object,
+                  size_t size)
+{
+    Retired *retired = arena_alloc(tree->arena, sizeof(Retired));
+    
+    /* Unlinking the object comes before reading the epoch it retires in. */
+    FENCE();
+    retired->epoch = LOAD(tree->epoch);
+    retired->release = release;
+    retired->object = object;
+    retired->size = size;
+    retired->next = session->retired;
+    session->retired = retired;
+    session->retired_count++;
+}
+
+/* Frees an object, which has just been made unreachable from the tree, once
+ * no thread can still be looking at it, like epoch_retire() but for a caller
+ * with no session of its own, such as a Release freeing what held it. The
+ * object goes straight to the tree, for any session to free. */
+void epoch_defer(Tree *tree, Release release, void *object, size_t size)
+{
+    Retired *retired = arena_alloc(tree->arena, sizeof(Retired));
+    
+    FENCE();
+    retired->epoch = LOAD(tree->epoch);
+    retired->release = release;
+    retired->object = object;
+    retired->size = size;
+    mutex_lock(&tree->sessions_lock);
+    retired->next = tree->orphans;
+    tree->orphans = retired;
+    mutex_unlock(&tree->sessions_lock);
+}
+
+/* Hands the objects a session has retired to the tree, for other sessions
+ * to free, when the session ends. The caller holds the tree's
+ * sessions_lock. */
+void epoch_orphan(Tree *tree, Session *session)
+{
+    Retired *last;
+    
+    if (session->retired == NULL)
+        return;
+    for (last = session->retired; last->next != NULL; last = last->next)
+        ;
+    last->next = tree->orphans;
+    tree->orphans = session->retired;
+    session->retired = NULL;
+    session->retired_count = 0;
+}
+
+static void reclaim(Tree *tree, Session *session)
+{
+    Session *s;
+    Retired **link, *item, *ready = NULL;
+    unsigned long epoch, active;
+    
+    mutex_lock(&tree->sessions_lock);
+    epoch = tree->epoch;
+    FENCE();
+    for (s = tree->sessions; s != NULL; s = s->next)
+    {
+        active = LOAD(s->epoch);
+        if (active != 0 && active != epoch)
+            break;
+    }
+    if (s == NULL)
+        PUBLISH(tree->epoch, ++epoch);
+    
+    /* Every thread still looking at an object retired two epochs ago has
+     * left since. */
+    link = &tree->orphans;
+    while ((item = *link) != NULL)
+    {
+        if (item->epoch + 2 <= epoch)
+        {
+            *link = item->next;
+            item->next = ready;
+            ready = item;
+        }
+        else
+            link = &item->next;
+    }
+    mutex_unlock(&tree->sessions_lock);
+    release_all(tree, ready);
+    
+    /* The session's own list is newest first, so it can be cut at the first
+     * object that is old enough. */
+    for (link = &session->retired; *link != NULL; link = &(*link)->next)
+        if ((*link)->epoch + 2 <= epoch)
+            break;
+    item = *link;
+    *link = NULL;
+    session->retired_count -= release_all(tree, item);
+}
+
+static unsigned long release_all(Tree *tree, Retired *list)
+{
+    Retired *next;
+    unsigned long count = 0;
+    
+    for (; list != NULL; list = next)
+    {
+        next = list->next;
+        list->release(tree, list->object, list->size);
+        arena_free(tree->arena, list, sizeof(Retired));
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,58 @@
+#ifndef _epoch_h
+#define _epoch_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+/* Accesses to the fields that threads read without taking a lock. A writer
+ * fills in a new node, name or table before it publishes a pointer to it, and
+ * a reader that loads the pointer sees everything written before that. A
+ * full fence orders a thread's earlier stores before its later loads. */
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define PUBLISH(field, value) \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define EXCHANGE(field, value) \
+    __atomic_exchange_n(&(field), (value), __ATOMIC_ACQ_REL)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Adds to a counter that several writers may change at once and readers 
+ * only ever load, so nothing else is ordered by it. */
+#define ADD(field, value) \
+    __atomic_add_fetch(&(field), (value), __ATOMIC_RELAXED)
+
+/* Adds to a counter that only one thread changes, but others may read at any
+ * time. That thread's own load and store need no atomic addition. */
+#define COUNT(field, value) \
+    __atomic_store_n(&(field), \
+                     __atomic_load_n(&(field), __ATOMIC_RELAXED) + (value), \
+                     __ATOMIC_RELAXED)
+
+/* The number of objects a session retires before it tries to free them. */
+#define EPOCH_BATCH 64
+
+/* Frees an object, of the given size, once no thread can still be looking at
+ * it. The size is only passed through, so a release that needs something
+ * other than a size may take it there instead: an entry of the inode table
+ * is released with a null object and its ID as the size, and one that needs
+ * nothing is passed 0. */
+typedef void (*Release)(Tree *, void *, size_t);
+
+/* An object taken out of a tree, waiting to be freed: the tree's epoch when
+ * it was retired, and how to free it. Each session keeps its own list,
+ * newest first. */
+typedef struct retired
+{
+    struct retired *next;
+    unsigned long epoch;
+    Release release;
+    void *object;
+    size_t size; /* or whatever else the release takes in its place */
+}Retired;
+
+void epoch_enter(Tree *, Session *);
+void epoch_leave(Tree *, Session *);
+void epoch_retire(Tree *, Session *, Release, void *, size_t);
+void epoch_defer(Tree *, Release, void *, size_t);
+void epoch_orphan(Tree *, Session *);
+
+#endif
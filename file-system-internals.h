@@ -1,42 +1,471 @@
 #ifndef _file_system_internals_h
 #define _file_system_internals_h
 
-struct sub_dir;
+#include <stddef.h>
+#include <stdio.h>
+#include "lock.h"
 
-/* A linked list of files. */
+struct dir;
+struct arena;
+struct block_store;
+struct image;
+struct image_dir;
+struct inode_table;
+struct journal;
+struct name_pool;
+struct retired;
+struct tracer;
+
+/* A run of consecutive blocks of a filesystem's block store. */
+typedef struct
+{
+    unsigned long start;
+    unsigned long count;
+}Extent;
+
+/* The bytes kept in the inode table for each entry's name (see inode.h), so
+ * that a name of fewer characters, as most are, needs no allocation of its 
+ * own. */
+#define NAME_INLINE 24
+
+/* The contents of a file, which its entry in the inode table points to once
+ * it has any: size bytes held in its extents, which together have blocks 
+ * blocks, or, for a file loaded from an image and not written since, the 
+ * size bytes at mapped. Copies of a file share its extents, and the list of
+ * them, until one is changed; refs then points to how many files share 
+ * them, and is NULL for a file that has never been copied. */
 typedef struct file
 {
-    char *file_name;
-    struct file *next;
+    size_t size;
+    unsigned long blocks;
+    Extent *extents;
+    unsigned long extent_count;
+    unsigned long extent_cap;
+    const char *mapped;
+    unsigned long *refs;
 }File;
 
-/* A directory which contains a name, list of files, a pointer to a parent, and
- * a linked list of sub directories. */
+/* The kinds of slot in a directory's name index. A deleted slot is a tombstone
+ * that keeps probe chains intact until the table is rebuilt; it is never used
+ * again, so a slot that a lookup finds in use never holds another entry. */
+typedef enum {SLOT_EMPTY, SLOT_FILE, SLOT_DIR, SLOT_DELETED} Slot_kind;
+
+/* The longest name length a name index slot records exactly. */
+#define SLOT_LEN_MAX 65535
+
+/* One slot of a name index: the low 32 bits of the hash of the entry's name,
+ * which are all that is needed to place it in a table, the ID of the entry,
+ * which is either a file or a sub directory, the length of the name 
+ * (SLOT_LEN_MAX for any longer), which together with the hash almost always
+ * passes over other names without comparing them, and the kind of slot (a
+ * Slot_kind). That packs the slot into 12 bytes, more than five to a cache
+ * line. */
+typedef struct
+{
+    unsigned int hash;
+    unsigned int id;
+    unsigned short len;
+    unsigned char kind;
+}Index_slot;
+
+/* A table of a name index, allocated with room for exactly capacity slots (a
+ * power of two), so that a thread that has loaded a table pointer also has 
+ * the right capacity for it. */
+typedef struct
+{
+    unsigned long capacity;
+    Index_slot slots[1];
+}Index_table;
+
+/* An open addressing (linear probing) hash index over every name in a
+ * directory, shared by files and sub directories. When the table grows, the
+ * previous table is kept in old_table and drained a few slots at a time by
+ * later insertions and removals, so no single call pays for the whole
+ * rehash. Lookups search both tables, and may do so while the directory is
+ * being changed: entries are only published into slots that have never been
+ * used, and a table that is replaced is retired rather than freed. */
+typedef struct
+{
+    Index_table *table;
+    unsigned long used;
+    unsigned long count;
+    Index_table *old_table;
+    unsigned long migrate_pos;
+}Name_index;
+
+/* The most levels a node of a directory's ordered child index can have. With
+ * one node in four reaching each next level this covers billions of names. */
+#define CHILD_MAX_LEVEL 16
+
+/* A node of the upper levels of a directory's ordered child index: the ID of
+ * the entry, and height forward pointers, one per level above the bottom one
+ * that the node is linked in. Nodes are allocated with room for exactly 
+ * height pointers. A node never changes once linked in. */
+typedef struct child
+{
+    unsigned int id;
+    int height;
+    struct child *next[1];
+}Child;
+
+/* A skip list over the names of every file and sub directory in a directory,
+ * kept in strcmp() order so that listing is a walk along the bottom level. 
+ * The bottom level is the chain of next fields of the entries in the inode
+ * table, starting at first, and holds every entry; the upper levels, up to 
+ * level of them, start at head and hold one entry in four of the level 
+ * below, so that only those entries have a node. An entry or node is 
+ * published on a level only after its own forward links are set, and an 
+ * unlinked one keeps them, so the bottom level can be walked while the list
+ * is being changed. */
+typedef struct
+{
+    unsigned int first;
+    Child *head[CHILD_MAX_LEVEL - 1];
+    int level;
+    unsigned long seed;
+}Child_list;
+
+/* The full path of a directory, len characters long, as it was when the
+ * filesystem's rename count was generation. A path is never changed once
+ * built; a stale one is replaced by a new one. */
+typedef struct
+{
+    unsigned long generation;
+    size_t len;
+    char text[1];
+}Dir_path;
+
+/* What is below a directory: how many files and directories there are at
+ * every level, the bytes of all of their names, and the most levels of 
+ * directories there are below it (0 if it has no sub directories). */
+typedef struct
+{
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long name_bytes;
+    unsigned long depth;
+}Usage;
+
+/* A directory which contains the ID of its entry in the inode table, which
+ * holds its name and changes when it is renamed or moved, a pointer to a 
+ * parent, and a hash index and an ordered index over the IDs of its files 
+ * and sub directories, which are the only way they are reached. Only move()
+ * changes the parent. It may also hold its full path,
+ * built the first time it is asked for and valid only until a directory is
+ * renamed or moved. A directory loaded from an image is only a name and a
+ * record in the image until it is first looked into; image points to that
+ * record until then, and is NULL afterwards. The lock guards the directory's
+ * indexes, and the files in them, against other writers; readers that take no
+ * locks only follow the indexes. removing is set while rm checks that no
+ * session is in the directory, and stays set once it has been removed. usage
+ * is kept up to date as entries come and go anywhere below the directory.
+ * tallest is how many of its sub directories reach its depth, and counted is
+ * set once the directory's own depth is part of its parent's; both are guarded
+ * by the tree's usage_lock. A directory made by copy() is likewise only a name
+ * until it is first looked into, or until origin, the directory it is a copy
+ * of, is about to change: origin is set until then, and the directory is on
+ * origin's doubly linked list of copies (copies, next_copy and prev_copy),
+ * which the tree's copies_lock guards; writers read copies without it to 
+ * see whether a directory has any at all. */
 typedef struct dir
 {
     
-    char *dir_name;
-    File *file_list;
-    struct sub_dir *sub_dir_list;
+    unsigned int id;
     struct dir *parent_dir;
+    Name_index index;
+    Child_list children;
+    Dir_path *path;
+    const struct image_dir *image;
+    struct dir *origin;
+    struct dir *copies;
+    struct dir *next_copy;
+    struct dir *prev_copy;
+    int removing;
+    Usage usage;
+    unsigned long tallest;
+    int counted;
+    Rwlock lock;
     
 }Directory;
 
-/* A linked list of sub directories. */
-typedef struct sub_dir
+
+/* The number of slots in a filesystem's dentry cache. */
+#define DENTRY_SLOTS 256
+
+/* A cached path resolution: the directory that a path (of len characters,
+ * allocated along with it) of more than one component led to from a base
+ * directory (the root for an absolute path, otherwise the current directory
+ * at the time). It is only valid while its generation matches the cache's.
+ * An entry is never changed once made; a new one replaces it. */
+typedef struct
+{
+    Directory *base;
+    Directory *target;
+    unsigned long hash;
+    unsigned long generation;
+    size_t len;
+    char path[1];
+}Dentry;
+
+/* A bounded, direct mapped cache of path resolutions, so that repeatedly 
+ * following a deep path does not walk every level each time. Removing or 
+ * renaming a directory bumps the generation, invalidating every entry. 
+ * Renaming a directory also bumps renames, which invalidates the full paths
+ * cached in directories; building one of those takes paths_lock. */
+typedef struct
 {
-    Directory *curr_sub;
-    struct sub_dir *next;
-}Sub_directory;
+    Dentry *slots[DENTRY_SLOTS];
+    unsigned long generation;
+    unsigned long renames;
+    Mutex paths_lock;
+}Dentry_cache;
+
+/* The operations whose calls are counted. */
+typedef enum {STAT_TOUCH, STAT_MKDIR, STAT_CD, STAT_LS, STAT_PWD, STAT_WALK,
+              STAT_DU, STAT_COMPLETE, STAT_RM, STAT_RENAME, STAT_WRITE, 
+              STAT_READ, STAT_APPEND, STAT_TRUNCATE, STAT_COPY, STAT_MOVE,
+              STAT_OPEN_DIR, STAT_READ_DIR, STAT_SNAPSHOT, STAT_OPS} Stat_op;
 
+/* The error codes counted apart: -1 down to -STAT_CODES, every code the
+ * operations return. */
+#define STAT_CODES 5
 
-/* The actualy filesystem contains a pointer to a root and a curr directory 
- * pointer to know what locationt the filesystem is at all times. */
+/* What a session has done: how many times it called each operation, and how
+ * many of those calls returned each error code, how many slots of name 
+ * indexes and nodes of ordered indexes it looked at, and how many names it 
+ * compared while doing so. Only the session's own thread changes them, but 
+ * fs_stats() may read them at any time. */
 typedef struct
+{
+    unsigned long calls[STAT_OPS];
+    unsigned long errors[STAT_OPS][STAT_CODES];
+    unsigned long scanned;
+    unsigned long compares;
+}Counters;
+
+/* What fs_stats() reports: the counters of every session the tree has had 
+ * added together, how many files and directories have IDs, how many nodes 
+ * of the upper levels of ordered indexes are allocated, the bytes of the 
+ * arena handed out and given back since the tree was made, and the bytes 
+ * the arena holds from the system, now and at most, as well as how many 
+ * long names are pooled, how many files and directories hold them, the 
+ * bytes the pooled names take up, and the bytes the names would take with
+ * a copy for each entry. */
+typedef struct
+{
+    Counters ops;
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long children;
+    unsigned long allocated;
+    unsigned long freed;
+    unsigned long reserved;
+    unsigned long peak;
+    unsigned long names;
+    unsigned long name_refs;
+    unsigned long name_bytes;
+    unsigned long name_copy_bytes;
+}Stats;
+
+/* The bytes a session is padded with, so that the epochs of different 
+ * sessions, which their threads store to on every operation, never share a
+ * cache line. */
+#define SESSION_PAD 64
+
+/* One user of a tree: the directory that relative paths start from, the 
+ * epoch it is in (0 between operations), the objects it has retired, newest
+ * first, with their count and the count at which it next tries to free 
+ * them, and what it has done. Every session of a tree is on its doubly 
+ * linked list of sessions. id tells the session apart in traces. While an
+ * operation that is traced is running, traced is the tracer it goes to, and
+ * the time it began, the length of its argument and the entries the session
+ * had looked at by then are kept until it is recorded; traced is NULL 
+ * otherwise. */
+typedef struct session
+{
+    struct dir *curr_dir;
+    unsigned long epoch;
+    struct retired *retired;
+    unsigned long retired_count;
+    unsigned long reclaim_at;
+    Counters counters;
+    unsigned long id;
+    struct tracer *traced;
+    double trace_begin;
+    size_t trace_len;
+    unsigned long trace_scanned;
+    struct session *next;
+    struct session *prev;
+    char pad[SESSION_PAD];
+}Session;
+
+/* The actualy filesystem contains a pointer to a root, the arena that all of
+ * its memory comes from, the table of its files and directories, its dentry
+ * cache, the block store holding the contents of its files, the pool of its
+ * long names, the image it was loaded from, if any, the journal its changes
+ * are recorded in, if it is kept on disk, its current epoch, the sessions 
+ * using it, and the objects retired, and the counters, of sessions that have
+ * ended, how many sessions it has had, how many copies made by copy() have 
+ * not been read in yet, how many times rm has begun or finished removing a
+ * directory (odd while it is removing one; see enter_dir()), and the tracer
+ * its calls are recorded in, if one is attached (see fs_trace()).
+ * 
+ * cd, ls and pwd take no locks: they run inside an epoch (see epoch.c), and
+ * nothing they could be looking at is freed until they have left it. Every
+ * other operation holds lock, for reading unless it removes or renames a 
+ * directory or saves the whole tree, so writers never find a directory 
+ * removed or renamed under them, and otherwise only wait for each other on
+ * the locks of the directories they change. sessions_lock guards the list
+ * of sessions, the counters of those that have ended, the count of 
+ * sessions, and moving the epoch on, and journal_lock orders the records of
+ * the journal. usage_lock orders changes to the depths of directories, whose
+ * other totals are counted with atomic additions. copies_lock guards the
+ * lists of copies waiting to be read in, their count, and which directory
+ * each is a copy of. A writer reads in the copies of the directory it 
+ * changes, and of those above it, before changing it, so only writers 
+ * below a directory with copies waiting ever wait for them. The fields 
+ * that every operation reads come first, away from the locks. */
+typedef struct tree
 {
     Directory *root;
-    struct dir *curr_dir;    
-    
+    struct arena *arena;
+    struct inode_table *inodes;
+    Dentry_cache *dentries;
+    struct block_store *blocks;
+    struct name_pool *names;
+    struct image *image;
+    struct journal *journal;
+    struct tracer *tracer;
+    unsigned long epoch;
+    Session *sessions;
+    struct retired *orphans;
+    Counters ended;
+    unsigned long session_ids;
+    unsigned long pending;
+    unsigned long removals;
+    Mutex sessions_lock;
+    Rwlock lock;
+    Mutex journal_lock;
+    Mutex usage_lock;
+    Mutex copies_lock;
+}Tree;
+
+/* A handle on a tree through one of its sessions, which knows the location
+ * that session is at. Handles are small and may be copied, and a copy refers
+ * to the same session. Different sessions may be used from different threads
+ * at once, but each session only from one thread at a time. */
+typedef struct
+{
+    Tree *tree;
+    Session *session;
 }Filesystem;
 
+/* An entry of a directory handed out by read_dir(): its name, kept by the 
+ * cursor, and whether it is a directory. */
+typedef struct
+{
+    const char *name;
+    int is_dir;
+}Dir_entry;
+
+/* A listing of a directory in progress, from open_dir(). It has a session of
+ * its own, whose current directory is the one listed, so that the directory 
+ * is neither removed nor moved until the listing is closed. The names of the
+ * last batch are copied, one after another, into a buffer of size bytes, so
+ * that the session need not stay inside an epoch between batches; last is 
+ * the last of them, of last_len characters (0 before the first batch), and
+ * each batch starts after it, in name order, whatever has been added or 
+ * removed since. */
+typedef struct
+{
+    Filesystem files;
+    char *names;
+    size_t size;
+    const char *last;
+    size_t last_len;
+}Dir_cursor;
+
+/* A directory that build_fs() has gone into on the way to the entry a line 
+ * of its manifest names, and the length of the directory's name. If ordered
+ * is set, last is the ID of the directory's entry that sorts last (0 while 
+ * it has none), so that a name after it is known to be new. It is not set 
+ * for a directory gone back into, whose entries are not known. While 
+ * appending is set as well, every entry has come in order, so last ends the
+ * bottom level of the directory's ordered index and tails holds the last 
+ * node on each level above it (NULL for none), which a new last entry is 
+ * linked in after. */
+typedef struct
+{
+    Directory *dir;
+    size_t len;
+    int ordered;
+    int appending;
+    unsigned int last;
+    Child *tails[CHILD_MAX_LEVEL - 1];
+}Build_level;
+
+/* The bytes of its manifest that build_fs() reads at a time, at first; a 
+ * line longer than that makes it read more. */
+#define BUILD_BLOCK 65536
+
+/* A build_fs() in progress: the filesystem being built, the manifest, read
+ * a block at a time into a buffer of size bytes, of which those from pos to
+ * len are still to be read, the directories of the line before, depth of 
+ * them in a buffer with room for level_cap, from the root down, and every 
+ * directory made so far, dir_count of them in a buffer with room for 
+ * dir_cap, in the order they were made. */
+typedef struct
+{
+    Filesystem *files;
+    FILE *manifest;
+    char *buf;
+    size_t size;
+    size_t pos;
+    size_t len;
+    Build_level *levels;
+    size_t depth;
+    size_t level_cap;
+    Directory **dirs;
+    unsigned long dir_count;
+    unsigned long dir_cap;
+}Builder;
+
+/* Called by walk() with the full path of each file and directory it finds,
+ * along with whether it is a directory and the context walk() was given. It
+ * may be called from several threads at once, and the path is only valid 
+ * until it returns. complete() calls it the same way with names alone. */
+typedef void (*Walk_callback)(void *, const char *, int);
+
+/* A directory waiting to be walked, and its full path, of len characters 
+ * (none for the root), allocated along with it. */
+typedef struct
+{
+    Directory *dir;
+    size_t len;
+    char path[1];
+}Walk_item;
+
+/* One thread of a walk: a session of its own, which reads directories in 
+ * from an image as the walk reaches them, and a buffer, of size bytes, that 
+ * it builds the paths of the entries it finds in. */
+typedef struct
+{
+    Filesystem files;
+    char *buf;
+    size_t size;
+}Walker;
+
+/* A walk in progress: its threads and the pool of deques they take 
+ * directories from, what to call for each entry, and how many directories 
+ * have been handed out to start the threads off. */
+typedef struct
+{
+    Walker *walkers;
+    int count;
+    struct pool *pool;
+    Walk_callback callback;
+    void *context;
+    unsigned long seeded;
+}Walk;
+
 #endif
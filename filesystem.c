@@ -18,65 +18,492 @@
 #include <stdlib.h>
 #include <string.h>
 #include "filesystem.h"
+#include "arena.h"
+#include "block-store.h"
+#include "inode.h"
+#include "names.h"
+#include "image.h"
+#include "journal.h"
+#include "epoch.h"
+#include "pool.h"
+#include "trace.h"
 
-/* Given the specified directory, the function will enter the names of all the 
- * files and sub directories in the directory into an array of strings and 
- * sort them. The functionw will also print the names after sorting. */
-static void sort_and_print(Directory *);
+/* Returns the length of the full path of a directory of a tree. */
+static size_t path_length(Tree *, Directory *);
 
-/* Checks to see if the string is a name of a sub directory in the current 
- * directory. */
-static int is_dir(Directory *, char *);
+/* Writes the full path of a directory, of the given length, into a buffer 
+ * with room for it and a terminator. The path is written from its end, 
+ * following parents up to the root. */
+static void fill_path(Tree *, Directory *, char *, size_t);
+
+/* Returns the full path of a directory, building it unless it is already 
+ * cached and no directory has been renamed or moved since. Building it 
+ * needs the tree's lock, which is taken unless the flag says the caller 
+ * holds it. The path stays valid until the caller leaves its epoch. */
+static const char *dir_path(Filesystem *, Directory *, int);
+
+/* Given the specified directory, the function will print the names of all the 
+ * files and sub directories in the directory in sorted order, appending "/" to
+ * the names of sub directories. A directory still in the filesystem's image is
+ * listed from the image, without reading it in. No lock is needed. */
+static void print_children(Filesystem *, Directory *);
+
+/* Runs one directory of a walk, a task of its pool: reports each of its 
+ * entries and hands its sub directories to the worker running it. */
+static void walk_dir(void *, int, void *);
+
+/* Reports each entry of a directory being walked and makes a walk item of
+ * each sub directory, pushing it onto the deque of the given worker, or if 
+ * the flag is set, dealing the items out over every worker in turn. The 
+ * directory's item is freed. */
+static void walk_entries(Walk *, int, Walk_item *, int);
+
+/* Makes a walk item for a directory with the given full path, of the given
+ * length (0 for the root). */
+static Walk_item *walk_item(Directory *, const char *, size_t);
+
+/* Builds the full path of an entry in a walker's buffer, from the path, of
+ * the given length, of the directory it is in and its own name, of the given
+ * length, returning the length of the result. */
+static size_t walk_name(Walker *, const char *, size_t, const char *, size_t);
+
+/* Reads the entries of a directory that is still in the filesystem's image
+ * into its lists and indexes, if it has not been read in yet. The names and
+ * file contents stay in the image; sub directories are read in the same way
+ * when they are first looked into. */
+static void dir_fault(Filesystem *, Directory *);
+
+/* Reads in a copy made by copy() in the same way, giving it entries of its 
+ * own like those of its origin: each file shares its origin's contents 
+ * until either is changed, and each sub directory is made a copy in turn, 
+ * to be read in when it is first looked into. */
+static void copy_in(Filesystem *, Directory *);
+
+/* Makes a new directory a copy of another, to be read in later, with the 
+ * totals of what is below the other. A copy of a copy that has not been 
+ * read in yet is made a copy of that one's origin instead. */
+static void share(Tree *, Directory *, Directory *);
+
+/* Takes a copy that has been read in, or is being removed, off its origin's
+ * list of copies. */
+static void drop_copy(Tree *, Directory *);
+
+/* Returns the first copy still waiting of a directory, or NULL. */
+static Directory *first_copy(Tree *, Directory *);
+
+/* Locks a directory for reading, or for writing if the flag is set, reading
+ * it in from the image first if need be. */
+static void lock_dir(Filesystem *, Directory *, int);
+
+/* Reads a directory in from the image, if it is still there, for a thread
+ * about to look into it without its lock. That takes the directory's lock,
+ * and the tree's unless the flag says the caller holds it. */
+static void read_in(Filesystem *, Directory *, int);
+
+/* Enters an epoch and takes the tree's lock, for writing if the flag is 
+ * set. */
+static void lock_tree(Filesystem *, int);
+
+/* Reads in every copy still waiting of a directory about to change, and of
+ * the directories above it, top down, so that the copies made of their sub
+ * directories along the way are read in as well. Once a directory has no 
+ * copies left, none can be made of it while the caller, holding the tree's 
+ * lock, goes on below it, so other writers only wait here for copies of 
+ * what they change. The caller holds the directory's lock. */
+static void unshare(Filesystem *, Directory *);
+
+/* Does the same for every directory below and including a sub directory 
+ * about to be removed, except that copies which are being removed with it 
+ * are dropped instead. */
+static void unshare_below(Filesystem *, Directory *);
+
+/* Lets go of the lock of a directory, if one is given, and then of the tree,
+ * and leaves the epoch, compacting the journal into a checkpoint if the flag
+ * is set. */
+static void release(Filesystem *, Directory *, int);
+
+/* Creates a session of a tree, at its root. The caller must hold the tree's
+ * sessions_lock, unless no other thread can be using the tree. */
+static Session *session_new(Tree *);
+
+/* Makes a directory the current directory of the session, unless it or a 
+ * directory above it is being removed, in which case the current directory
+ * is left as it was and -1 is returned. The count of the tree's removals, 
+ * read before the directory was looked for, is passed. */
+static int enter_dir(Filesystem *, Directory *, unsigned long);
+
+/* Frees an object retired by an operation: a block of memory of the given 
+ * size, a node of an ordered child index, the ID (passed as the size) of an
+ * entry that has been removed, renamed or moved, along with its name, or a 
+ * removed sub directory with all of its contents. */
+static void release_memory(Tree *, void *, size_t);
+static void release_child(Tree *, void *, size_t);
+static void release_inode(Tree *, void *, size_t);
+static void release_dir(Tree *, void *, size_t);
+
+/* Returns the number of bytes allocated for a cached path, or a dentry, of
+ * the given length. */
+static size_t path_size(size_t);
+static size_t dentry_size(size_t);
+
+/* Returns the ID of a new entry of the given kind, with a name of the given
+ * length and hash, kept in the image if the name is there, in the entry's 
+ * short name if it fits, and otherwise in the tree's pool of names. Only its
+ * place in the ordered index and what it is are left to fill in. */
+static unsigned int new_entry(Tree *, Slot_kind, const char *, size_t, 
+                              unsigned long);
+
+/* Lets go of the name of an entry, unless it is in the image or is its short
+ * name, and then of its ID. No thread may still be able to reach it. */
+static void free_entry(Tree *, unsigned int);
+
+/* Returns the contents of the file an entry is, giving it some (empty) if it
+ * has none yet. The caller holds the lock of its directory for writing. */
+static File *file_of(Tree *, unsigned int);
+
+/* Records a mutation that has just succeeded in the filesystem's journal, if
+ * it has one, along with the current directory when the path is relative.
+ * The caller must still hold the lock of the directory it changed, so that
+ * records of changes to one directory are in the order they were made. 
+ * Returns 1 if the journal has grown too long and should be compacted once
+ * the caller's locks are released. */
+static int log_op(Filesystem *, Journal_op, const char *, const char *,
+                  unsigned long, const char *, size_t);
+
+/* Makes the mutation a journal record describes again, in the filesystem 
+ * passed as the context. */
+static void replay_record(void *, const Journal_record *);
+
+/* Finds the next line of the manifest of a build, reading more of it into
+ * the buffer, which is grown for a line longer than it, as needed, and 
+ * stores where it starts and its length without the newline, which is 
+ * replaced with a terminator. Returns 0 once there are no more lines. */
+static int read_line(Builder *, char **, size_t *);
+
+/* Adds the entry a line of a manifest, of the given length, names to the 
+ * filesystem being built, along with the directories on the way to it, 
+ * starting from those the line before went through. Only the totals of each
+ * directory's own entries are counted. Returns 0, or -1 if the line names 
+ * nothing that can be made, in which case what it went through is kept. */
+static int build_line(Builder *, const char *, size_t);
+
+/* Makes a directory the next level of the path a build is at. The flag says
+ * whether it has just been made, and so has no entries yet. */
+static void build_push(Builder *, Directory *, size_t, int);
+
+/* Gives a directory made by a build its name index, if it has entries but
+ * none has been looked for yet, in one table of the size they need. */
+static void build_index(Filesystem *, Directory *);
+
+/* Gives every directory made by a build its name index, and counts what is
+ * below each in the totals of the directories above it, children before 
+ * parents. */
+static void build_usage(Builder *);
+
+/* Returns 1 if a name of the given length sorts after another, terminated,
+ * name in strcmp() order. */
+static int sorts_after(const char *, size_t, const char *);
+
+/* Notes that the session has begun a call whose argument is of the given
+ * length, to be traced if a tracer is attached. */
+static void begin(Filesystem *, size_t);
+
+/* Counts a call of an operation by the session, and the error code it 
+ * returns, if it is one, records it in the tracer if it is being traced, and
+ * returns that code. */
+static int counted(Filesystem *, Stat_op, int);
+
+/* Adds the first counters to the second. */
+static void add_counters(const Counters *, Counters *);
+
+/* Sets up the empty lists and indexes, and the lock, of a new directory. The
+ * seed drives the heights chosen for the nodes of its ordered index. */
+static void init_contents(Directory *, unsigned long);
 
 /* Removes the contents within the given directory, including the directory
  * itself. In other words, the function removes anything beyond and including 
- * sub directories of the given directory and the directory itself. */
-static void remove_contents(Directory *);
+ * sub directories of the given directory and the directory itself. Every
+ * directory is visited exactly once, and the number of files and directories
+ * removed is returned. Everything is freed at once, so no thread may still be
+ * able to reach the directory. */
+static unsigned long remove_contents(Tree *, Directory *);
+
+/* Removes, or renames to the given name, the entry that a path names in the
+ * directory it is in, the path's last component being the name (of the given
+ * length) of the entry. Other writers only have to keep out of that 
+ * directory while a file is removed or renamed, but must be out of the whole
+ * tree for a directory, so unless the flag is set, 1 is returned instead of
+ * changing a directory. Otherwise they return like rm() and re_name(). */
+static int remove_entry(Filesystem *, const char *, const char *, size_t, 
+                        int);
+static int rename_entry(Filesystem *, const char *, const char *, 
+                        const char *, size_t, int);
+
+/* Removes every entry matching a pattern (of the given length), the last 
+ * component of a path, from the directory the rest of the path leads to, 
+ * logging each removal on its own. Like remove_entry(), 1 is returned 
+ * instead of changing anything if a sub directory matches and the flag is
+ * not set. Otherwise it returns -1 if nothing matches, -2 if a directory 
+ * that matches is in use (the rest are still removed) and 0 otherwise. */
+static int remove_matching(Filesystem *, const char *, const char *, size_t,
+                           int);
+
+/* Prints the entries of a directory matching a pattern (of the given 
+ * length), each as the given number of characters of a path followed by its
+ * name, with "/" after the names of sub directories, returning how many 
+ * there were. No lock is needed. */
+static unsigned long print_matching(Filesystem *, Directory *, const char *,
+                                    size_t, const char *, size_t);
+
+/* Finds the last component of a path, ignoring trailing slashes. Its length
+ * is 0 if the path has none (it is empty or all slashes). */
+static void split_path(const char *, const char **, size_t *);
+
+/* Follows the first given number of characters of a path, from the root if it
+ * starts with / and from the current directory otherwise. On success 0 is
+ * returned and the directory the path leads to is stored, unless its last
+ * component is a file: then the directory holding it is stored and the flag
+ * is set. -1 is returned if a component does not exist, and -2 if a 
+ * component other than the last is a file. No directory on the way is 
+ * locked, except to read one in from the image, which needs the tree's lock
+ * as well; the last flag says whether the caller holds it. The caller must 
+ * be inside an epoch, and lock the directory stored to look into it. */
+static int resolve(Filesystem *, const char *, size_t, Directory **, int *,
+                   int);
+
+/* Follows all of a path but its last component, storing the directory that
+ * the last component would be in. Returns 0, -1 or -2 like resolve(). The 
+ * caller holds the tree's lock. */
+static int resolve_parent(Filesystem *, const char *, Directory **);
+
+/* Finds the file a path names, returning 0 with the directory holding it
+ * locked (for writing if the flag is set), or -1 if there is no such file or
+ * directory and -2 if the path names a directory. A file that has never had
+ * contents is stored as NULL, unless it is to be written. */
+static int find_file(Filesystem *, const char *, int, Directory **, File **);
+
+/* Returns 1 if the first directory is the second one or one of its 
+ * ancestors. */
+static int is_ancestor(Directory *, Directory *);
+
+/* Returns 1 if a directory is the current directory of a session of the tree,
+ * or one of its ancestors. The sessions' current directories are read as 
+ * they are at the time, since cd takes no lock. */
+static int in_use(Tree *, Directory *);
+
+/* Returns the directory a path (of a given length and hash) led to from the 
+ * given base directory the last time it was resolved, if that is still in the
+ * dentry cache and nothing has been removed or renamed since, or NULL. */
+static Directory *dentry_lookup(Dentry_cache *, Directory *, const char *, 
+                                size_t, unsigned long);
+
+/* Records the directory a path led to from a base directory, found by a walk
+ * that started when the cache's generation was the one given. */
+static void dentry_insert(Filesystem *, Directory *, const char *, size_t,
+                          unsigned long, unsigned long, Directory *);
+
+/* Returns the dentry cache slot for a base directory and path hash. */
+static unsigned long dentry_slot(Directory *, unsigned long);
+
+/* Creates a file, returning its ID, or creates and returns an empty sub 
+ * directory, with the given name (and its length and hash) in a directory 
+ * that has no entry of that name. The name is kept as new_entry() says. A 
+ * file has no contents until it is given some. A sub directory that is still
+ * in the image is given its record there, and a copy the directory it is a
+ * copy of, which are set before any thread can find it. */
+static unsigned int add_file(Filesystem *, Directory *, const char *, size_t,
+                             unsigned long);
+static Directory *add_dir(Filesystem *, Directory *, const char *, size_t,
+                          unsigned long, const Image_dir *, Directory *);
+
+/* Creates a sub directory like add_dir(), but without linking it into the
+ * directory's indexes, which is left to the caller. */
+static Directory *make_dir(Filesystem *, Directory *, const char *, size_t,
+                           unsigned long, const Image_dir *, Directory *);
+
+/* Removes the file, or the sub directory and all of its contents, held by an 
+ * index slot of a directory. What other threads may still be looking at is
+ * retired. */
+static void remove_file(Filesystem *, Directory *, Index_slot *);
+static void remove_dir(Filesystem *, Directory *, Index_slot *);
+
+/* Points a directory that is still in the image at its record there, and
+ * takes the totals of what is below it from the record. */
+static void use_image(Directory *, const Image_dir *);
+
+/* Counts a new entry, with a name of the given length, of a directory in 
+ * the usage of that directory and of every directory above it. The entry
+ * is a file unless the sub directory is given, whose whole usage is 
+ * counted. A sub directory is counted before it is linked in, unless every
+ * other writer is kept out: once another thread can find it, what that 
+ * thread adds below it is counted above it as well, and would be counted
+ * twice. */
+static void usage_added(Tree *, Directory *, Directory *, size_t);
+
+/* Takes an entry out of the usage of a directory and of every directory 
+ * above it, like usage_added() in reverse. A sub directory is taken out 
+ * before it is removed, so that it is never found among the sub directories
+ * of a directory once it no longer counts there. */
+static void usage_removed(Tree *, Directory *, Directory *, size_t);
+
+/* Adds the given numbers of files, directories and name bytes to the usage of
+ * a directory and of every directory above it, or takes them away if the 
+ * flag is set. */
+static void add_usage(Tree *, Directory *, unsigned long, unsigned long, 
+                      unsigned long, int);
+
+/* Records that a sub directory of a directory that used to reach the first
+ * given number of levels below the directory (0 if it did not count) now
+ * reaches the second (0 if it no longer counts), moving the depth of the 
+ * directory, and of those above it, as far as that changes it. The caller 
+ * holds the tree's usage_lock. */
+static void count_depth(Tree *, Directory *, unsigned long, unsigned long);
+
+/* Sets the depth of a directory, and how many of its sub directories reach
+ * it, from its sub directories that count. The caller holds the tree's 
+ * usage_lock. */
+static void measure_depth(Tree *, Directory *);
+
+/* Returns the length of the literal prefix of a pattern of the given 
+ * length: everything before its first *, ? or [. A name is a pattern if 
+ * that is shorter than the name. */
+static size_t glob_prefix(const char *, size_t);
+
+/* Returns 1 if a name matches a pattern of the given length, in which * 
+ * matches any run of characters, ? any one character, and [...] any one of
+ * the characters or ranges (such as a-z) between the brackets, or with ! or 
+ * ^ first, any other. A [ that is never closed matches itself. */
+static int glob_match(const char *, size_t, const char *);
+
+/* Matches one character against the bracket expression a pattern of the 
+ * given length starts with, setting the flag if it matches. Returns the
+ * length of the expression, or 0 if it is never closed. */
+static size_t glob_class(const char *, size_t, int, int *);
+
+/* Returns 1 if the name (of the given length) is ".", ".." or "/", the names
+ * that can never refer to an entry of a directory. */
+static int is_special(const char *, size_t);
+
+/* Hashes a name of the given length. */
+static unsigned long name_hash(const char *, size_t);
+
+
+/* Finds the slot holding the given name (of the given length and hash, and not
+ * necessarily terminated) in a directory's name index, or returns NULL if there
+ * is no entry with that name. Lookups never modify the index, and need no lock:
+ * without the directory's lock, the slot found may turn into a tombstone at
+ * any time. The slots looked at, and the names compared, are counted for 
+ * the session looking, as they are by the functions of ordered child 
+ * indexes. */
+static Index_slot *index_lookup(Filesystem *, const Name_index *, const char *,
+                                size_t, unsigned long);
+
+/* Adds a file or sub directory, by its ID, whose name has the given hash and
+ * length, and which must not already be present, to a name index. */
+static void index_insert(Filesystem *, Name_index *, unsigned long, size_t, 
+                         Slot_kind, unsigned int);
+
+/* Gives a name index that has no table, but counts entries, a table holding
+ * every entry of the given ordered child index, in which they are all 
+ * linked. */
+static void index_fill(Filesystem *, Name_index *, const Child_list *);
+
+/* Removes the entry held by the given slot, which must have been returned by
+ * index_lookup() on the same index. */
+static void index_remove(Filesystem *, Name_index *, Index_slot *);
+
+/* Frees the tables of a name index at once. */
+static void index_free(Arena *, Name_index *);
+
+/* Links an entry, whose name must not already be present, into an ordered 
+ * child index, at a height drawn from that index: above the bottom level, it
+ * is given a node. */
+static void children_insert(Filesystem *, Child_list *, unsigned int);
+
+/* Links an entry, whose name sorts after every other one, into an ordered 
+ * child index after the given last entry (0 if there is none), like 
+ * children_insert() but without comparing names: the caller keeps the last
+ * node on each level above the bottom one (NULL for none), which are 
+ * updated. */
+static void children_append(Filesystem *, Child_list *, unsigned int, 
+                            unsigned int, Child **);
+
+/* Unlinks an entry from an ordered child index. Its node, if it has one, is
+ * retired, since other threads may be walking over it. */
+static void children_remove(Filesystem *, Child_list *, unsigned int);
+
+/* Returns the first entry of an ordered child index whose name is not before
+ * the given prefix (of the given length), or 0 if there is none, so that 
+ * the names starting with the prefix follow it along the bottom level. It 
+ * may be called without the directory's lock, like a walk along the bottom
+ * level. */
+static unsigned int children_seek(Filesystem *, Child_list *, const char *, 
+                                  size_t);
+
+/* Frees a node of an ordered child index. */
+static void child_free(Arena *, Child *);
+
+/* Frees every node of an ordered child index. */
+static void children_free(Arena *, Child_list *);
 
 /* Every call to mkfs() must initialize the parameter Filesystem in such a way 
  * that each returned value represents a different filesystem, so calling mkfs 
  * several times will not cause separate Filesystem variables to share any files 
- * or directories. The result of calling any of the other functions on a 
- * Filesystem variable before mkfs() is called on it is undefined. The result 
- * of calling any of the other functions is also undefined if mkfs() was first 
- * called, but its argument was just NULL. The function initialzes and mallocs
- * any neccessary components of the root directory. After this function is 
- * called, the current directory will be the root directory. 
+ * or directories (each one gets an arena of its own). The result of calling 
+ * any of the other functions on a Filesystem variable before mkfs() is called
+ * on it is undefined. The result of calling any of the other functions is also
+ * undefined if mkfs() was first called, but its argument was just NULL. The
+ * function initialzes and allocates any neccessary components of the root 
+ * directory, and files becomes the first session of the new tree. After this
+ * function is called, the current directory will be the root directory. 
  */
 void mkfs(Filesystem *files)
 {
     if (files != NULL)
     {
-        files->root = malloc(sizeof(Directory));
-        if (files->root != NULL)
-        {
-            files->root->dir_name = malloc(2);
-            if (files->root->dir_name != NULL)
-            {
-                strcpy(files->root->dir_name, "/");
-                files->root->file_list = NULL;
-                files->root->sub_dir_list = NULL;
-                files->root->parent_dir = files->root;
-                files->curr_dir = files->root;
-            }
-            else
-            {
-                printf("Memory allocation failed!\n");
-                exit(1);
-            }
-        }
-        else
-        {
-            printf("Memory allocation failed!\n");
-            exit(1);
-        }
+        Arena *arena = arena_new();
+        Tree *tree = arena_alloc(arena, sizeof(Tree));
+        
+        tree->arena = arena;
+        tree->inodes = inodes_new(arena);
+        tree->dentries = arena_alloc(arena, sizeof(Dentry_cache));
+        memset(tree->dentries, 0, sizeof(Dentry_cache));
+        mutex_init(&tree->dentries->paths_lock);
+        tree->dentries->generation = 1;
+        tree->blocks = blocks_new(arena);
+        tree->names = names_new(arena, tree);
+        tree->image = NULL;
+        tree->root = slab_alloc(&arena->dirs);
+        tree->root->id = new_entry(tree, SLOT_DIR, "/", 1, name_hash("/", 1));
+        INODE_ENTRY(tree->inodes, tree->root->id).dir = tree->root;
+        tree->root->parent_dir = tree->root;
+        init_contents(tree->root, name_hash("/", 1));
+        tree->journal = NULL;
+        tree->tracer = NULL;
+        tree->epoch = 1;
+        tree->sessions = NULL;
+        tree->orphans = NULL;
+        memset(&tree->ended, 0, sizeof(Counters));
+        tree->session_ids = 0;
+        tree->pending = 0;
+        tree->removals = 0;
+        mutex_init(&tree->sessions_lock);
+        rwlock_init(&tree->lock);
+        mutex_init(&tree->journal_lock);
+        mutex_init(&tree->usage_lock);
+        mutex_init(&tree->copies_lock);
+        
+        files->tree = tree;
+        files->session = session_new(tree);
     }
 }
 
 /* This function’s usual effect is to create a file, if it does not already 
- * exist in the Filesystem files. If files is NULL, the function exits 
- * immediately, since NULL takes priority over all other errors. Otherwise,
- * the function will return 0 or another error code.
+ * exist in the Filesystem files. The argument may be a path, in which case the
+ * file is created in the directory that the rest of the path leads to. If 
+ * files is NULL, the function exits immediately, since NULL takes priority 
+ * over all other errors. Otherwise, the function will return 0 or another 
+ * error code.
  */
 int touch(Filesystem *files, const char arg[])
 {
@@ -84,238 +511,158 @@ int touch(Filesystem *files, const char arg[])
     if (files != NULL && arg != NULL)
     {
         
-        File *curr_file = files->curr_dir->file_list, *new_file;
-        Sub_directory *curr_s_dir;
+        Tree *tree = files->tree;
+        Directory *dir;
+        const char *name;
+        size_t len;
+        unsigned long hash;
+        int due = 0;
+        
+        begin(files, strlen(arg));
         
         /* If arg is an empty string. */
         if (*arg == '\0')
-            return -1;
+            return counted(files, STAT_TOUCH, -1);
         
-        /* If arg is the name of a sub-directory or a file that already exists 
-         * in the current directory, or is . (a single period), .., or / . */
-        else if ((strcmp(arg, ".") == 0) || (strcmp(arg, "..") == 0)
-                 || (strcmp(arg, "/") == 0))
-            return 0;
-        
-        /* Check for existing files with the same name. */
-        while (curr_file != NULL)
-        {
-            if (strcmp(arg, curr_file->file_name) == 0)
-                return 0;
-            curr_file = curr_file->next;
-        }
+        /* If arg ends in . (a single period), .., or / . */
+        split_path(arg, &name, &len);
+        if (len == 0 || is_special(name, len))
+            return counted(files, STAT_TOUCH, 0);
         
-        /* Check for existing sub directories with the same name. */
-        if (files->curr_dir->sub_dir_list != NULL)
+        /* If the directory the file would go in does not exist. */
+        lock_tree(files, 0);
+        if (resolve_parent(files, arg, &dir) != 0)
         {
-            curr_s_dir = files->curr_dir->sub_dir_list;
-            
-            while (curr_s_dir != NULL)
-            {
-                if (strcmp(arg, curr_s_dir->curr_sub->dir_name) == 0)
-                    return 0;
-                curr_s_dir = curr_s_dir->next;
-            }
+            release(files, NULL, 0);
+            return counted(files, STAT_TOUCH, -1);
         }
         
-        /* By now, there are no files/directories with the same name. */
-        curr_file = files->curr_dir->file_list;
-        new_file = malloc(sizeof(File));
-        new_file->file_name = malloc(strlen(arg) + 1);
-        
-        if (new_file != NULL && new_file->file_name != NULL)
-        {
-            strcpy(new_file->file_name, arg);
-            new_file->next = NULL;
-            
-            if (curr_file == NULL)
-            {
-                files->curr_dir->file_list = new_file;
-                return 0;
-            }
-            else
-            {
-                while (curr_file->next != NULL)
-                    curr_file = curr_file->next;
-                
-                curr_file->next = new_file;
-                return 0;
-            }
-        }
-        else
+        /* Unless arg is the name of a sub-directory or a file that already
+         * exists in that directory, there are no files/directories with the
+         * same name. */
+        lock_dir(files, dir, 1);
+        unshare(files, dir);
+        hash = name_hash(name, len);
+        if (index_lookup(files, &dir->index, name, len, hash) == NULL)
         {
-            printf("Memory allocation failed!\n");
-            exit(1);
+            add_file(files, dir, name, len, hash);
+            usage_added(tree, dir, NULL, len);
+            due = log_op(files, JOURNAL_TOUCH, arg, "", 0, "", 0);
         }
+        release(files, dir, due);
+        return counted(files, STAT_TOUCH, 0);
     }
     return 0;
 }
 
 /* The usual effect of this function is to create a sub-directory in the 
- * current directory. If files is NULL, the function exits 
- * immediately, since NULL takes priority over all other errors. Otherwise,
- * the function will return 0 or another error code.
+ * current directory, or in the directory a path leads to. If files is NULL,
+ * the function exits immediately, since NULL takes priority over all other
+ * errors. Otherwise, the function will return 0 or another error code.
  */
 int mkdir(Filesystem *files, const char arg[])
 {
     
     if (files != NULL && arg != NULL)
     {
-        File *curr_file = files->curr_dir->file_list;
-        Directory *new_dir;
-        Sub_directory *curr_s_dir, *new_s_dir;
+        Tree *tree = files->tree;
+        Directory *dir, *sub;
+        const char *name;
+        size_t len;
+        unsigned long hash;
+        int result = 0, due = 0;
+        
+        begin(files, strlen(arg));
         
         /* If arg is an empty string. */
         if (*arg == '\0')
-            return -1;
-        
-        /* If arg is the name of a file or of a sub-directory that already 
-         * exists in the current directory, or is . (a single period), or .., 
-         * or / */
-        else if ((strcmp(arg, ".") == 0) || (strcmp(arg, "..") == 0)
-                 || (strcmp(arg, "/") == 0))
-            return -2;
+            return counted(files, STAT_MKDIR, -1);
         
-        /* Check for existing files with the same name. */
-        while (curr_file != NULL)
-        {
-            if (strcmp(arg, curr_file->file_name) == 0)
-                return -2;
-            curr_file = curr_file->next;
-        }
+        /* If arg ends in . (a single period), or .., or / */
+        split_path(arg, &name, &len);
+        if (len == 0 || is_special(name, len))
+            return counted(files, STAT_MKDIR, -2);
         
-        /* Check for existing sub directories with the same name. */
-        if (files->curr_dir->sub_dir_list != NULL)
+        /* If the directory the new one would go in does not exist. */
+        lock_tree(files, 0);
+        if (resolve_parent(files, arg, &dir) != 0)
         {
-            curr_s_dir = files->curr_dir->sub_dir_list;
-            
-            while (curr_s_dir != NULL)
-            {
-                if (strcmp(arg, curr_s_dir->curr_sub->dir_name) == 0)
-                    return -2;
-                curr_s_dir = curr_s_dir->next;
-            }
+            release(files, NULL, 0);
+            return counted(files, STAT_MKDIR, -1);
         }
         
-        /* At this point, there should not be any files or sub directories in 
-         * the current directory with the same name in the parameter. 
-         * The function will proceed to make the sub directory. */
-        new_dir = malloc(sizeof(Directory));
-        new_dir->dir_name = malloc(strlen(arg) + 1);
-        new_s_dir = malloc(sizeof(Sub_directory));
+        /* If arg is the name of a file or of a sub-directory that already 
+         * exists in that directory. */
+        lock_dir(files, dir, 1);
+        unshare(files, dir);
+        hash = name_hash(name, len);
+        if (index_lookup(files, &dir->index, name, len, hash) != NULL)
+            result = -2;
         
-        if (new_dir != NULL && new_dir->dir_name != NULL && new_s_dir != NULL)
-        {
-            strcpy(new_dir->dir_name, arg);
-            new_dir->file_list = NULL;
-            new_dir->sub_dir_list = NULL;
-            new_dir->parent_dir = files->curr_dir;
-            new_s_dir->curr_sub = new_dir;
-            new_s_dir->next = NULL;
-            
-            if (files->curr_dir->sub_dir_list == NULL)
-            {
-                files->curr_dir->sub_dir_list = new_s_dir;
-                return 0;
-            }
-            
-            else
-            {
-                curr_s_dir = files->curr_dir->sub_dir_list;
-                
-                while (curr_s_dir->next != NULL)
-                    curr_s_dir = curr_s_dir->next;
-                
-                curr_s_dir->next = new_s_dir;
-                return 0;
-            }
-        }
+        /* Otherwise, there should not be any files or sub directories in the
+         * directory with the same name in the parameter. The function will
+         * proceed to make the sub directory. */
         else
         {
-            printf("Memory allocation failed!\n");
-            exit(1);
+            sub = make_dir(files, dir, name, len, hash, NULL, NULL);
+            usage_added(tree, dir, sub, len);
+            index_insert(files, &dir->index, hash, len, SLOT_DIR, sub->id);
+            children_insert(files, &dir->children, sub->id);
+            due = log_op(files, JOURNAL_MKDIR, arg, "", 0, "", 0);
         }
+        release(files, dir, due);
+        return counted(files, STAT_MKDIR, result);
     }
     return 0;
 }
 
-/* This function’s usual effect is to change the current directory. If files is 
- * NULL, the function exits immediately, since NULL takes priority over 
- * all other errors. Otherwise, the function will return 0 or another error
- * code.
+/* This function’s usual effect is to change the current directory. The 
+ * argument may be a path of any number of components, absolute or relative to
+ * the current directory. If files is NULL, the function exits immediately, 
+ * since NULL takes priority over all other errors. Otherwise, the function 
+ * will return 0 or another error code.
  */
 int cd(Filesystem *files, const char arg[])
 {
     if (files != NULL && arg != NULL)
     {
-        File *curr_file = files->curr_dir->file_list;
-        Sub_directory *curr_s_dir;
-        int exist_file_or_dir = 0;
-        
-        /* If arg is /, the root directory becomes the new current directory. */
-        if (strcmp(arg, "/") == 0)
-        {
-            files->curr_dir = files->root;
-            return 0;
-        }
+        Tree *tree = files->tree;
+        Directory *dir;
+        size_t len = strlen(arg);
+        unsigned long removals;
+        int is_file, result;
         
-        /* If arg is . (a single period), or is an empty string, the function 
-         * has no effect. */
-        if ((strcmp(arg, ".") == 0) || *arg == '\0')
-            return 0;
+        begin(files, len);
         
-        /* If arg is .., the parent directory of the current directory becomes 
-         * the new current directory. */
-        if (strcmp(arg, "..") == 0)
-        {
-            if (strcmp(files->curr_dir->dir_name, "/") == 0)
-                return 0;
-            else
-            {
-                files->curr_dir = files->curr_dir->parent_dir;
-                return 0;
-            }
-        }
+        /* If arg is an empty string, the function has no effect. / takes the
+         * current directory to the root, . leaves it and .. goes to its 
+         * parent (the root is its own parent), like any other path. */
+        if (*arg == '\0')
+            return counted(files, STAT_CD, 0);
         
-        /* If arg is the name of a file that exists in the current directory. */
-        while (curr_file != NULL)
-        {
-            if (strcmp(arg, curr_file->file_name) == 0)
-                return -2;
-            
-            curr_file = curr_file->next;
-        }
+        /* If a component of arg does not exist, or a file is named. */
+        epoch_enter(tree, files->session);
+        removals = LOAD(tree->removals);
+        result = resolve(files, arg, len, &dir, &is_file, 0);
+        if (result == 0 && is_file)
+            result = -2;
         
-        /* If arg is a name that does not refer to an existing file or 
-         * directory in the current directory. */
-        if (files->curr_dir->sub_dir_list != NULL)
+        /* Otherwise arg leads to an existing directory, so the session's 
+         * current directory now points to that. If rm is removing it at the
+         * same moment, wait for rm to finish, holding the tree's lock, and 
+         * look again. */
+        if (result == 0 && enter_dir(files, dir, removals) != 0)
         {
-            curr_s_dir = files->curr_dir->sub_dir_list;
-            
-            while (curr_s_dir != NULL)
-            {
-                if (strcmp(arg, curr_s_dir->curr_sub->dir_name) == 0)
-                    exist_file_or_dir = 1;
-                
-                curr_s_dir = curr_s_dir->next;
-            }
+            rwlock_read(&tree->lock);
+            result = resolve(files, arg, len, &dir, &is_file, 1);
+            if (result == 0 && is_file)
+                result = -2;
+            if (result == 0)
+                PUBLISH(files->session->curr_dir, dir);
+            rwlock_unlock(&tree->lock);
         }
-        
-        if (!exist_file_or_dir)
-            return -1;
-        
-        /* At this point arg is the name of a directory that exists as an 
-         * immediate sub-directory of the current directory. */
-        
-        /* Find and point to the directory, and have the Filesystem's current
-         * directory now point to that. */
-        curr_s_dir = files->curr_dir->sub_dir_list;
-        while (curr_s_dir->next != NULL && 
-               (strcmp(arg, curr_s_dir->curr_sub->dir_name) != 0))
-            curr_s_dir = curr_s_dir->next;
-        
-        files->curr_dir = curr_s_dir->curr_sub;
-        return 0;
+        epoch_leave(tree, files->session);
+        return counted(files, STAT_CD, result);
     }
     else
         return 0;
@@ -323,94 +670,53 @@ int cd(Filesystem *files, const char arg[])
 
 /* This function’s usual effect is to list the files and sub-directories of the
  * current directory, or the files and sub-directories of its argument if that
- * is a sub-directory, or to list its argument if that is a file.
+ * is a sub-directory, or to list its argument if that is a file. The argument
+ * may be a path, and if it does not exist, its last component may be a pattern
+ * with *, ? and [...] in it, listing every entry that matches.
  */
 int ls(Filesystem files, const char arg[])
 {
     if (arg != NULL)
     {
         
-        int exist_file = 0, exist_dir = 0;
-        File *curr_file = files.curr_dir->file_list;
-        Sub_directory *curr_s_dir = files.curr_dir->sub_dir_list;
-        
-        
-        /* If arg is . (a single period) or the empty string, the function prints
-         * all the files and sub directories of the current directory. (If root,
-         * then there may be no sub directories or files). */
-        if (strcmp(arg, ".") == 0 || *arg == '\0')
-        {
-            sort_and_print(files.curr_dir);
-            return 0;
-        }
+        Directory *dir = files.session->curr_dir;
+        const char *name;
+        size_t len;
+        int is_file = 0, result = 0;
         
-        /* If arg is / (the root), the function prints all the files and sub 
-         * directories of the root directory . */
-        if (strcmp(arg, "/") == 0)
-        {
-            sort_and_print(files.root);
-            return 0;
-        }
+        begin(&files, strlen(arg));
         
-        /* If arg is .. (double peroid), the function prints all the files and
-         * sub directories of the parent directory. (If the current directory is the
-         * root, then function acts the same as "." or "/").*/
-        if (strcmp(arg, "..") == 0)
-        {
-            if (strcmp("/", files.curr_dir->dir_name) == 0)
-            {
-                sort_and_print(files.root);
-                return 0; 
-            }
-            else
-            {
-                sort_and_print(files.curr_dir->parent_dir);
-                return 0;
-            }
-        }
+        /* If arg is the empty string, the function prints all the files and
+         * sub directories of the current directory. (If root, then there may 
+         * be no sub directories or files). Otherwise arg may not lead to an
+         * existing file or directory. */
+        epoch_enter(files.tree, files.session);
+        if (*arg != '\0')
+            result = resolve(&files, arg, strlen(arg), &dir, &is_file, 0);
         
-        /* Check for existing files with the same name. */
-        while (curr_file != NULL)
-        {
-            if (strcmp(arg, curr_file->file_name) == 0)
-            {
-                exist_file = 1;
-                break;
-            }
-            
-            curr_file = curr_file->next;
-        }
+        /* If arg is the name of a file that exists. */
+        if (result == 0 && is_file)
+            printf("%s\n", arg);
         
-        /* Check for existing sub directories with the same name. */
-        while (curr_s_dir != NULL)
-        {
-            if (strcmp(arg, curr_s_dir->curr_sub->dir_name) == 0)
-            {
-                exist_dir = 1;
-                break;
-            }
-            
-            curr_s_dir = curr_s_dir->next;
-        }
+        /* If arg leads to an exisiting directory (/, . and .. included), the
+         * function will print all of its files and sub directories. */
+        else if (result == 0)
+            print_children(&files, dir);
         
-        /* If arg is the name of a file that exists in the current directory. */
-        if (exist_file)
+        /* If arg does not exist but its last component is a pattern, the
+         * entries of the directory that the rest leads to matching it are 
+         * printed, as arg would be if it were each of them. */
+        else
         {
-            printf("%s\n", curr_file->file_name);
-            return 0;
+            split_path(arg, &name, &len);
+            if (glob_prefix(name, len) < len && 
+                resolve(&files, arg, name - arg, &dir, &is_file, 0) == 0 &&
+                !is_file && 
+                print_matching(&files, dir, name, len, arg, name - arg) > 0)
+                result = 0;
         }
-        
-        
-        /* If arg is a name that does not refer to an existing file or directory 
-         * in the current directory. */
-        if (!exist_dir && !exist_file)
-            return -1;
-        
-        /* At this point, arg must be the name of an exisiting sub directory, the 
-         * function will print all the files and sub directories of the specified 
-         * sub directory of the current directory. */
-        sort_and_print(curr_s_dir->curr_sub);
-        return 0;
+        epoch_leave(files.tree, files.session);
+        return counted(&files, STAT_LS, result == 0 ? 0 : -1);
         
     }
     else
@@ -430,457 +736,3608 @@ int ls(Filesystem files, const char arg[])
  */
 void pwd(Filesystem files)
 {
-    char **path = NULL; 
-    int directories = 0, i;
-    Directory *dir = files.curr_dir;
+    Directory *dir = files.session->curr_dir;
+    
+    counted(&files, STAT_PWD, 0);
     
     /* If the current directory is the root. */
-    if (strcmp(files.curr_dir->dir_name, "/") == 0)
+    if (dir == files.tree->root)
     {
         printf("/\n");
         return;
     }
     
-    /* Count the number of directories, exlcuding the root. */
-    while (strcmp("/", dir->dir_name) != 0) 
-    {
-        directories++;
-        dir = dir->parent_dir;
-    }
-    path = malloc(sizeof(char *) * directories);
-    
-    if (path == NULL)
-    {
-        printf("Memory allocation failed!\n");
-        exit(1);
-    }
-    
-    dir = files.curr_dir; /* Reset the tmp dir pointer */
-    i = 0;
+    epoch_enter(files.tree, files.session);
+    printf("%s\n", dir_path(&files, dir, 0));
+    epoch_leave(files.tree, files.session);
+}
+
+/* This function stores the same path that pwd() prints, without the newline,
+ * in the caller's buffer of the given size and returns its length. It never
+ * allocates memory. If the buffer is too small for the path and its 
+ * terminator, only an empty string is stored, and the length returned tells
+ * the caller how much room is needed. */
+size_t pwd_path(Filesystem files, char buf[], size_t size)
+{
+    Tree *tree = files.tree;
+    Directory *dir = files.session->curr_dir;
+    const Dir_path *path;
+    size_t len;
     
-    /* The array of strings will first allocate memory, add "/" and then the 
-     * name of the current directory, going back parent by parent. (Note: 
-     * this array will contain the names in reverse order!!!!) Also, it will
-     * not include the root, since it adds "/" to every directory name. */
-    while (i < directories)
+    /* A cached path is read without a lock. Building one takes the tree's
+     * lock, so that no directory is renamed or moved part way through. */
+    epoch_enter(tree, files.session);
+    path = LOAD(dir->path);
+    if (path != NULL && path->generation == LOAD(tree->dentries->renames))
     {
-        path[i] = malloc(strlen(dir->dir_name) + 1); 
-        
-        if (path[i] == NULL)
-        {
-            printf("Memory allocation failed!\n");
-            exit(1);
-        }
-        strcpy(path[i++], dir->dir_name);
-        dir = dir->parent_dir;
+        len = path->len;
+        if (len < size)
+            memcpy(buf, path->text, len + 1);
     }
-    
-    /* Print the names in the array of strings in REVERSE order to get correct
-     * output!!!!!! */
-    i = directories - 1;
-    while (i >= 0)
+    else
     {
-        printf("/");
-        printf("%s", path[i--]);
+        rwlock_read(&tree->lock);
+        len = path_length(tree, dir);
+        if (len < size)
+            fill_path(tree, dir, buf, len);
+        rwlock_unlock(&tree->lock);
     }
-    printf("\n");
+    epoch_leave(tree, files.session);
     
-    /* Free all malloc'd memory */
-    i = 0;
-    while (i < directories)
-    {
-        free(path[i++]);
-    }
-    free(path);
+    if (len >= size && size > 0)
+        buf[0] = '\0';
+    return len;
 }
 
-static void sort_and_print(Directory *dir)
+/* This function starts a listing of the directory that arg names (arg may be
+ * a path; the empty string stands for the current directory) in cursor, for
+ * read_dir() to hand out its entries in batches. Until close_dir() is 
+ * called, the directory can be neither removed nor moved, and rmfs() may 
+ * not be called on the filesystem. It returns 0, or -1 if arg does not exist
+ * and -2 if it names a file, in which case there is nothing to close.
+ */
+int open_dir(Filesystem files, const char arg[], Dir_cursor *cursor)
 {
-    if (dir != NULL)
+    if (arg != NULL && cursor != NULL)
     {
-        char **s_arr, *tmp_s;
-        File *curr_file = dir->file_list;
-        Sub_directory *curr_s_dir = dir->sub_dir_list;
-        int elements = 0, i, j;
-        
-        
-        /* Find number of total files and sub dir. */
-        while (curr_file != NULL)
-        {
-            elements++;
-            curr_file = curr_file->next;
-        }
-        while (curr_s_dir != NULL)
-        {
-            elements++;
-            curr_s_dir = curr_s_dir->next;
-        }
+        Filesystem *listing = &cursor->files;
+        Directory *dir = files.session->curr_dir;
+        size_t len = strlen(arg);
+        unsigned long removals;
+        int is_file = 0, result = 0;
         
-        s_arr = malloc(sizeof(char *) * elements);
-        if (s_arr == NULL)
-        {
-            printf("Memory allocation failed!\n");
-            exit(1);
-        }
-        i = 0;
+        begin(&files, len);
+        listing->tree = NULL;
+        listing->session = NULL;
+        epoch_enter(files.tree, files.session);
+        removals = LOAD(files.tree->removals);
+        if (*arg != '\0')
+            result = resolve(&files, arg, len, &dir, &is_file, 0);
+        if (result == 0 && is_file)
+            result = -2;
         
-        /* Reset pointers. */
-        curr_file = dir->file_list;
-        curr_s_dir = dir->sub_dir_list;
-        
-        /* Enter all files into array of strings. */
-        while (curr_file != NULL)
+        /* The listing's session goes into the directory the way cd() does,
+         * looking again with the tree's lock held if rm is removing it at 
+         * the same moment. */
+        if (result == 0)
         {
-            s_arr[i] = malloc(strlen(curr_file->file_name) + 1);
-            if (s_arr[i] == NULL)
+            new_session(files, listing);
+            if (enter_dir(listing, dir, removals) != 0)
             {
-                printf("Memory allocation failed!\n");
-                exit(1);
+                rwlock_read(&files.tree->lock);
+                result = resolve(&files, arg, len, &dir, &is_file, 1);
+                if (result == 0 && is_file)
+                    result = -2;
+                if (result == 0)
+                    PUBLISH(listing->session->curr_dir, dir);
+                rwlock_unlock(&files.tree->lock);
             }
-            strcpy(s_arr[i++], curr_file->file_name);
-            curr_file = curr_file->next;
+            if (result != 0)
+                end_session(listing);
         }
+        epoch_leave(files.tree, files.session);
+        
+        cursor->names = NULL;
+        cursor->size = 0;
+        cursor->last = NULL;
+        cursor->last_len = 0;
+        return counted(&files, STAT_OPEN_DIR, result);
+    }
+    else
+        return -1;
+}
+
+/* This function stores the next entries, up to count of them, of the 
+ * directory a cursor from open_dir() lists in entries, in name order, and 
+ * returns how many it stored, which is 0 once there are no more. Each batch
+ * starts after the last name of the one before, so entries added or removed
+ * in between are handed out or not depending on where they fall. The names
+ * are copied into the cursor, and stay valid until the next call with it, or
+ * close_dir(). Like ls(), it takes no locks, and nothing is held between 
+ * calls.
+ */
+size_t read_dir(Dir_cursor *cursor, Dir_entry entries[], size_t count)
+{
+    if (cursor != NULL && entries != NULL)
+    {
+        Filesystem *files = &cursor->files;
+        Inode_table *inodes = files->tree->inodes;
+        Directory *dir = files->session->curr_dir;
+        const char *name;
+        unsigned int id;
+        size_t n = 0, used = 0, len, i;
+        
+        begin(files, count);
+        epoch_enter(files->tree, files->session);
+        read_in(files, dir, 0);
         
-        /* Enter all sub directories into array of strings. */
-        while (curr_s_dir != NULL)
+        /* A name that has been removed since is found by where it would 
+         * be. The last name is only needed until the buffer holding it is 
+         * written over. */
+        if (cursor->last_len == 0)
+            id = LOAD(dir->children.first);
+        else
         {
-            s_arr[i] = malloc(strlen(curr_s_dir->curr_sub->dir_name) + 1);
-            if (s_arr[i] == NULL)
-            {
-                printf("Memory allocation failed!\n");
-                exit(1);
-            }
-            strcpy(s_arr[i++], curr_s_dir->curr_sub->dir_name);
-            curr_s_dir = curr_s_dir->next;
+            id = children_seek(files, &dir->children, cursor->last, 
+                               cursor->last_len);
+            if (id != 0 && strcmp(INODE_NAME(inodes, id), cursor->last) == 0)
+                id = LOAD(INODE_NEXT(inodes, id));
         }
         
-        /* By now, s_arr will be an array of strings of both any existing files
-         * and any existing sub directories, however it will be unsorted!! */
-        
-        /* Sort the strings in the array using bubble sort.
-         * (Slow, I know hahahaha) but its easy to impliment. (= */
-        j = elements - 1;
-        while (j > 0)
+        /* The names may be freed once the epoch is left, so they are copied
+         * before that. */
+        for (; id != 0 && n < count; id = LOAD(INODE_NEXT(inodes, id)))
         {
-            for (i = 1; i <= j; i++)
+            name = INODE_NAME(inodes, id);
+            len = strlen(name) + 1;
+            if (used + len > cursor->size)
             {
-                if (strcmp(s_arr[i-1], s_arr[i]) > 0)
+                cursor->size = (used + len) * 2;
+                cursor->names = realloc(cursor->names, cursor->size);
+                if (cursor->names == NULL)
                 {
-                    tmp_s = s_arr[i-1];
-                    s_arr[i-1] = s_arr[i];
-                    s_arr[i] = tmp_s;
+                    printf("Memory allocation failed!\n");
+                    exit(1);
                 }
-            }      
-            j--;
+            }
+            memcpy(cursor->names + used, name, len);
+            used += len;
+            entries[n].is_dir = INODE_KIND(inodes, id) == SLOT_DIR;
+            n++;
         }
+        epoch_leave(files->tree, files->session);
+        COUNT(files->session->counters.scanned, n);
         
-        /* Print the sorted names, and append "/" to sub directories. */
-        i = 0;
-        while (i < elements)
+        for (i = 0, name = cursor->names; i < n; i++, name += len + 1)
         {
-            if (is_dir(dir, s_arr[i])) /* To find out if the name is a dir.   */
-                printf("%s/\n", s_arr[i++]);
-            
-            else
-                printf("%s\n", s_arr[i++]);
+            entries[i].name = name;
+            len = strlen(name);
         }
-        
-        /* Free all malloc'd memory */
-        i = 0;
-        while (i < elements)
+        if (n > 0)
         {
-            free(s_arr[i++]);
+            cursor->last = entries[n - 1].name;
+            cursor->last_len = len;
         }
-        free(s_arr);
+        counted(files, STAT_READ_DIR, 0);
+        return n;
     }
+    else
+        return 0;
 }
 
-static int is_dir(Directory *dir, char *str)
+/* This function ends a listing started by open_dir(), after which the names
+ * it handed out are freed and the directory may be removed or moved.
+ */
+void close_dir(Dir_cursor *cursor)
 {
-    Sub_directory *curr_s_dir = dir->sub_dir_list;
-    
-    /* Simply checks if the current directory contains any sub directories with
-     * the given name str. */
-    while (curr_s_dir != NULL)
+    if (cursor != NULL && cursor->files.session != NULL)
     {
-        if (strcmp(str, curr_s_dir->curr_sub->dir_name) == 0)
-            return 1;
-        
-        curr_s_dir = curr_s_dir->next;
-    }
-    return 0;
-}
-
-
-/* This function will deallocate any dynamically-allocated memory that is used 
- * by the Filesystem variable that its parameter files points to, destroying the 
- * filesystem and all its data in the process. The parameter files will use no 
- * dynamically-allocated memory at all after this function is called. (i.e. the
- * filesystem variable will not contain any memory leaks. */
-void rmfs(Filesystem *files)
-{
-    if (files != NULL)
-    {
-        remove_contents(files->root);
+        free(cursor->names);
+        cursor->names = NULL;
+        cursor->last = NULL;
+        end_session(&cursor->files);
     }
 }
 
-/* This function’s usual effect is to remove a file or a directory from the 
- * current directory. In removing files and directories this function will 
- * ensure that no memory leaks occur. The last file or directory could be 
- * removed from a directory, causing it to become an empty directory with no 
- * contents, but the current directory can never be removed.*/
-int rm(Filesystem *files, const char arg[])
+/* This function calls callback, with context, for its argument and for every
+ * file and directory below it, passing each one's full path and whether it 
+ * is a directory. The argument may be a path; the empty string stands for 
+ * the current directory, and a file is reported on its own. The directories 
+ * are shared out between the given number of threads, the calling one 
+ * included: each thread works through the directories it finds itself, and
+ * once it runs out takes one that another thread found but has not got to
+ * yet. So callback may be called from several threads at once, and the 
+ * entries are reported in no particular order. Like ls(), the walk takes no
+ * locks, and an entry that is added or removed while it runs may or may not
+ * be reported. The function returns -1 if the argument does not exist, and
+ * 0 otherwise.
+ */
+int walk(Filesystem files, const char arg[], Walk_callback callback,
+         void *context, int threads)
 {
-    if (files != NULL && arg != NULL)
+    if (arg != NULL && callback != NULL)
     {
-        File *prev_file = NULL, *curr_file = files->curr_dir->file_list, 
-        *tmp_file;
-        Sub_directory *prev_s_d = NULL, 
-        *curr_s_d = files->curr_dir->sub_dir_list, *tmp_s_d;
-        int exist_file = 0, exist_dir = 0;
-        
-        /* If arg is an empty string */
-        if (*arg == '\0')
-            return -3;
+        Tree *tree = files.tree;
+        Directory *dir = files.session->curr_dir;
+        Walker *walker;
+        Walk walk;
+        const char *path, *name;
+        size_t len, name_len;
+        int is_file = 0, result = 0, i;
         
-        /* If arg is . (a single period), .., or / */
-        if ((strcmp(arg, ".") == 0) || (strcmp(arg, "..") == 0) || 
-            (strcmp(arg, "/") == 0))
-            return -2;
-        
-        while (curr_file != NULL)
+        /* If arg is the empty string, the current directory is walked. 
+         * Otherwise arg may not lead to an existing file or directory. */
+        epoch_enter(tree, files.session);
+        if (*arg != '\0')
+            result = resolve(&files, arg, strlen(arg), &dir, &is_file, 0);
+        if (result != 0)
         {
-            if(strcmp(arg, curr_file->file_name) == 0)
-            {
-                exist_file = 1;
-                break;
-            }
-            prev_file = curr_file;
-            curr_file = curr_file->next;
+            epoch_leave(tree, files.session);
+            return counted(&files, STAT_WALK, -1);
         }
         
-        while (curr_s_d != NULL)
+        /* Every thread but the calling one has a session of its own, which
+         * stays in an epoch until the walk is over, so that nothing the walk
+         * has found is freed before then. */
+        walk.count = threads > 1 && !is_file ? threads : 1;
+        walk.walkers = arena_alloc(tree->arena, walk.count * sizeof(Walker));
+        walk.callback = callback;
+        walk.context = context;
+        walk.seeded = 0;
+        for (i = 0; i < walk.count; i++)
         {
-            if (strcmp(arg, curr_s_d->curr_sub->dir_name) == 0)
+            walker = &walk.walkers[i];
+            walker->buf = NULL;
+            walker->size = 0;
+            if (i == 0)
+                walker->files = files;
+            else
             {
-                exist_dir = 1;
-                break;
+                new_session(files, &walker->files);
+                epoch_enter(tree, walker->files.session);
             }
-            prev_s_d = curr_s_d;
-            curr_s_d = curr_s_d->next;
         }
+        path = dir_path(&files, dir, 0);
+        len = dir == tree->root ? 0 : strlen(path);
         
-        /* If the current directory does not contain a file or sub directory 
-         * with the name that arg refers to. */
-        if (!exist_dir && !exist_file)
-            return -1;
+        /* If arg names a file, only that file is reported. */
+        if (is_file)
+        {
+            split_path(arg, &name, &name_len);
+            walk_name(&walk.walkers[0], path, len, name, name_len);
+            callback(context, walk.walkers[0].buf, 0);
+        }
         
-        /* At this point there must exist a file OR sub directory within the 
-         * current directory with the name that arg refers to. */
+        /* Otherwise the directory itself is reported, and then its entries,
+         * its sub directories being dealt out between the threads to start 
+         * them off. */
+        else
+        {
+            callback(context, path, 1);
+            walk.pool = pool_new(walk.count, walk_dir, &walk);
+            walk_entries(&walk, 0, walk_item(dir, path, len), 1);
+            pool_run(walk.pool);
+            pool_free(walk.pool);
+        }
         
-        /* If there exists a file with the name that arg refers to, remove it */
-        if (exist_file)
+        for (i = 0; i < walk.count; i++)
         {
-            tmp_file = curr_file;
-            
-            if (prev_file == NULL) /* If the file to remove is the first file */
+            walker = &walk.walkers[i];
+            free(walker->buf);
+            if (i > 0)
             {
-                files->curr_dir->file_list = curr_file->next;
-                free(tmp_file->file_name);
-                free(tmp_file);
-                return 0;
+                epoch_leave(tree, walker->files.session);
+                end_session(&walker->files);
             }
-            
-            prev_file->next = curr_file->next;
-            free(tmp_file->file_name);
-            free(tmp_file);
-            return 0;
         }
+        arena_free(tree->arena, walk.walkers, walk.count * sizeof(Walker));
+        epoch_leave(tree, files.session);
+        return counted(&files, STAT_WALK, 0);
+    }
+    else
+        return 0;
+}
+
+/* This function stores in usage what is below its argument: how many files
+ * and directories there are at every level, the bytes of all of their names
+ * and the most levels of directories there are below it. The argument may 
+ * be a path; the empty string stands for the current directory, and nothing
+ * is below a file. The totals are kept up to date as entries come and go, 
+ * so this takes the same time however much is below the argument. While 
+ * other threads change the tree, each total is one that the argument has 
+ * had, but they may not all be from the same moment. The function returns 
+ * -1 if the argument does not exist, and 0 otherwise.
+ */
+int du(Filesystem files, const char arg[], Usage *usage)
+{
+    if (arg != NULL && usage != NULL)
+    {
+        Directory *dir = files.session->curr_dir;
+        int is_file = 0, result = 0;
         
-        else
+        /* The directory itself need not have been read in from the image,
+         * since its totals are in its record. */
+        epoch_enter(files.tree, files.session);
+        if (*arg != '\0')
+            result = resolve(&files, arg, strlen(arg), &dir, &is_file, 0);
+        if (result == 0 && is_file)
+            memset(usage, 0, sizeof(Usage));
+        else if (result == 0)
         {
-            tmp_s_d = curr_s_d;
-            
-            if (prev_s_d == NULL) /* If the sub dir to remove is the first */
+            usage->files = LOAD(dir->usage.files);
+            usage->dirs = LOAD(dir->usage.dirs);
+            usage->name_bytes = LOAD(dir->usage.name_bytes);
+            usage->depth = LOAD(dir->usage.depth);
+        }
+        epoch_leave(files.tree, files.session);
+        return counted(&files, STAT_DU, result == 0 ? 0 : -1);
+    }
+    else
+        return 0;
+}
+
+/* This function finds the entries whose names start with what follows the last
+ * / of arg (all of arg if there is none) in the directory that the part up to
+ * it leads to (the current directory if that is empty), for completing a name
+ * as it is typed. callback is given context, each name, in sorted order, and
+ * whether it is a sub directory. It returns how many there were, or -1 if the
+ * directory does not exist. Like ls, it takes no locks, and only the entries 
+ * that match are looked at. */
+int complete(Filesystem files, const char arg[], Walk_callback callback,
+             void *context)
+{
+    if (arg != NULL && callback != NULL)
+    {
+        Directory *dir = files.session->curr_dir;
+        Inode_table *inodes = files.tree->inodes;
+        const char *prefix = strrchr(arg, '/');
+        size_t len;
+        unsigned int id;
+        int is_file = 0, result = 0;
+        
+        prefix = prefix != NULL ? prefix + 1 : arg;
+        len = strlen(prefix);
+        epoch_enter(files.tree, files.session);
+        if (prefix > arg)
+            result = resolve(&files, arg, prefix - arg, &dir, &is_file, 0);
+        if (result == 0 && !is_file)
+        {
+            read_in(&files, dir, 0);
+            for (id = children_seek(&files, &dir->children, prefix, len); 
+                 id != 0 && strncmp(INODE_NAME(inodes, id), prefix, len) == 0;
+                 id = LOAD(INODE_NEXT(inodes, id)))
             {
-                files->curr_dir->sub_dir_list = curr_s_d->next;
-                remove_contents(tmp_s_d->curr_sub);
-                free(tmp_s_d);
-                return 0;
+                callback(context, INODE_NAME(inodes, id), 
+                         INODE_KIND(inodes, id) == SLOT_DIR);
+                result++;
             }
-            
-            prev_s_d->next = curr_s_d->next;
-            remove_contents(tmp_s_d->curr_sub);
-            free(tmp_s_d);
-            return 0;
+            COUNT(files.session->counters.scanned, result);
         }
+        else
+            result = -1;
+        epoch_leave(files.tree, files.session);
+        counted(&files, STAT_COMPLETE, result < 0 ? -1 : 0);
+        return result;
     }
     else
         return 0;
 }
 
-static void remove_contents(Directory *dir)
+static void print_children(Filesystem *files, Directory *dir)
 {
-    Sub_directory *travel_sub_dir, *tmp_sub_dir, **prev_sub_dir;
-    Directory *tmp_dir;
-    File *tmp_file, *tmp_file_next;
-    travel_sub_dir = dir->sub_dir_list;
-    prev_sub_dir = &dir->sub_dir_list;
+    Tree *tree = files->tree;
+    Inode_table *inodes = tree->inodes;
+    const Image_dir *record = LOAD(dir->image);
+    const Image_entry *entry;
+    const char *name;
+    unsigned int id;
+    unsigned long i;
     
-    while (dir->sub_dir_list != NULL)
+    /* A copy has no record to list, so it is read in. */
+    if (record == NULL)
+        read_in(files, dir, 0);
+    
+    /* An image directory record holds its entries in sorted order too. It 
+     * never changes, even once the directory has been read in. */
+    if (record != NULL)
     {
-        
-        while (travel_sub_dir->next != NULL)
+        for (i = 0; (entry = image_entry(tree->image, record, i)) != NULL; i++)
         {
-            prev_sub_dir = &travel_sub_dir->next;
-            travel_sub_dir = travel_sub_dir->next;
+            if ((name = image_name(tree->image, entry)) == NULL)
+                continue;
+            if (entry->kind == IMAGE_DIR)
+                printf("%s/\n", name);
+            else
+                printf("%s\n", name);
         }
-        
-        if (travel_sub_dir->curr_sub->sub_dir_list != NULL)
+        COUNT(files->session->counters.scanned, i);
+        return;
+    }
+    
+    /* The ordered index already holds the names in sorted order, with a flag
+     * telling sub directories apart, so this is a single walk along the next
+     * fields of the entries. An entry taken out of the list while it is 
+     * walked still leads back into it. */
+    for (i = 0, id = LOAD(dir->children.first); id != 0; 
+         i++, id = LOAD(INODE_NEXT(inodes, id)))
+    {
+        if (INODE_KIND(inodes, id) == SLOT_DIR)
+            printf("%s/\n", INODE_NAME(inodes, id));
+        else
+            printf("%s\n", INODE_NAME(inodes, id));
+    }
+    COUNT(files->session->counters.scanned, i);
+}
+
+static unsigned long print_matching(Filesystem *files, Directory *dir, 
+                                    const char *pattern, size_t len, 
+                                    const char *path, size_t path_len)
+{
+    Inode_table *inodes = files->tree->inodes;
+    size_t prefix = glob_prefix(pattern, len);
+    unsigned long printed = 0, scanned = 0;
+    const char *name;
+    unsigned int id;
+    
+    read_in(files, dir, 0);
+    for (id = children_seek(files, &dir->children, pattern, prefix); 
+         id != 0 && strncmp(INODE_NAME(inodes, id), pattern, prefix) == 0;
+         id = LOAD(INODE_NEXT(inodes, id)))
+    {
+        scanned++;
+        name = INODE_NAME(inodes, id);
+        if (!glob_match(pattern, len, name))
+            continue;
+        printf("%.*s%s%s\n", (int) path_len, path, name, 
+               INODE_KIND(inodes, id) == SLOT_DIR ? "/" : "");
+        printed++;
+    }
+    COUNT(files->session->counters.scanned, scanned);
+    return printed;
+}
+
+static void walk_dir(void *context, int worker, void *task)
+{
+    walk_entries(context, worker, task, 0);
+}
+
+static void walk_entries(Walk *walk, int worker, Walk_item *item, int deal)
+{
+    Walker *walker = &walk->walkers[worker];
+    Inode_table *inodes = walker->files.tree->inodes;
+    const char *name;
+    size_t len;
+    unsigned int id;
+    unsigned long scanned = 0;
+    int is_dir;
+    
+    /* Like print_children(), this follows the ordered index without a lock,
+     * once the directory has been read in. */
+    read_in(&walker->files, item->dir, 0);
+    for (id = LOAD(item->dir->children.first); id != 0; 
+         id = LOAD(INODE_NEXT(inodes, id)))
+    {
+        scanned++;
+        name = INODE_NAME(inodes, id);
+        is_dir = INODE_KIND(inodes, id) == SLOT_DIR;
+        len = walk_name(walker, item->path, item->len, name, strlen(name));
+        walk->callback(walk->context, walker->buf, is_dir);
+        if (is_dir)
+            pool_push(walk->pool, 
+                      deal ? (int) (walk->seeded++ % walk->count) : worker,
+                      walk_item(INODE_ENTRY(inodes, id).dir, walker->buf, 
+                                len));
+    }
+    COUNT(walker->files.session->counters.scanned, scanned);
+    free(item);
+}
+
+static Walk_item *walk_item(Directory *dir, const char *path, size_t len)
+{
+    Walk_item *item = malloc(offsetof(Walk_item, path) + len + 1);
+    
+    if (item == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    item->dir = dir;
+    item->len = len;
+    memcpy(item->path, path, len);
+    item->path[len] = '\0';
+    return item;
+}
+
+static size_t walk_name(Walker *walker, const char *path, size_t len, 
+                        const char *name, size_t name_len)
+{
+    size_t size = len + name_len + 2;
+    
+    if (size > walker->size)
+    {
+        walker->size = size * 2;
+        walker->buf = realloc(walker->buf, walker->size);
+        if (walker->buf == NULL)
         {
-            prev_sub_dir = &travel_sub_dir->curr_sub->sub_dir_list;
-            travel_sub_dir = travel_sub_dir->curr_sub->sub_dir_list;
+            printf("Memory allocation failed!\n");
+            exit(1);
         }
+    }
+    memcpy(walker->buf, path, len);
+    walker->buf[len] = '/';
+    memcpy(walker->buf + len + 1, name, name_len);
+    walker->buf[len + 1 + name_len] = '\0';
+    return len + 1 + name_len;
+}
+
+static size_t path_length(Tree *tree, Directory *dir)
+{
+    size_t len = 0;
+    
+    if (dir == tree->root)
+        return 1;
+    for (; dir != tree->root; dir = dir->parent_dir)
+        len += strlen(INODE_NAME(tree->inodes, LOAD(dir->id))) + 1;
+    return len;
+}
+
+static const char *dir_path(Filesystem *files, Directory *dir, int locked)
+{
+    Tree *tree = files->tree;
+    Dentry_cache *cache = tree->dentries;
+    Dir_path *path = LOAD(dir->path), *old;
+    size_t len;
+    
+    if (path != NULL && path->generation == LOAD(cache->renames))
+        return path->text;
+    
+    /* Two threads may ask for the same path at once, but only one builds it.
+     * The rename count is read first, so a path built while a rename is 
+     * being made is already stale. */
+    if (!locked)
+        rwlock_read(&tree->lock);
+    mutex_lock(&cache->paths_lock);
+    old = dir->path;
+    if (old == NULL || old->generation != cache->renames)
+    {
+        len = path_length(tree, dir);
+        path = arena_alloc(tree->arena, path_size(len));
+        path->generation = cache->renames;
+        path->len = len;
+        fill_path(tree, dir, path->text, len);
+        PUBLISH(dir->path, path);
+        if (old != NULL)
+            epoch_retire(tree, files->session, release_memory, old, 
+                         path_size(old->len));
+    }
+    path = dir->path;
+    mutex_unlock(&cache->paths_lock);
+    if (!locked)
+        rwlock_unlock(&tree->lock);
+    return path->text;
+}
+
+static void fill_path(Tree *tree, Directory *dir, char *buf, size_t len)
+{
+    const char *name;
+    size_t name_len;
+    
+    buf[len] = '\0';
+    if (dir == tree->root)
+        buf[0] = '/';
+    for (; dir != tree->root; dir = dir->parent_dir)
+    {
+        name = INODE_NAME(tree->inodes, LOAD(dir->id));
+        name_len = strlen(name);
+        len -= name_len;
+        memcpy(buf + len, name, name_len);
+        buf[--len] = '/';
+    }
+}
+
+static void init_contents(Directory *dir, unsigned long seed)
+{
+    memset(&dir->index, 0, sizeof(Name_index));
+    memset(&dir->children, 0, sizeof(Child_list));
+    dir->children.seed = seed | 1;
+    dir->path = NULL;
+    dir->image = NULL;
+    dir->origin = NULL;
+    dir->copies = NULL;
+    dir->next_copy = NULL;
+    dir->prev_copy = NULL;
+    dir->removing = 0;
+    memset(&dir->usage, 0, sizeof(Usage));
+    dir->tallest = 0;
+    dir->counted = 0;
+    rwlock_init(&dir->lock);
+}
+
+static void dir_fault(Filesystem *files, Directory *dir)
+{
+    Tree *tree = files->tree;
+    const Image_dir *record = dir->image;
+    const Image_entry *entry;
+    const Image_dir *sub;
+    const char *name, *data;
+    Usage found = {0, 0, 0, 0};
+    unsigned long i, hash, depth;
+    unsigned int id;
+    size_t len;
+    
+    if (dir->origin != NULL)
+    {
+        copy_in(files, dir);
+        return;
+    }
+    if (record == NULL)
+        return;
+    
+    /* Entries the image is damaged at, and names that could not have been 
+     * created (or repeat an earlier one), are left out. */
+    for (i = 0; (entry = image_entry(tree->image, record, i)) != NULL; i++)
+    {
+        if ((name = image_name(tree->image, entry)) == NULL)
+            continue;
+        len = entry->name_len;
+        hash = name_hash(name, len);
+        if (is_special(name, len) || memchr(name, '/', len) != NULL ||
+            index_lookup(files, &dir->index, name, len, hash) != NULL)
+            continue;
         
-        else
+        /* The names are only ever freed or replaced, never written to, so 
+         * they can stay in the read only mapping. */
+        if (entry->kind == IMAGE_FILE && 
+            (data = image_data(tree->image, entry)) != NULL)
         {
-            tmp_dir = travel_sub_dir->curr_sub;
-            tmp_sub_dir = travel_sub_dir;
-            travel_sub_dir = dir->sub_dir_list;
-            
-            if (tmp_dir->file_list != NULL)
-            {
-                tmp_file = tmp_dir->file_list;
-                while (tmp_file != NULL)
-                {
-                    tmp_file_next = tmp_file->next;
-                    free(tmp_file->file_name);
-                    free(tmp_file);
-                    tmp_file = tmp_file_next;
-                }
-            }
-            tmp_dir->file_list = NULL;
-            free(tmp_dir->dir_name);
-            free(tmp_dir);
-            free(tmp_sub_dir);
-            *prev_sub_dir = NULL;
-            prev_sub_dir = &dir->sub_dir_list;
+            id = add_file(files, dir, name, len, hash);
+            if (entry->size > 0)
+                file_map(file_of(tree, id), data, entry->size);
+            found.files++;
+            found.name_bytes += len;
+        }
+        else if (entry->kind == IMAGE_DIR &&
+                 (sub = image_subdir(tree->image, entry)) != NULL)
+        {
+            add_dir(files, dir, name, len, hash, sub, NULL);
+            found.files += sub->files;
+            found.dirs += sub->dirs + 1;
+            found.name_bytes += sub->name_bytes + len;
         }
     }
     
-    if (dir->file_list != NULL)
+    /* The totals the image recorded only differ from what was read in if 
+     * entries were left out, in which case they are put right here and 
+     * above. Adding the difference works either way, since the counts 
+     * wrap. */
+    if (found.files != dir->usage.files || found.dirs != dir->usage.dirs ||
+        found.name_bytes != dir->usage.name_bytes)
+        add_usage(tree, dir, found.files - dir->usage.files, 
+                  found.dirs - dir->usage.dirs, 
+                  found.name_bytes - dir->usage.name_bytes, 0);
+    mutex_lock(&tree->usage_lock);
+    depth = dir->usage.depth;
+    measure_depth(tree, dir);
+    if (dir->counted && dir->usage.depth != depth)
+        count_depth(tree, dir->parent_dir, depth + 1, dir->usage.depth + 1);
+    mutex_unlock(&tree->usage_lock);
+    
+    /* Threads without the lock list the directory from the image until its
+     * indexes are complete. */
+    PUBLISH(dir->image, NULL);
+}
+
+static void copy_in(Filesystem *files, Directory *dir)
+{
+    Tree *tree = files->tree;
+    Inode_table *inodes = tree->inodes;
+    Directory *sub;
+    const Image_dir *image;
+    const char *name;
+    size_t len;
+    unsigned long hash;
+    unsigned int id, made;
+    
+    /* Nothing changes the origin while it has copies waiting, since every
+     * writer reads those in first. */
+    for (id = dir->origin->children.first; id != 0; 
+         id = INODE_NEXT(inodes, id))
     {
-        tmp_file = dir->file_list;
-        while (tmp_file != NULL)
+        name = INODE_NAME(inodes, id);
+        len = strlen(name);
+        hash = name_hash(name, len);
+        if (INODE_KIND(inodes, id) == SLOT_FILE)
         {
-            tmp_file_next = tmp_file->next;
-            free(tmp_file->file_name);
-            free(tmp_file);
-            tmp_file = tmp_file_next;
+            made = add_file(files, dir, name, len, hash);
+            if (INODE_ENTRY(inodes, id).file != NULL)
+                file_clone(tree->blocks, file_of(tree, made), 
+                           INODE_ENTRY(inodes, id).file);
+            continue;
         }
+        /* A sub directory may be read in from the image meanwhile. */
+        sub = INODE_ENTRY(inodes, id).dir;
+        image = LOAD(sub->image);
+        add_dir(files, dir, name, len, hash, image, 
+                image == NULL ? sub : NULL);
     }
-    free(dir->dir_name);
-    free(dir);
+    
+    /* The totals were taken from the origin when the copy was made, and 
+     * each sub directory's depth is already counted in them. */
+    mutex_lock(&tree->usage_lock);
+    measure_depth(tree, dir);
+    mutex_unlock(&tree->usage_lock);
+    
+    /* The new copies are counted before this one stops being, so that the
+     * count never reaches 0 while any are waiting. */
+    drop_copy(tree, dir);
 }
 
-/* This function’s usual effect is to change the name of a file or directory. 
- * The name of the current directory cannot be changed by this function, nor can 
- * the name of any directory between the root and the current directory. */
-int re_name(Filesystem *files, const char arg1[], const char arg2[])
+static void share(Tree *tree, Directory *copy, Directory *origin)
 {
-    if (files != NULL && arg1 != NULL && arg2 != NULL)
+    /* The origin may be a copy that another writer is reading in, which 
+     * drops it under the same lock. */
+    mutex_lock(&tree->copies_lock);
+    if (origin->origin != NULL)
+        origin = origin->origin;
+    copy->usage = origin->usage;
+    copy->origin = origin;
+    copy->prev_copy = NULL;
+    copy->next_copy = origin->copies;
+    if (origin->copies != NULL)
+        origin->copies->prev_copy = copy;
+    PUBLISH(origin->copies, copy);
+    PUBLISH(tree->pending, tree->pending + 1);
+    mutex_unlock(&tree->copies_lock);
+}
+
+static void drop_copy(Tree *tree, Directory *copy)
+{
+    mutex_lock(&tree->copies_lock);
+    if (copy->prev_copy != NULL)
+        copy->prev_copy->next_copy = copy->next_copy;
+    else
+        PUBLISH(copy->origin->copies, copy->next_copy);
+    if (copy->next_copy != NULL)
+        copy->next_copy->prev_copy = copy->prev_copy;
+    PUBLISH(tree->pending, tree->pending - 1);
+    
+    /* Threads without the lock read the copy in until its indexes are 
+     * complete. */
+    PUBLISH(copy->origin, NULL);
+    mutex_unlock(&tree->copies_lock);
+}
+
+static Directory *first_copy(Tree *tree, Directory *origin)
+{
+    Directory *copy;
+    
+    mutex_lock(&tree->copies_lock);
+    copy = origin->copies;
+    mutex_unlock(&tree->copies_lock);
+    return copy;
+}
+
+static void lock_dir(Filesystem *files, Directory *dir, int write)
+{
+    if (write)
     {
-        int exist_dir = 0, exist_file = 0, exist_arg2 = 0;
-        File *curr_file = files->curr_dir->file_list;
-        Sub_directory *curr_s_d = files->curr_dir->sub_dir_list;
-        
-        /* If arg1 or arg2 is an empty string */
-        if (*arg1 == '\0' || *arg2 == '\0')
-            return -2;
-        
-        /* If arg1 or arg2 is either ".", "..", or "/" */
-        if ((strcmp(arg1, ".") == 0) || (strcmp(arg1, "..") == 0) || 
-            (strcmp(arg1, "/") == 0) || (strcmp(arg2, ".") == 0) ||
-            (strcmp(arg2, "..") == 0) || (strcmp(arg2, "/") == 0))
-            return -3;
-        
-        while (curr_file != NULL)
+        rwlock_write(&dir->lock);
+        dir_fault(files, dir);
+        return;
+    }
+    
+    /* Reading a directory in from the image, or a copy in from its origin, 
+     * changes it, so that needs the lock for writing. A directory that has 
+     * been read in stays that way. */
+    rwlock_read(&dir->lock);
+    if (dir->image != NULL || dir->origin != NULL)
+    {
+        rwlock_unlock(&dir->lock);
+        rwlock_write(&dir->lock);
+        dir_fault(files, dir);
+        rwlock_unlock(&dir->lock);
+        rwlock_read(&dir->lock);
+    }
+}
+
+static void read_in(Filesystem *files, Directory *dir, int locked)
+{
+    /* The tree's lock keeps save_fs() from reading the directory while it 
+     * is half read in. */
+    if (LOAD(dir->image) == NULL && LOAD(dir->origin) == NULL)
+        return;
+    if (!locked)
+        rwlock_read(&files->tree->lock);
+    lock_dir(files, dir, 1);
+    rwlock_unlock(&dir->lock);
+    if (!locked)
+        rwlock_unlock(&files->tree->lock);
+}
+
+static void lock_tree(Filesystem *files, int exclusive)
+{
+    epoch_enter(files->tree, files->session);
+    if (exclusive)
+        rwlock_write(&files->tree->lock);
+    else
+        rwlock_read(&files->tree->lock);
+}
+
+static void unshare(Filesystem *files, Directory *dir)
+{
+    Tree *tree = files->tree;
+    Directory *d, *top, *copy;
+    
+    if (LOAD(tree->pending) == 0)
+        return;
+    
+    /* A copy is never above another directory, so it is never one of these
+     * and already locked. Whether a directory has copies is first read 
+     * without any lock, which almost always shows that none of these do. 
+     * The highest one that does has its copies read in, which can give 
+     * those below it copies of their own, so the walk up is made again 
+     * until none is left. Other writers may be reading in the same copies,
+     * or making new copies of a directory while one of its copies is read 
+     * in, so the list is only followed under copies_lock; a copy being read
+     * in elsewhere is waited for on its lock. */
+    for (;;)
+    {
+        top = NULL;
+        for (d = dir; ; d = d->parent_dir)
         {
-            if (strcmp(arg1, curr_file->file_name) == 0)
-            {
-                exist_file = 1;
+            if (LOAD(d->copies) != NULL)
+                top = d;
+            if (d == tree->root)
                 break;
-            }
-            if (strcmp(arg2, curr_file->file_name) == 0)
-                exist_arg2 = 1;
-            
-            curr_file = curr_file->next;
         }
-        
-        while (curr_s_d != NULL)
+        if (top == NULL)
+            return;
+        while ((copy = first_copy(tree, top)) != NULL)
         {
-            if (strcmp(arg1, curr_s_d->curr_sub->dir_name) == 0)
-            {
-                exist_dir = 1;
-                break;
-            }
-            if (strcmp(arg2, curr_s_d->curr_sub->dir_name) == 0)
-                exist_arg2 = 1;
-            
-            curr_s_d = curr_s_d->next;
+            lock_dir(files, copy, 1);
+            rwlock_unlock(&copy->lock);
         }
-        
-        /* If arg2 is a different name from arg1 but there is already a file or
-         * directory in the current directory with the name arg2 */
-        if (exist_arg2 && (strcmp(arg1, arg2) != 0))
-            return -3;
-        
-        /* If there does not exist a file or sub directory in the current 
-         * directory with the name of arg1 */
-        if (!exist_dir && !exist_file)
-            return -1;
-        
-        /* If arg1 is the name of a file or directory that exists in the current 
-         * directory at that time, and arg2 is the same as arg1 */
-        if ((exist_file || exist_dir) && (strcmp(arg1, arg2) == 0))
-            return -4;
-        
-        /* If arg1 is the name of a file or directory that exists in the current 
-         * directory at that time, and there is not already a file or directory 
-         * in the current directory named arg2, the function will try to change 
-         * arg1’s name to arg2 */
-        if (exist_file)
+    }
+}
+
+static void unshare_below(Filesystem *files, Directory *target)
+{
+    Tree *tree = files->tree;
+    Inode_table *inodes = tree->inodes;
+    Directory **dirs, *copy;
+    unsigned int id;
+    size_t count = 1, size = 16, i;
+    int faulted = 1;
+    
+    if (LOAD(tree->pending) == 0)
+        return;
+    
+    dirs = malloc(size * sizeof(Directory *));
+    if (dirs == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    dirs[0] = target;
+    
+    /* Reading copies in only ever adds directories outside the sub 
+     * directory, so what is below it can be listed first. */
+    for (i = 0; i < count; i++)
+        for (id = dirs[i]->children.first; id != 0; 
+             id = INODE_NEXT(inodes, id))
         {
-            free(curr_file->file_name);
-            curr_file->file_name = malloc(strlen(arg2) + 1);
-            
-            if (curr_file->file_name == NULL)
+            if (INODE_KIND(inodes, id) != SLOT_DIR)
+                continue;
+            if (count == size)
             {
-                printf("Memory allocation failed!\n");
-                exit(1);
+                size *= 2;
+                dirs = realloc(dirs, size * sizeof(Directory *));
+                if (dirs == NULL)
+                {
+                    printf("Memory allocation failed!\n");
+                    exit(1);
+                }
             }
-            
-            strcpy(curr_file->file_name, arg2);
-            return 0;
+            dirs[count++] = INODE_ENTRY(inodes, id).dir;
         }
-        else
-        {
-            free(curr_s_d->curr_sub->dir_name);
-            curr_s_d->curr_sub->dir_name = malloc(strlen(arg2) + 1);
-            
-            if (curr_s_d->curr_sub->dir_name == NULL)
+    
+    /* Reading in a copy that stays can make copies of other directories 
+     * being removed, even of those already looked at, so this goes on until
+     * none are left. The copies being removed are dropped last, since 
+     * reading the others in may still need their origins. */
+    while (faulted)
+    {
+        faulted = 0;
+        for (i = 0; i < count; i++)
+            for (copy = dirs[i]->copies; copy != NULL; )
             {
-                printf("Memory allocation failed!\n");
-                exit(1);
+                if (is_ancestor(target, copy))
+                {
+                    copy = copy->next_copy;
+                    continue;
+                }
+                lock_dir(files, copy, 1);
+                rwlock_unlock(&copy->lock);
+                faulted = 1;
+                copy = dirs[i]->copies;
             }
-            
-            strcpy(curr_s_d->curr_sub->dir_name, arg2);
-            return 0;
-        }
     }
-    else
+    for (i = 0; i < count; i++)
+        if (dirs[i]->origin != NULL)
+            drop_copy(tree, dirs[i]);
+    free(dirs);
+}
+
+static void release(Filesystem *files, Directory *dir, int checkpoint)
+{
+    if (dir != NULL)
+        rwlock_unlock(&dir->lock);
+    rwlock_unlock(&files->tree->lock);
+    epoch_leave(files->tree, files->session);
+    if (checkpoint)
+        checkpoint_fs(files);
+}
+
+static Session *session_new(Tree *tree)
+{
+    Session *session = arena_alloc(tree->arena, sizeof(Session));
+    
+    session->curr_dir = tree->root;
+    session->epoch = 0;
+    session->retired = NULL;
+    session->retired_count = 0;
+    session->reclaim_at = EPOCH_BATCH;
+    memset(&session->counters, 0, sizeof(Counters));
+    session->id = ++tree->session_ids;
+    session->traced = NULL;
+    session->prev = NULL;
+    session->next = tree->sessions;
+    if (tree->sessions != NULL)
+        tree->sessions->prev = session;
+    tree->sessions = session;
+    return session;
+}
+
+static int enter_dir(Filesystem *files, Directory *dir, 
+                     unsigned long removals)
+{
+    Directory *prev = files->session->curr_dir, *d;
+    
+    /* rm counts the removal it begins and sets removing before it looks at
+     * the current directories, and this sets the current directory before 
+     * it looks at the count, so at least one of them sees the other. A 
+     * removal that had ended before the directory was looked for left 
+     * nothing to find, so unless one was under way then, or has begun 
+     * since, the directories above need not be looked at. */
+    PUBLISH(files->session->curr_dir, dir);
+    FENCE();
+    if (removals % 2 == 0 && LOAD(files->tree->removals) == removals)
         return 0;
+    for (d = dir; ; d = LOAD(d->parent_dir))
+    {
+        if (LOAD(d->removing))
+        {
+            PUBLISH(files->session->curr_dir, prev);
+            return -1;
+        }
+        if (d == files->tree->root)
+            return 0;
+    }
+}
+
+static void release_memory(Tree *tree, void *memory, size_t size)
+{
+    arena_free(tree->arena, memory, size);
+}
+
+static void release_child(Tree *tree, void *child, size_t size)
+{
+    child_free(tree->arena, child);
+}
+
+/* The entry's ID comes in place of a size, as epoch.h allows, and object is
+ * null. */
+static void release_inode(Tree *tree, void *object, size_t id)
+{
+    free_entry(tree, (unsigned int) id);
+}
+
+static void release_dir(Tree *tree, void *object, size_t size)
+{
+    remove_contents(tree, object);
+}
+
+static size_t path_size(size_t len)
+{
+    return offsetof(Dir_path, text) + len + 1;
+}
+
+static size_t dentry_size(size_t len)
+{
+    return offsetof(Dentry, path) + len;
+}
+
+static unsigned int new_entry(Tree *tree, Slot_kind kind, const char *name,
+                              size_t len, unsigned long hash)
+{
+    Inode_table *inodes = tree->inodes;
+    unsigned int id = inode_alloc(inodes, kind);
+    char *short_name = INODE_SHORT(inodes, id);
+    
+    if (image_owns(tree->image, name))
+        INODE_NAME(inodes, id) = (char *) name;
+    else if (len >= NAME_INLINE)
+        INODE_NAME(inodes, id) = name_intern(tree->names, name, len, hash);
+    else
+    {
+        memcpy(short_name, name, len);
+        short_name[len] = '\0';
+        INODE_NAME(inodes, id) = short_name;
+    }
+    INODE_ENTRY(inodes, id).file = NULL;
+    return id;
+}
+
+static void free_entry(Tree *tree, unsigned int id)
+{
+    Inode_table *inodes = tree->inodes;
+    char *name = INODE_NAME(inodes, id);
+    
+    if (name != INODE_SHORT(inodes, id) && !image_owns(tree->image, name))
+        name_release(tree->names, name);
+    inode_free(inodes, id);
+}
+
+static File *file_of(Tree *tree, unsigned int id)
+{
+    File *file = INODE_ENTRY(tree->inodes, id).file;
+    
+    if (file == NULL)
+    {
+        file = slab_alloc(&tree->arena->files);
+        file_init(file);
+        INODE_ENTRY(tree->inodes, id).file = file;
+    }
+    return file;
+}
+
+static int log_op(Filesystem *files, Journal_op op, const char *arg1,
+                  const char *arg2, unsigned long offset, const char *data,
+                  size_t len)
+{
+    Tree *tree = files->tree;
+    Journal_record record;
+    int full;
+    
+    if (tree->journal == NULL)
+        return 0;
+    
+    record.op = op;
+    record.cwd = arg1[0] == '/' ? "" 
+                                : dir_path(files, files->session->curr_dir, 1);
+    record.cwd_len = strlen(record.cwd);
+    record.arg1 = arg1;
+    record.arg1_len = strlen(arg1);
+    record.arg2 = arg2;
+    record.arg2_len = strlen(arg2);
+    record.offset = offset;
+    record.data = data;
+    record.data_len = len;
+    
+    /* A journal that cannot be written stays failed, which sync_fs() 
+     * reports; the mutation itself has already been made. */
+    mutex_lock(&tree->journal_lock);
+    journal_append(tree->journal, &record);
+    full = tree->journal->size >= JOURNAL_CHECKPOINT_SIZE;
+    mutex_unlock(&tree->journal_lock);
+    return full;
+}
+
+static int read_line(Builder *builder, char **line, size_t *len)
+{
+    char *end;
+    size_t got;
+    
+    for (;;)
+    {
+        end = memchr(builder->buf + builder->pos, '\n', 
+                     builder->len - builder->pos);
+        if (end != NULL)
+        {
+            *line = builder->buf + builder->pos;
+            *len = end - *line;
+            *end = '\0';
+            builder->pos += *len + 1;
+            return 1;
+        }
+        
+        /* The start of the line is kept, and the rest read in after it. 
+         * There is always room for a terminator after what was read. */
+        memmove(builder->buf, builder->buf + builder->pos, 
+                builder->len - builder->pos);
+        builder->len -= builder->pos;
+        builder->pos = 0;
+        if (builder->len + 1 == builder->size)
+        {
+            builder->size *= 2;
+            builder->buf = realloc(builder->buf, builder->size);
+            if (builder->buf == NULL)
+            {
+                printf("Memory allocation failed!\n");
+                exit(1);
+            }
+        }
+        got = fread(builder->buf + builder->len, 1, 
+                    builder->size - 1 - builder->len, builder->manifest);
+        builder->len += got;
+        
+        /* The last line may have no newline. */
+        if (got == 0)
+        {
+            *line = builder->buf;
+            *len = builder->len;
+            builder->buf[builder->len] = '\0';
+            builder->len = 0;
+            return *len > 0;
+        }
+    }
+}
+
+static int build_line(Builder *builder, const char *line, size_t len)
+{
+    Filesystem *files = builder->files;
+    Inode_table *inodes = files->tree->inodes;
+    Build_level *level;
+    Directory *dir, *sub = NULL;
+    Index_slot *slot;
+    const char *name;
+    size_t pos = 1, end, name_len, depth = 0;
+    unsigned long hash;
+    unsigned int id;
+    int is_dir, same = 1, after;
+    
+    if (len == 0)
+        return 0;
+    if (line[0] != '/')
+        return -1;
+    
+    for (; pos < len; pos = end + 1)
+    {
+        for (end = pos; end < len && line[end] != '/'; end++)
+            ;
+        name = line + pos;
+        name_len = end - pos;
+        is_dir = end < len;
+        if (name_len == 0 || is_special(name, name_len))
+            return -1;
+        
+        /* As long as the line starts like the one before, the directories
+         * that one went through are the ones to go through. */
+        if (same && depth + 1 < builder->depth && 
+            builder->levels[depth + 1].len == name_len &&
+            memcmp(INODE_NAME(inodes, builder->levels[depth + 1].dir->id), 
+                   name, name_len) == 0)
+        {
+            if (!is_dir)
+                return -1;
+            depth++;
+            continue;
+        }
+        same = 0;
+        builder->depth = depth + 1;
+        level = &builder->levels[depth];
+        dir = level->dir;
+        after = level->ordered && 
+                (level->last == 0 || 
+                 sorts_after(name, name_len, INODE_NAME(inodes, level->last)));
+        
+        /* Hashing a name is what most of the time of adding it goes on. A
+         * short file name that comes in order, to a directory that has no
+         * name index yet, is only hashed when the index is filled in, since
+         * new_entry() has no use for the hash of a name it keeps inline. */
+        hash = 0;
+        if (!after || is_dir || name_len >= NAME_INLINE || 
+            dir->index.table != NULL)
+            hash = name_hash(name, name_len);
+        
+        /* A name is only looked for if it might already be there, which
+         * takes the directory's name index. */
+        if (!after)
+        {
+            build_index(files, dir);
+            slot = index_lookup(files, &dir->index, name, name_len, hash);
+            if (slot != NULL && !is_dir)
+                return slot->kind == SLOT_FILE ? 0 : -1;
+            if (slot != NULL && slot->kind != SLOT_DIR)
+                return -1;
+            if (slot != NULL)
+            {
+                build_push(builder, INODE_ENTRY(inodes, slot->id).dir, 
+                           name_len, 0);
+                depth++;
+                continue;
+            }
+        }
+        
+        if (is_dir)
+        {
+            sub = make_dir(files, dir, name, name_len, hash, NULL, NULL);
+            id = sub->id;
+            dir->usage.dirs++;
+        }
+        else
+        {
+            id = new_entry(files->tree, SLOT_FILE, name, name_len, hash);
+            dir->usage.files++;
+        }
+        dir->usage.name_bytes += name_len;
+        
+        /* A directory that has had no name looked for yet gets its name 
+         * index once the build is done, all at once. */
+        if (dir->index.table != NULL)
+            index_insert(files, &dir->index, hash, name_len, 
+                         INODE_KIND(inodes, id), id);
+        else
+            dir->index.count++;
+        if (after && level->appending)
+            children_append(files, &dir->children, level->last, id, 
+                            level->tails);
+        else
+        {
+            children_insert(files, &dir->children, id);
+            level->appending = 0;
+        }
+        if (after)
+            level->last = id;
+        if (!is_dir)
+            return 0;
+        
+        if (builder->dir_count == builder->dir_cap)
+        {
+            builder->dir_cap *= 2;
+            builder->dirs = realloc(builder->dirs, 
+                                    builder->dir_cap * sizeof(Directory *));
+            if (builder->dirs == NULL)
+            {
+                printf("Memory allocation failed!\n");
+                exit(1);
+            }
+        }
+        builder->dirs[builder->dir_count++] = sub;
+        build_push(builder, sub, name_len, 1);
+        depth++;
+    }
+    return 0;
+}
+
+static void build_push(Builder *builder, Directory *dir, size_t len, 
+                       int made)
+{
+    Build_level *level;
+    
+    if (builder->depth == builder->level_cap)
+    {
+        builder->level_cap *= 2;
+        builder->levels = realloc(builder->levels, 
+                                  builder->level_cap * sizeof(Build_level));
+        if (builder->levels == NULL)
+        {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+    level = &builder->levels[builder->depth++];
+    level->dir = dir;
+    level->len = len;
+    level->ordered = made;
+    level->appending = made;
+    level->last = 0;
+    memset(level->tails, 0, sizeof(level->tails));
+}
+
+static void build_index(Filesystem *files, Directory *dir)
+{
+    if (dir->index.table == NULL && dir->index.count > 0)
+        index_fill(files, &dir->index, &dir->children);
+}
+
+static void build_usage(Builder *builder)
+{
+    Directory *sub, *dir;
+    unsigned long i;
+    
+    /* Every directory was made after the one it is in. */
+    build_index(builder->files, builder->files->tree->root);
+    for (i = builder->dir_count; i-- > 0; )
+    {
+        sub = builder->dirs[i];
+        build_index(builder->files, sub);
+        dir = sub->parent_dir;
+        dir->usage.files += sub->usage.files;
+        dir->usage.dirs += sub->usage.dirs;
+        dir->usage.name_bytes += sub->usage.name_bytes;
+        if (sub->usage.depth + 1 > dir->usage.depth)
+        {
+            dir->usage.depth = sub->usage.depth + 1;
+            dir->tallest = 1;
+        }
+        else if (sub->usage.depth + 1 == dir->usage.depth)
+            dir->tallest++;
+        sub->counted = 1;
+    }
+}
+
+static int sorts_after(const char *name, size_t len, const char *other)
+{
+    /* other is shorter if its terminator comes first, and that sorts 
+     * first. */
+    return strncmp(name, other, len) > 0;
+}
+
+static void replay_record(void *context, const Journal_record *record)
+{
+    Filesystem *files = context;
+    
+    /* Relative paths were followed from the directory that was current. */
+    files->session->curr_dir = files->tree->root;
+    if (record->cwd_len > 0 && cd(files, record->cwd) != 0)
+        return;
+    
+    switch (record->op)
+    {
+        case JOURNAL_TOUCH:
+            touch(files, record->arg1);
+            break;
+        case JOURNAL_MKDIR:
+            mkdir(files, record->arg1);
+            break;
+        case JOURNAL_RM:
+            rm(files, record->arg1);
+            break;
+        case JOURNAL_RENAME:
+            re_name(files, record->arg1, record->arg2);
+            break;
+        case JOURNAL_WRITE:
+            write_file(files, record->arg1, record->offset, record->data,
+                       record->data_len);
+            break;
+        case JOURNAL_TRUNCATE:
+            truncate_file(files, record->arg1, record->offset);
+            break;
+        case JOURNAL_COPY:
+            copy(files, record->arg1, record->arg2);
+            break;
+        case JOURNAL_MOVE:
+            move(files, record->arg1, record->arg2);
+            break;
+        case JOURNAL_SNAPSHOT:
+            snapshot(files, record->arg1);
+            break;
+    }
+}
+
+static void begin(Filesystem *files, size_t arg_len)
+{
+    Session *session = files->session;
+    
+    session->traced = LOAD(files->tree->tracer);
+    if (session->traced != NULL)
+    {
+        session->trace_begin = trace_now();
+        session->trace_len = arg_len;
+        session->trace_scanned = session->counters.scanned;
+    }
+}
+
+static int counted(Filesystem *files, Stat_op op, int result)
+{
+    Session *session = files->session;
+    Counters *counters = &session->counters;
+    Trace_event event;
+    
+    COUNT(counters->calls[op], 1);
+    if (result < 0 && result >= -STAT_CODES)
+        COUNT(counters->errors[op][-result - 1], 1);
+    
+    if (session->traced != NULL)
+    {
+        event.op = op;
+        event.result = result;
+        event.session = session->id;
+        event.arg_len = session->trace_len;
+        event.scanned = counters->scanned - session->trace_scanned;
+        event.begin = session->trace_begin;
+        event.end = trace_now();
+        trace_record(session->traced, &event);
+        session->traced = NULL;
+    }
+    return result;
+}
+
+static void add_counters(const Counters *from, Counters *to)
+{
+    int op, code;
+    
+    /* The session counted may be running, so its counters are loaded one 
+     * at a time. */
+    for (op = 0; op < STAT_OPS; op++)
+    {
+        to->calls[op] += __atomic_load_n(&from->calls[op], __ATOMIC_RELAXED);
+        for (code = 0; code < STAT_CODES; code++)
+            to->errors[op][code] += 
+                __atomic_load_n(&from->errors[op][code], __ATOMIC_RELAXED);
+    }
+    to->scanned += __atomic_load_n(&from->scanned, __ATOMIC_RELAXED);
+    to->compares += __atomic_load_n(&from->compares, __ATOMIC_RELAXED);
+}
+
+
+/* This function will deallocate any dynamically-allocated memory that is used 
+ * by the Filesystem variable that its parameter files points to, destroying the 
+ * filesystem and all its data in the process. The parameter files will use no 
+ * dynamically-allocated memory at all after this function is called. (i.e. the
+ * filesystem variable will not contain any memory leaks. Since everything in
+ * the filesystem came from its arena, this frees the arena's slabs rather than
+ * visiting every file and directory. A filesystem loaded with load_fs() also
+ * lets go of its image, and one opened with open_fs() commits and closes its
+ * journal, leaving its data on disk. Every session of the filesystem ends, 
+ * and no other thread may be using it. */
+void rmfs(Filesystem *files)
+{
+    if (files != NULL && files->tree != NULL)
+    {
+        Tree *tree = files->tree;
+        Tracer *tracer = LOAD(tree->tracer);
+        Trace_event event;
+        
+        if (tracer != NULL)
+        {
+            event.op = TRACE_RMFS;
+            event.result = 0;
+            event.session = files->session->id;
+            event.arg_len = 0;
+            event.scanned = 0;
+            event.begin = trace_now();
+        }
+        
+        if (tree->journal != NULL)
+            journal_close(tree->journal);
+        image_unmap(tree->image);
+        arena_destroy(tree->arena);
+        files->tree = NULL;
+        files->session = NULL;
+        
+        if (tracer != NULL)
+        {
+            event.end = trace_now();
+            trace_record(tracer, &event);
+        }
+    }
+}
+
+/* This function’s usual effect is to remove a file or a directory from the 
+ * current directory, or from the directory a path leads to. In removing files
+ * and directories this function will ensure that no memory leaks occur. The 
+ * last file or directory could be removed from a directory, causing it to 
+ * become an empty directory with no contents, but the current directory of 
+ * any session (and so any directory above it) can never be removed. If arg 
+ * does not exist, its last component may be a pattern, as for ls, removing 
+ * every entry that matches.*/
+int rm(Filesystem *files, const char arg[])
+{
+    if (files != NULL && arg != NULL)
+    {
+        const char *name;
+        size_t len;
+        int result;
+        
+        begin(files, strlen(arg));
+        
+        /* If arg is an empty string */
+        if (*arg == '\0')
+            return counted(files, STAT_RM, -3);
+        
+        /* If arg ends in . (a single period), .., or / */
+        split_path(arg, &name, &len);
+        if (len == 0 || is_special(name, len))
+            return counted(files, STAT_RM, -2);
+        
+        /* Try it as a file first, which leaves the rest of the tree to other
+         * threads. */
+        result = remove_entry(files, arg, name, len, 0);
+        if (result == 1)
+            result = remove_entry(files, arg, name, len, 1);
+        
+        /* A name that exists is removed as it is, even if it could be a
+         * pattern. Otherwise everything it matches is removed. */
+        if (result == -1 && glob_prefix(name, len) < len)
+        {
+            result = remove_matching(files, arg, name, len, 0);
+            if (result == 1)
+                result = remove_matching(files, arg, name, len, 1);
+        }
+        return counted(files, STAT_RM, result);
+    }
+    else
+        return 0;
+}
+
+static int remove_entry(Filesystem *files, const char *arg, const char *name,
+                        size_t len, int exclusive)
+{
+    Tree *tree = files->tree;
+    Directory *dir, *target;
+    Index_slot *slot;
+    int result = 0, due = 0;
+    
+    lock_tree(files, exclusive);
+    
+    /* If the directory does not contain a file or sub directory with the
+     * name that arg refers to, or does not exist itself. */
+    if (resolve_parent(files, arg, &dir) != 0)
+    {
+        release(files, NULL, 0);
+        return -1;
+    }
+    lock_dir(files, dir, 1);
+    unshare(files, dir);
+    slot = index_lookup(files, &dir->index, name, len, name_hash(name, len));
+    if (slot == NULL)
+        result = -1;
+    
+    /* If there exists a file with the name that arg refers to, remove it */
+    else if (slot->kind == SLOT_FILE)
+    {
+        usage_removed(tree, dir, NULL, len);
+        remove_file(files, dir, slot);
+        due = log_op(files, JOURNAL_RM, arg, "", 0, "", 0);
+    }
+    
+    /* A sub directory needs every other writer out of the tree. */
+    else if (!exclusive)
+        result = 1;
+    
+    /* The current directories and the directories above them stay. A 
+     * session may be changing into the directory right now, without any 
+     * lock; see enter_dir(). */
+    else
+    {
+        target = INODE_ENTRY(tree->inodes, slot->id).dir;
+        PUBLISH(tree->removals, tree->removals + 1);
+        PUBLISH(target->removing, 1);
+        FENCE();
+        if (in_use(tree, target))
+        {
+            PUBLISH(target->removing, 0);
+            result = -2;
+        }
+        
+        /* Any cached path resolution may lead into the removed directories.
+         * The generation moves on after they are unlinked, so a resolution
+         * made since cannot have found them. */
+        else
+        {
+            usage_removed(tree, dir, target, len);
+            remove_dir(files, dir, slot);
+            PUBLISH(tree->dentries->generation, 
+                    tree->dentries->generation + 1);
+            due = log_op(files, JOURNAL_RM, arg, "", 0, "", 0);
+        }
+        PUBLISH(tree->removals, tree->removals + 1);
+    }
+    release(files, dir, due);
+    return result;
+}
+
+static int remove_matching(Filesystem *files, const char *arg, 
+                           const char *pattern, size_t len, int exclusive)
+{
+    Tree *tree = files->tree;
+    Inode_table *inodes = tree->inodes;
+    Directory *dir, *target;
+    Index_slot *slot;
+    const char *name;
+    size_t prefix = glob_prefix(pattern, len), dir_len = pattern - arg;
+    size_t name_len, size = 0;
+    unsigned long scanned = 0;
+    unsigned int id, next;
+    char *path = NULL;
+    int matched = 0, skipped = 0, due = 0;
+    
+    lock_tree(files, exclusive);
+    if (resolve_parent(files, arg, &dir) != 0)
+    {
+        release(files, NULL, 0);
+        return -1;
+    }
+    lock_dir(files, dir, 1);
+    unshare(files, dir);
+    
+    /* Only the entries that start with the pattern's literal prefix are 
+     * looked at, and none is removed before it is known whether any sub 
+     * directory matches. */
+    if (!exclusive)
+        for (id = children_seek(files, &dir->children, pattern, prefix); 
+             id != 0 && strncmp(INODE_NAME(inodes, id), pattern, prefix) == 0;
+             id = INODE_NEXT(inodes, id))
+            if (INODE_KIND(inodes, id) == SLOT_DIR && 
+                glob_match(pattern, len, INODE_NAME(inodes, id)))
+            {
+                release(files, dir, 0);
+                return 1;
+            }
+    
+    for (id = children_seek(files, &dir->children, pattern, prefix); 
+         id != 0 && strncmp(INODE_NAME(inodes, id), pattern, prefix) == 0;
+         id = next)
+    {
+        /* Removing the entry leaves the one after it where it is. */
+        next = INODE_NEXT(inodes, id);
+        scanned++;
+        name = INODE_NAME(inodes, id);
+        if (!glob_match(pattern, len, name))
+            continue;
+        matched = 1;
+        name_len = strlen(name);
+        slot = index_lookup(files, &dir->index, name, name_len, 
+                            name_hash(name, name_len));
+        
+        /* Each removal is logged on its own, by the name removed, so that
+         * replaying it removes just that entry. */
+        if (dir_len + name_len + 1 > size)
+        {
+            size = (dir_len + name_len + 1) * 2;
+            path = realloc(path, size);
+            if (path == NULL)
+            {
+                printf("Memory allocation failed!\n");
+                exit(1);
+            }
+        }
+        memcpy(path, arg, dir_len);
+        memcpy(path + dir_len, name, name_len + 1);
+        
+        if (INODE_KIND(inodes, id) == SLOT_FILE)
+        {
+            usage_removed(tree, dir, NULL, name_len);
+            remove_file(files, dir, slot);
+            due |= log_op(files, JOURNAL_RM, path, "", 0, "", 0);
+            continue;
+        }
+        
+        /* As in remove_entry(), a directory that is in use stays. */
+        target = INODE_ENTRY(inodes, id).dir;
+        PUBLISH(tree->removals, tree->removals + 1);
+        PUBLISH(target->removing, 1);
+        FENCE();
+        if (in_use(tree, target))
+        {
+            PUBLISH(target->removing, 0);
+            skipped = 1;
+        }
+        else
+        {
+            usage_removed(tree, dir, target, name_len);
+            remove_dir(files, dir, slot);
+            PUBLISH(tree->dentries->generation, 
+                    tree->dentries->generation + 1);
+            due |= log_op(files, JOURNAL_RM, path, "", 0, "", 0);
+        }
+        PUBLISH(tree->removals, tree->removals + 1);
+    }
+    COUNT(files->session->counters.scanned, scanned);
+    release(files, dir, due);
+    free(path);
+    if (!matched)
+        return -1;
+    return skipped ? -2 : 0;
+}
+
+static unsigned long remove_contents(Tree *tree, Directory *dir)
+{
+    Arena *arena = tree->arena;
+    Inode_table *inodes = tree->inodes;
+    Directory *stack = NULL, *sub;
+    File *file;
+    unsigned long removed = 0;
+    unsigned int id, next;
+    
+    while (dir != NULL)
+    {
+        /* Push the sub directories of dir onto the stack before dir is freed,
+         * and free its files, walking the bottom level of its ordered index.
+         * The stack is threaded through the parent pointers of the sub 
+         * directories themselves, which nothing follows any more, so it 
+         * needs no memory of its own and has no depth limit. Freeing an ID
+         * uses its next field, so that is read first. */
+        for (id = dir->children.first; id != 0; id = next)
+        {
+            next = INODE_NEXT(inodes, id);
+            if (INODE_KIND(inodes, id) == SLOT_DIR)
+            {
+                sub = INODE_ENTRY(inodes, id).dir;
+                sub->parent_dir = stack;
+                stack = sub;
+                continue;
+            }
+            if ((file = INODE_ENTRY(inodes, id).file) != NULL)
+            {
+                file_release(tree->blocks, file);
+                slab_free(&arena->files, file);
+            }
+            free_entry(tree, id);
+            removed++;
+        }
+        
+        index_free(arena, &dir->index);
+        children_free(arena, &dir->children);
+        if (dir->path != NULL)
+            arena_free(arena, dir->path, path_size(dir->path->len));
+        free_entry(tree, dir->id);
+        rwlock_destroy(&dir->lock);
+        slab_free(&arena->dirs, dir);
+        removed++;
+        
+        /* Continue with the most recently pushed directory, if any are left. */
+        dir = stack;
+        if (stack != NULL)
+            stack = stack->parent_dir;
+    }
+    return removed;
+}
+
+/* This function’s usual effect is to change the name of a file or directory. 
+ * arg1 may be a path, and the entry keeps its place in the directory that the
+ * path leads to; arg2 is the new name alone. The name of the current directory
+ * of any session cannot be changed by this function, nor can the name of any
+ * directory between the root and such a directory. */
+int re_name(Filesystem *files, const char arg1[], const char arg2[])
+{
+    if (files != NULL && arg1 != NULL && arg2 != NULL)
+    {
+        const char *name1;
+        size_t len1;
+        int result;
+        
+        begin(files, strlen(arg1) + strlen(arg2));
+        
+        /* If arg1 or arg2 is an empty string */
+        if (*arg1 == '\0' || *arg2 == '\0')
+            return counted(files, STAT_RENAME, -2);
+        
+        /* If arg1 ends in or arg2 is either ".", "..", or "/" */
+        split_path(arg1, &name1, &len1);
+        if (len1 == 0 || is_special(name1, len1) || 
+            is_special(arg2, strlen(arg2)))
+            return counted(files, STAT_RENAME, -3);
+        
+        /* The new name must be a name, not a path. */
+        if (strchr(arg2, '/') != NULL)
+            return counted(files, STAT_RENAME, -2);
+        
+        /* Like rm(), a file is renamed with only its directory locked. */
+        result = rename_entry(files, arg1, arg2, name1, len1, 0);
+        if (result == 1)
+            result = rename_entry(files, arg1, arg2, name1, len1, 1);
+        return counted(files, STAT_RENAME, result);
+    }
+    else
+        return 0;
+}
+
+static int rename_entry(Filesystem *files, const char *arg1, const char *arg2,
+                        const char *name1, size_t len1, int exclusive)
+{
+    Tree *tree = files->tree;
+    Inode_table *inodes = tree->inodes;
+    Directory *dir;
+    Index_slot *slot;
+    Slot_kind kind;
+    size_t len2 = strlen(arg2);
+    unsigned long hash2 = name_hash(arg2, len2);
+    unsigned int id, old;
+    int result = 0, due = 0;
+    
+    lock_tree(files, exclusive);
+    
+    /* If the directory arg1 is in does not exist */
+    if (resolve_parent(files, arg1, &dir) != 0)
+    {
+        release(files, NULL, 0);
+        return -1;
+    }
+    lock_dir(files, dir, 1);
+    unshare(files, dir);
+    slot = index_lookup(files, &dir->index, name1, len1, 
+                        name_hash(name1, len1));
+    
+    /* If arg2 is a different name from arg1 but there is already a file or
+     * directory in that directory with the name arg2 */
+    if ((len1 != len2 || strncmp(name1, arg2, len1) != 0) && 
+        index_lookup(files, &dir->index, arg2, len2, hash2) != NULL)
+        result = -3;
+    
+    /* If there does not exist a file or sub directory in the directory 
+     * with the name of arg1 */
+    else if (slot == NULL)
+        result = -1;
+    
+    /* If arg1 is the name of a file or directory that exists in the 
+     * directory at that time, and arg2 is the same as arg1 */
+    else if (strcmp(INODE_NAME(inodes, slot->id), arg2) == 0)
+        result = -4;
+    
+    /* A sub directory needs every other writer out of the tree, and the 
+     * current directories and those above them keep their names. */
+    else if (slot->kind == SLOT_DIR && !exclusive)
+        result = 1;
+    else if (slot->kind == SLOT_DIR && 
+             in_use(tree, INODE_ENTRY(inodes, slot->id).dir))
+        result = -2;
+    
+    /* If arg1 is the name of a file or directory that exists in the 
+     * directory at that time, and there is not already a file or directory 
+     * in it named arg2, the function will try to change arg1’s name to 
+     * arg2, moving the entry to its new place in the indexes. Threads 
+     * without the lock may still be reading the old name and following the
+     * old next field, so rather than being changed, the entry is given a new
+     * ID, which holds the new name like any other, and the old one is 
+     * retired. */
+    else
+    {
+        old = slot->id;
+        kind = slot->kind;
+        id = new_entry(tree, kind, arg2, len2, hash2);
+        INODE_ENTRY(inodes, id) = INODE_ENTRY(inodes, old);
+        index_remove(files, &dir->index, slot);
+        children_remove(files, &dir->children, old);
+        epoch_retire(tree, files->session, release_inode, NULL, old);
+        index_insert(files, &dir->index, hash2, len2, kind, id);
+        children_insert(files, &dir->children, id);
+        if (kind == SLOT_DIR)
+            PUBLISH(INODE_ENTRY(inodes, id).dir->id, id);
+        if (len2 > len1)
+            add_usage(tree, dir, 0, 0, len2 - len1, 0);
+        else
+            add_usage(tree, dir, 0, 0, len1 - len2, 1);
+        
+        /* Paths cached before the directory got its new name are stale. */
+        if (kind == SLOT_DIR)
+        {
+            PUBLISH(tree->dentries->generation, 
+                    tree->dentries->generation + 1);
+            PUBLISH(tree->dentries->renames, tree->dentries->renames + 1);
+        }
+        due = log_op(files, JOURNAL_RENAME, arg1, arg2, 0, "", 0);
+    }
+    release(files, dir, due);
+    return result;
+}
+
+/* This function’s usual effect is to write len bytes of data into the file 
+ * that arg names (arg may be a path), starting offset bytes into it. The file
+ * grows if the data goes past its end, and any gap left between its old end
+ * and offset reads as zeroes. The number of bytes written is returned, or -1
+ * if there is no such file and -2 if arg names a directory.
+ */
+long write_file(Filesystem *files, const char arg[], size_t offset, 
+                const char data[], size_t len)
+{
+    if (files != NULL && arg != NULL && data != NULL)
+    {
+        Directory *dir;
+        File *file;
+        int result, due;
+        
+        lock_tree(files, 0);
+        result = find_file(files, arg, 1, &dir, &file);
+        if (result != 0)
+        {
+            release(files, NULL, 0);
+            return counted(files, STAT_WRITE, result);
+        }
+        
+        file_write(files->tree->blocks, file, offset, data, len);
+        due = log_op(files, JOURNAL_WRITE, arg, "", offset, data, len);
+        release(files, dir, due);
+        counted(files, STAT_WRITE, 0);
+        return (long) len;
+    }
+    else
+        return 0;
+}
+
+/* This function’s usual effect is to read up to len bytes from the file that
+ * arg names, starting offset bytes into it, into buf. The number of bytes read
+ * is returned, which is fewer than len (or 0) at the end of the file, or -1 
+ * if there is no such file and -2 if arg names a directory.
+ */
+long read_file(Filesystem files, const char arg[], size_t offset, char buf[],
+               size_t len)
+{
+    if (arg != NULL && buf != NULL)
+    {
+        Directory *dir;
+        File *file;
+        int result;
+        
+        lock_tree(&files, 0);
+        result = find_file(&files, arg, 0, &dir, &file);
+        if (result != 0)
+        {
+            release(&files, NULL, 0);
+            return counted(&files, STAT_READ, result);
+        }
+        
+        len = file != NULL ? file_read(files.tree->blocks, file, offset, buf, 
+                                       len) : 0;
+        release(&files, dir, 0);
+        counted(&files, STAT_READ, 0);
+        return (long) len;
+    }
+    else
+        return 0;
+}
+
+/* This function’s usual effect is to add len bytes of data to the end of the
+ * file that arg names. It returns like write_file().
+ */
+long append_file(Filesystem *files, const char arg[], const char data[], 
+                 size_t len)
+{
+    if (files != NULL && arg != NULL && data != NULL)
+    {
+        Directory *dir;
+        File *file;
+        size_t offset;
+        int result, due;
+        
+        lock_tree(files, 0);
+        result = find_file(files, arg, 1, &dir, &file);
+        if (result != 0)
+        {
+            release(files, NULL, 0);
+            return counted(files, STAT_APPEND, result);
+        }
+        
+        /* The journal records where the data went, so that replaying it does
+         * not depend on the size the file had. */
+        offset = file->size;
+        file_write(files->tree->blocks, file, offset, data, len);
+        due = log_op(files, JOURNAL_WRITE, arg, "", offset, data, len);
+        release(files, dir, due);
+        counted(files, STAT_APPEND, 0);
+        return (long) len;
+    }
+    else
+        return 0;
+}
+
+/* This function’s usual effect is to make the file that arg names exactly 
+ * size bytes long, dropping whatever is past that or adding zeroes up to it.
+ * It returns 0, or -1 if there is no such file and -2 if arg names a 
+ * directory.
+ */
+int truncate_file(Filesystem *files, const char arg[], size_t size)
+{
+    if (files != NULL && arg != NULL)
+    {
+        Directory *dir;
+        File *file;
+        int result, due;
+        
+        lock_tree(files, 0);
+        result = find_file(files, arg, 1, &dir, &file);
+        if (result != 0)
+        {
+            release(files, NULL, 0);
+            return counted(files, STAT_TRUNCATE, result);
+        }
+        
+        file_truncate(files->tree->blocks, file, size);
+        due = log_op(files, JOURNAL_TRUNCATE, arg, "", size, "", 0);
+        release(files, dir, due);
+        return counted(files, STAT_TRUNCATE, 0);
+    }
+    return 0;
+}
+
+/* This function’s usual effect is to copy the file or directory that arg1 
+ * names, with everything below it, to the path arg2, which must not exist 
+ * yet. Both may be paths. The copy of a directory is made in constant time,
+ * whatever is below it: each directory of the copy takes its entries from 
+ * the one it is a copy of when it is first looked into, or before that one
+ * changes, which only calls changing what is below the original wait 
+ * for. It returns 0, or -1 if arg1 or the directory arg2 would go in does not exist,
+ * -2 if either is empty or arg2 ends in ., .. or /, -3 if arg2 already 
+ * exists and -4 if arg2 would be inside the directory arg1.
+ */
+int copy(Filesystem *files, const char arg1[], const char arg2[])
+{
+    if (files != NULL && arg1 != NULL && arg2 != NULL)
+    {
+        Tree *tree = files->tree;
+        Directory *src, *dir, *sub;
+        Index_slot *slot = NULL;
+        File *file;
+        const char *name1, *name2;
+        size_t len1, len2;
+        unsigned long hash;
+        unsigned int made;
+        int is_file = 0, result = 0, due = 0;
+        
+        begin(files, strlen(arg1) + strlen(arg2));
+        
+        /* If arg1 or arg2 is an empty string, or arg2 ends in ., .. or /. */
+        split_path(arg2, &name2, &len2);
+        if (*arg1 == '\0' || len2 == 0 || is_special(name2, len2))
+            return counted(files, STAT_COPY, -2);
+        
+        /* Making copies changes what other writers have to do, so they wait
+         * for this one. */
+        lock_tree(files, 1);
+        split_path(arg1, &name1, &len1);
+        if (resolve(files, arg1, strlen(arg1), &src, &is_file, 1) != 0 ||
+            resolve_parent(files, arg2, &dir) != 0)
+        {
+            release(files, NULL, 0);
+            return counted(files, STAT_COPY, -1);
+        }
+        lock_dir(files, dir, 1);
+        unshare(files, dir);
+        hash = name_hash(name2, len2);
+        if (is_file)
+            slot = index_lookup(files, &src->index, name1, len1, 
+                                name_hash(name1, len1));
+        
+        /* If arg2 already exists, or is inside the directory being 
+         * copied. */
+        if (index_lookup(files, &dir->index, name2, len2, hash) != NULL)
+            result = -3;
+        else if (!is_file && is_ancestor(src, dir))
+            result = -4;
+        
+        /* A file's contents are shared until either file changes. */
+        else if (is_file)
+        {
+            file = INODE_ENTRY(tree->inodes, slot->id).file;
+            made = add_file(files, dir, name2, len2, hash);
+            if (file != NULL)
+                file_clone(tree->blocks, file_of(tree, made), file);
+            usage_added(tree, dir, NULL, len2);
+            due = log_op(files, JOURNAL_COPY, arg1, arg2, 0, "", 0);
+        }
+        
+        /* A directory still in the image is copied by reading the copy in
+         * from the same record. */
+        else
+        {
+            sub = make_dir(files, dir, name2, len2, hash, src->image, 
+                           src->image == NULL ? src : NULL);
+            usage_added(tree, dir, sub, len2);
+            index_insert(files, &dir->index, hash, len2, SLOT_DIR, sub->id);
+            children_insert(files, &dir->children, sub->id);
+            due = log_op(files, JOURNAL_COPY, arg1, arg2, 0, "", 0);
+        }
+        release(files, dir, due);
+        return counted(files, STAT_COPY, result);
+    }
+    else
+        return 0;
+}
+
+/* This function’s usual effect is to move the file or directory that arg1 
+ * names to the path arg2, which must not exist yet, giving it the last 
+ * component of arg2 as its name. Both may be paths. A directory is moved 
+ * with everything below it in the same time as a file, by linking it into 
+ * its new parent. It returns 0, or -1 if arg1 or the directory arg2 would
+ * go in does not exist, -2 if either is empty or ends in ., .. or /, -3 if
+ * arg2 already exists, -4 if arg2 would be inside the directory arg1 and 
+ * -5 if that directory is the current directory of a session, or above it.
+ */
+int move(Filesystem *files, const char arg1[], const char arg2[])
+{
+    if (files != NULL && arg1 != NULL && arg2 != NULL)
+    {
+        Tree *tree = files->tree;
+        Inode_table *inodes = tree->inodes;
+        Directory *from, *to, *target = NULL;
+        Index_slot *slot;
+        Slot_kind kind;
+        const char *name1, *name2;
+        size_t len1, len2;
+        unsigned long hash2;
+        unsigned int id, old;
+        int result = 0, due = 0;
+        
+        begin(files, strlen(arg1) + strlen(arg2));
+        
+        /* If arg1 or arg2 is an empty string, or ends in ., .. or /. */
+        split_path(arg1, &name1, &len1);
+        split_path(arg2, &name2, &len2);
+        if (len1 == 0 || is_special(name1, len1) || len2 == 0 || 
+            is_special(name2, len2))
+            return counted(files, STAT_MOVE, -2);
+        hash2 = name_hash(name2, len2);
+        
+        /* A directory moved takes everything below it to another place in
+         * the tree, so other writers wait for this one, and no directory 
+         * can be changed or moved on the way to either place. */
+        lock_tree(files, 1);
+        if (resolve_parent(files, arg1, &from) != 0 || 
+            resolve_parent(files, arg2, &to) != 0)
+        {
+            release(files, NULL, 0);
+            return counted(files, STAT_MOVE, -1);
+        }
+        
+        /* No other thread takes a directory's lock without the tree's, so 
+         * the one arg2 goes in is only locked to read it in. */
+        if (to != from)
+        {
+            lock_dir(files, to, 1);
+            rwlock_unlock(&to->lock);
+        }
+        lock_dir(files, from, 1);
+        unshare(files, from);
+        unshare(files, to);
+        slot = index_lookup(files, &from->index, name1, len1, 
+                            name_hash(name1, len1));
+        if (slot != NULL && slot->kind == SLOT_DIR)
+            target = INODE_ENTRY(inodes, slot->id).dir;
+        
+        /* If there is nothing to move, or already something at arg2. */
+        if (slot == NULL)
+            result = -1;
+        else if (index_lookup(files, &to->index, name2, len2, hash2) != NULL)
+            result = -3;
+        
+        /* A directory cannot go below itself, which only takes following 
+         * the parents of where it would go. The current directories and 
+         * those above them stay where they are. */
+        else if (target != NULL && is_ancestor(target, to))
+            result = -4;
+        else if (target != NULL && in_use(tree, target))
+            result = -5;
+        
+        /* The entry is taken out of the indexes of one directory and put
+         * into those of the other, like rename_entry() does within one. 
+         * Readers may still be following the old ID along the list it was
+         * in, so it is given a new one even when the name stays the same. 
+         * Nothing below a directory changes, but its parent. */
+        else
+        {
+            old = slot->id;
+            kind = slot->kind;
+            id = new_entry(tree, kind, name2, len2, hash2);
+            INODE_ENTRY(inodes, id) = INODE_ENTRY(inodes, old);
+            usage_removed(tree, from, target, len1);
+            index_remove(files, &from->index, slot);
+            children_remove(files, &from->children, old);
+            epoch_retire(tree, files->session, release_inode, NULL, old);
+            if (target != NULL)
+            {
+                PUBLISH(target->parent_dir, to);
+                PUBLISH(target->id, id);
+            }
+            index_insert(files, &to->index, hash2, len2, kind, id);
+            children_insert(files, &to->children, id);
+            usage_added(tree, to, target, len2);
+            
+            /* Cached paths through a directory that has moved are stale. */
+            if (target != NULL)
+            {
+                PUBLISH(tree->dentries->generation, 
+                        tree->dentries->generation + 1);
+                PUBLISH(tree->dentries->renames, 
+                        tree->dentries->renames + 1);
+            }
+            due = log_op(files, JOURNAL_MOVE, arg1, arg2, 0, "", 0);
+        }
+        release(files, from, due);
+        return counted(files, STAT_MOVE, result);
+    }
+    else
+        return 0;
+}
+
+/* This function’s usual effect is to make a directory at the path arg, which
+ * must not exist yet, holding a copy of everything in the filesystem as it
+ * is when the call is made; the snapshot is not inside itself. Like a copy 
+ * made by copy(), it is made without copying what is below it, except that 
+ * the entries of the root, and of the directories on the way to arg, are 
+ * read into the snapshot at once, since the directory arg goes in changes 
+ * right after. It returns 0, or -1 if the directory arg would go in does 
+ * not exist, -2 if arg is empty or ends in ., .. or /, and -3 if arg already
+ * exists.
+ */
+int snapshot(Filesystem *files, const char arg[])
+{
+    if (files != NULL && arg != NULL)
+    {
+        Tree *tree = files->tree;
+        Directory *dir, *sub;
+        const char *name;
+        size_t len;
+        unsigned long hash;
+        int result = 0, due = 0;
+        
+        begin(files, strlen(arg));
+        split_path(arg, &name, &len);
+        if (len == 0 || is_special(name, len))
+            return counted(files, STAT_SNAPSHOT, -2);
+        
+        lock_tree(files, 1);
+        if (resolve_parent(files, arg, &dir) != 0)
+        {
+            release(files, NULL, 0);
+            return counted(files, STAT_SNAPSHOT, -1);
+        }
+        lock_dir(files, dir, 1);
+        unshare(files, dir);
+        hash = name_hash(name, len);
+        if (index_lookup(files, &dir->index, name, len, hash) != NULL)
+            result = -3;
+        
+        /* The snapshot is a copy of the root, read in before it is linked 
+         * in, so that it does not hold itself. Reading it in makes copies 
+         * of the directories on the way to the one it goes in, which are 
+         * read in again before that one changes. */
+        else
+        {
+            sub = make_dir(files, dir, name, len, hash, NULL, tree->root);
+            lock_dir(files, sub, 1);
+            rwlock_unlock(&sub->lock);
+            unshare(files, dir);
+            usage_added(tree, dir, sub, len);
+            index_insert(files, &dir->index, hash, len, SLOT_DIR, sub->id);
+            children_insert(files, &dir->children, sub->id);
+            due = log_op(files, JOURNAL_SNAPSHOT, arg, "", 0, "", 0);
+        }
+        release(files, dir, due);
+        return counted(files, STAT_SNAPSHOT, result);
+    }
+    else
+        return 0;
+}
+
+/* This function writes the whole filesystem to an image file at path, which
+ * load_fs() can map back in. Directories and files that are still in the 
+ * image the filesystem was loaded from are copied from it, and path may be 
+ * that image itself. Other threads wait until the image has been written. It
+ * returns 0, or -1 if the image cannot be written.
+ */
+int save_fs(Filesystem files, const char path[])
+{
+    Tree *tree = files.tree;
+    int result;
+    
+    if (path == NULL)
+        return -1;
+    rwlock_write(&tree->lock);
+    result = image_save(tree->root, tree->image, tree->inodes, 
+                        tree->blocks, path, 0);
+    rwlock_unlock(&tree->lock);
+    return result;
+}
+
+/* This function’s usual effect is to initialize files, like mkfs(), as the 
+ * filesystem saved in the image file at path. The image is mapped rather than
+ * read, so loading takes the same time whatever its size: each directory is 
+ * read in from the image the first time it is looked into, and names and file
+ * contents are used from the image until they are changed. The image stays 
+ * mapped until rmfs() is called. It returns 0, or -1 if the file cannot be 
+ * opened or mapped and -2 if it is not an image, in which case files is left
+ * as it was.
+ */
+int load_fs(Filesystem *files, const char path[])
+{
+    if (files != NULL && path != NULL)
+    {
+        Image *image;
+        int result;
+        
+        image = image_map(path, &result);
+        if (image == NULL)
+            return result;
+        
+        mkfs(files);
+        files->tree->image = image;
+        use_image(files->tree->root, image_root(image));
+        return 0;
+    }
+    else
+        return -1;
+}
+
+/* This function’s usual effect is to initialize files, like mkfs(), as a 
+ * filesystem holding every file and directory listed in the manifest file at
+ * path. Each line of the manifest is a full path, which names a directory if
+ * it ends in / and a file otherwise; the directories on the way to it are 
+ * made as needed, and an entry listed again is left as it is. Lines may come
+ * in any order, but sorted ones load fastest: the directories the line 
+ * before went through are not looked for again, and a name that sorts after
+ * every other one in its directory is added without looking for it, linked 
+ * in at the end of the directory's ordered index without comparing it to 
+ * any other. A directory's name index is only built once a name has to be 
+ * looked for in it, or else once all the lines have been read, in one table
+ * of the right size; what is below each directory is counted then too, 
+ * rather than up to the root for each entry. It returns 0, -1 if the file 
+ * cannot be opened, in which case files is left as it was, or read, in 
+ * which case files holds no filesystem, and -2 if some lines name nothing 
+ * that can be made (they are relative, name . or .., or go through a file),
+ * in which case the others are loaded.
+ */
+int build_fs(Filesystem *files, const char path[])
+{
+    if (files != NULL && path != NULL)
+    {
+        FILE *manifest = fopen(path, "r");
+        Builder builder;
+        char *line;
+        size_t len;
+        int result = 0;
+        
+        if (manifest == NULL)
+            return -1;
+        
+        mkfs(files);
+        builder.files = files;
+        builder.manifest = manifest;
+        builder.size = BUILD_BLOCK;
+        builder.pos = 0;
+        builder.len = 0;
+        builder.depth = 0;
+        builder.level_cap = 16;
+        builder.dir_count = 0;
+        builder.dir_cap = 64;
+        builder.buf = malloc(builder.size);
+        builder.levels = malloc(builder.level_cap * sizeof(Build_level));
+        builder.dirs = malloc(builder.dir_cap * sizeof(Directory *));
+        if (builder.buf == NULL || builder.levels == NULL || 
+            builder.dirs == NULL)
+        {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        build_push(&builder, files->tree->root, 1, 1);
+        
+        while (read_line(&builder, &line, &len))
+            if (build_line(&builder, line, len) != 0)
+                result = -2;
+        build_usage(&builder);
+        
+        if (ferror(manifest))
+        {
+            rmfs(files);
+            result = -1;
+        }
+        fclose(manifest);
+        free(builder.buf);
+        free(builder.levels);
+        free(builder.dirs);
+        return result;
+    }
+    else
+        return -1;
+}
+
+/* This function’s usual effect is to initialize files, like mkfs(), as the 
+ * filesystem kept on disk at path, creating it (empty) if there is none yet.
+ * The filesystem is the checkpoint image at path.image, loaded as by 
+ * load_fs(), with the journal at path.journal replayed on top of it, and 
+ * every later mutation is appended to the journal. To share the cost of 
+ * syncing the journal, mutations are committed in groups: once batch of them
+ * are waiting, or window milliseconds after the first of them (0 meaning no
+ * time limit). The window is checked as later mutations arrive, so the last 
+ * group waits for sync_fs() or rmfs(); a crash loses at most the uncommitted
+ * group. A batch of 1 makes every mutation durable before it returns. It 
+ * returns 0, -1 if the files cannot be read or written and -2 if they are not
+ * a filesystem, in which case files holds no filesystem.
+ */
+int open_fs(Filesystem *files, const char path[], unsigned long batch,
+            unsigned long window)
+{
+    if (files != NULL && path != NULL)
+    {
+        Journal *journal;
+        FILE *checkpoint;
+        int result;
+        
+        journal = journal_open(path, batch, window, &result);
+        if (journal == NULL)
+            return result;
+        
+        /* Start from the checkpoint, if one has been made. */
+        checkpoint = fopen(journal->checkpoint, "rb");
+        if (checkpoint == NULL)
+            mkfs(files);
+        else
+        {
+            fclose(checkpoint);
+            result = load_fs(files, journal->checkpoint);
+            if (result != 0)
+            {
+                journal_close(journal);
+                return result;
+            }
+        }
+        
+        result = journal_replay(journal, files->tree->image != NULL 
+                                         ? files->tree->image->header->stamp 
+                                         : 0,
+                                replay_record, files);
+        files->session->curr_dir = files->tree->root;
+        if (result != 0)
+        {
+            journal_close(journal);
+            rmfs(files);
+            return result;
+        }
+        files->tree->journal = journal;
+        return 0;
+    }
+    else
+        return -1;
+}
+
+/* This function commits every mutation of a filesystem opened with open_fs()
+ * that is still waiting for its group, returning 0, or -1 if the journal 
+ * could not be written (now or at any point since the last checkpoint).
+ */
+int sync_fs(Filesystem *files)
+{
+    if (files != NULL && files->tree->journal != NULL)
+    {
+        Tree *tree = files->tree;
+        int result;
+        
+        mutex_lock(&tree->journal_lock);
+        result = journal_commit(tree->journal);
+        mutex_unlock(&tree->journal_lock);
+        return result;
+    }
+    return 0;
+}
+
+/* This function compacts the journal of a filesystem opened with open_fs():
+ * the whole filesystem is saved as a new checkpoint image and the journal is
+ * emptied, while other threads wait. The image is written before the journal
+ * is touched, and a journal left over from an older checkpoint is ignored, so
+ * a crash part way through loses nothing. It returns 0, or -1 if the 
+ * filesystem has no journal or the checkpoint cannot be written. It is also
+ * called whenever the journal grows past JOURNAL_CHECKPOINT_SIZE bytes.
+ */
+int checkpoint_fs(Filesystem *files)
+{
+    if (files != NULL && files->tree->journal != NULL)
+    {
+        Tree *tree = files->tree;
+        Journal *journal = tree->journal;
+        int result = -1;
+        
+        rwlock_write(&tree->lock);
+        mutex_lock(&tree->journal_lock);
+        if (image_save(tree->root, tree->image, tree->inodes, tree->blocks,
+                       journal->checkpoint, journal->epoch + 1) == 0)
+            result = journal_reset(journal, journal->epoch + 1);
+        mutex_unlock(&tree->journal_lock);
+        rwlock_unlock(&tree->lock);
+        return result;
+    }
+    else
+        return -1;
+}
+
+/* This function starts another session of the filesystem that files is a 
+ * session of, storing it in session. The two share every file and directory,
+ * but each has a current directory of its own, the new one's being the root.
+ * Different sessions may be used from different threads at the same time.
+ */
+void new_session(Filesystem files, Filesystem *session)
+{
+    if (session != NULL)
+    {
+        mutex_lock(&files.tree->sessions_lock);
+        session->tree = files.tree;
+        session->session = session_new(files.tree);
+        mutex_unlock(&files.tree->sessions_lock);
+    }
+}
+
+/* This function ends a session, which cannot be used afterwards. Ending the
+ * last session of a filesystem is the same as calling rmfs(). What the 
+ * session retired is freed by the other sessions.
+ */
+void end_session(Filesystem *session)
+{
+    if (session != NULL && session->tree != NULL)
+    {
+        Tree *tree = session->tree;
+        Session *s = session->session;
+        
+        mutex_lock(&tree->sessions_lock);
+        if (s->prev == NULL && s->next == NULL)
+        {
+            mutex_unlock(&tree->sessions_lock);
+            rmfs(session);
+            return;
+        }
+        
+        if (s->prev == NULL)
+            tree->sessions = s->next;
+        else
+            s->prev->next = s->next;
+        if (s->next != NULL)
+            s->next->prev = s->prev;
+        epoch_orphan(tree, s);
+        add_counters(&s->counters, &tree->ended);
+        arena_free(tree->arena, s, sizeof(Session));
+        mutex_unlock(&tree->sessions_lock);
+        
+        session->tree = NULL;
+        session->session = NULL;
+    }
+}
+
+/* This function stores in stats what every session of the filesystem, those
+ * that have ended included, has done: the calls of each operation and the
+ * errors they returned, and the entries they looked at and compared, as well
+ * as how much the filesystem has allocated. Each session counts what it does
+ * on its own, without any lock, and the counts are only added up here, so 
+ * those of sessions that are running may be a little behind. */
+void fs_stats(Filesystem files, Stats *stats)
+{
+    if (stats != NULL)
+    {
+        Tree *tree = files.tree;
+        Session *s;
+        
+        memset(stats, 0, sizeof(Stats));
+        mutex_lock(&tree->sessions_lock);
+        add_counters(&tree->ended, &stats->ops);
+        for (s = tree->sessions; s != NULL; s = s->next)
+            add_counters(&s->counters, &stats->ops);
+        mutex_unlock(&tree->sessions_lock);
+        arena_stats(tree->arena, stats);
+        inodes_stats(tree->inodes, stats);
+        names_stats(tree->names, stats);
+    }
+}
+
+/* This function attaches a tracer (see trace.h) to the filesystem, so that 
+ * every later call of touch(), mkdir(), cd(), ls(), rm(), re_name() and 
+ * rmfs() in any of its sessions is recorded in it, or detaches the one that 
+ * is attached if tracer is NULL. With no tracer attached, those calls only 
+ * check that there is none. A call that began before a tracer was detached
+ * may still record itself in it, so it must not be freed until any such 
+ * calls have returned. */
+void fs_trace(Filesystem files, struct tracer *tracer)
+{
+    if (files.tree != NULL)
+        PUBLISH(files.tree->tracer, tracer);
+}
+
+/* The number of slots a name index allocates for its first entry, and the
+ * number of slots of an old table that each insertion or removal moves into
+ * the new one while the index is being resized. */
+#define INDEX_MIN_CAPACITY 8
+#define INDEX_MIGRATE_STEP 16
+
+/* Returns the number of bytes allocated for an index table of the given
+ * capacity. */
+static size_t table_size(unsigned long);
+
+/* Allocates an index table of the given capacity with every slot empty. */
+static Index_table *table_new(Arena *, unsigned long);
+
+/* Looks for a name in one table of a name index, like index_lookup(). The
+ * table may be NULL. */
+static Index_slot *table_lookup(Filesystem *, Index_table *, const char *, 
+                                size_t, unsigned long);
+
+/* Places an entry, known to be absent, in a table of a name index, which 
+ * must have room for it. It takes a slot that has never been used, so that
+ * a thread reading the table without the lock never sees a slot's entry
+ * change. */
+static void table_place(Index_table *, unsigned long, unsigned int, Slot_kind,
+                        unsigned int);
+
+/* Moves up to the given number of slots from the old table of a name index 
+ * into its current one, retiring the old table once it has been drained. */
+static void index_migrate(Filesystem *, Name_index *, unsigned long);
+
+/* Replaces both tables of a name index with one new table holding every entry,
+ * sized for at least the given number of entries. */
+static void index_rebuild(Filesystem *, Name_index *, unsigned long);
+
+/* Returns a random height for an entry being linked into an ordered child 
+ * index, drawn from the index's own generator: each level is reached by one
+ * entry in four. */
+static int child_height(Child_list *);
+
+static void split_path(const char *path, const char **name, size_t *len)
+{
+    size_t end = strlen(path), start;
+    
+    /* Trailing slashes do not start another component. */
+    while (end > 0 && path[end - 1] == '/')
+        end--;
+    start = end;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    
+    *name = path + start;
+    *len = end - start;
+}
+
+static int resolve(Filesystem *files, const char *path, size_t len,
+                   Directory **dir, int *is_file, int locked)
+{
+    Tree *tree = files->tree;
+    Directory *base = (len > 0 && path[0] == '/') ? tree->root 
+                                                  : files->session->curr_dir;
+    Directory *curr = base, *next;
+    Index_slot *slot;
+    Slot_kind kind;
+    const char *component;
+    size_t i = 0, clen;
+    unsigned long hash = 0, generation = 0;
+    int cacheable;
+    
+    *dir = NULL;
+    *is_file = 0;
+    
+    /* Paths of more than one component are worth looking up in the dentry
+     * cache first. The generation is read before the walk, so that a walk
+     * that overlaps a removal or rename is not cached as current. */
+    cacheable = len > 1 && memchr(path + 1, '/', len - 1) != NULL;
+    if (cacheable)
+    {
+        hash = name_hash(path, len);
+        generation = LOAD(tree->dentries->generation);
+        if ((*dir = dentry_lookup(tree->dentries, base, path, len, hash)) 
+            != NULL)
+            return 0;
+    }
+    
+    while (i < len)
+    {
+        /* Empty components (from a leading or repeated /) are skipped. */
+        if (path[i] == '/')
+        {
+            i++;
+            continue;
+        }
+        component = path + i;
+        for (clen = 0; i < len && path[i] != '/'; i++)
+            clen++;
+        
+        /* . stays put and .. goes up a level; the root is its own parent. A
+         * directory being moved leads back to either of its parents, which
+         * are both still there. */
+        if (clen == 1 && component[0] == '.')
+            continue;
+        if (clen == 2 && component[0] == '.' && component[1] == '.')
+        {
+            curr = LOAD(curr->parent_dir);
+            continue;
+        }
+        
+        /* The sub directory found is not freed before the caller leaves its
+         * epoch. A slot that has just become a tombstone was either removed
+         * or moved to another table, so it is looked up again. */
+        read_in(files, curr, locked);
+        do
+        {
+            slot = index_lookup(files, &curr->index, component, clen, 
+                                name_hash(component, clen));
+            kind = slot != NULL ? LOAD(slot->kind) : SLOT_EMPTY;
+        } while (kind == SLOT_DELETED);
+        next = kind == SLOT_DIR ? INODE_ENTRY(tree->inodes, slot->id).dir 
+                                : NULL;
+        
+        if (kind == SLOT_EMPTY)
+            return -1;
+        if (kind == SLOT_FILE)
+        {
+            /* A file can only be the last component. */
+            while (i < len && path[i] == '/')
+                i++;
+            if (i < len)
+                return -2;
+            *dir = curr;
+            *is_file = 1;
+            return 0;
+        }
+        curr = next;
+    }
+    
+    if (cacheable)
+        dentry_insert(files, base, path, len, hash, generation, curr);
+    *dir = curr;
+    return 0;
+}
+
+static int resolve_parent(Filesystem *files, const char *path, Directory **dir)
+{
+    const char *name;
+    size_t len;
+    int is_file, result;
+    
+    split_path(path, &name, &len);
+    result = resolve(files, path, name - path, dir, &is_file, 1);
+    
+    /* A file cannot contain anything. */
+    if (result == 0 && is_file)
+        return -2;
+    return result;
+}
+
+static int find_file(Filesystem *files, const char *path, int write, 
+                     Directory **dir, File **file)
+{
+    Index_slot *slot;
+    const char *name;
+    size_t len;
+    
+    /* A path without a last component, or ending in . or .., names a 
+     * directory. */
+    split_path(path, &name, &len);
+    if (resolve_parent(files, path, dir) != 0)
+        return -1;
+    if (len == 0 || is_special(name, len))
+        return -2;
+    
+    lock_dir(files, *dir, write);
+    if (write)
+        unshare(files, *dir);
+    slot = index_lookup(files, &(*dir)->index, name, len, name_hash(name, len));
+    if (slot == NULL || slot->kind != SLOT_FILE)
+    {
+        rwlock_unlock(&(*dir)->lock);
+        return slot == NULL ? -1 : -2;
+    }
+    
+    *file = write ? file_of(files->tree, slot->id) 
+                  : INODE_ENTRY(files->tree->inodes, slot->id).file;
+    return 0;
+}
+
+static int is_ancestor(Directory *dir, Directory *of)
+{
+    /* The root is its own parent, and the last directory looked at. */
+    for (; of != dir; of = of->parent_dir)
+        if (of->parent_dir == of)
+            return 0;
+    return 1;
+}
+
+static int in_use(Tree *tree, Directory *dir)
+{
+    Session *session;
+    
+    mutex_lock(&tree->sessions_lock);
+    for (session = tree->sessions; session != NULL; session = session->next)
+        if (is_ancestor(dir, LOAD(session->curr_dir)))
+            break;
+    mutex_unlock(&tree->sessions_lock);
+    return session != NULL;
+}
+
+static Directory *dentry_lookup(Dentry_cache *cache, Directory *base, 
+                                const char *path, size_t len, 
+                                unsigned long hash)
+{
+    const Dentry *dentry = LOAD(cache->slots[dentry_slot(base, hash)]);
+    
+    if (dentry != NULL && dentry->generation == LOAD(cache->generation) && 
+        dentry->base == base && dentry->hash == hash && dentry->len == len &&
+        memcmp(dentry->path, path, len) == 0)
+        return dentry->target;
+    return NULL;
+}
+
+static void dentry_insert(Filesystem *files, Directory *base, 
+                          const char *path, size_t len, unsigned long hash,
+                          unsigned long generation, Directory *target)
+{
+    Tree *tree = files->tree;
+    Dentry *dentry = arena_alloc(tree->arena, dentry_size(len)), *old;
+    
+    memcpy(dentry->path, path, len);
+    dentry->len = len;
+    dentry->hash = hash;
+    dentry->base = base;
+    dentry->target = target;
+    dentry->generation = generation;
+    
+    /* The cache is direct mapped: a new resolution replaces whatever was in
+     * its slot, which another thread may still be comparing against. */
+    old = EXCHANGE(tree->dentries->slots[dentry_slot(base, hash)], dentry);
+    if (old != NULL)
+        epoch_retire(tree, files->session, release_memory, old, 
+                     dentry_size(old->len));
+}
+
+static unsigned long dentry_slot(Directory *base, unsigned long hash)
+{
+    return (hash ^ ((unsigned long) base >> 4) * 2654435761UL) 
+           % DENTRY_SLOTS;
+}
+
+static unsigned int add_file(Filesystem *files, Directory *dir, 
+                             const char *name, size_t len, unsigned long hash)
+{
+    unsigned int id = new_entry(files->tree, SLOT_FILE, name, len, hash);
+    
+    index_insert(files, &dir->index, hash, len, SLOT_FILE, id);
+    children_insert(files, &dir->children, id);
+    return id;
+}
+
+static Directory *add_dir(Filesystem *files, Directory *dir, const char *name,
+                          size_t len, unsigned long hash, 
+                          const Image_dir *image, Directory *origin)
+{
+    Directory *new_dir = make_dir(files, dir, name, len, hash, image, origin);
+    
+    index_insert(files, &dir->index, hash, len, SLOT_DIR, new_dir->id);
+    children_insert(files, &dir->children, new_dir->id);
+    return new_dir;
+}
+
+static Directory *make_dir(Filesystem *files, Directory *dir, 
+                           const char *name, size_t len, unsigned long hash,
+                           const Image_dir *image, Directory *origin)
+{
+    Tree *tree = files->tree;
+    Directory *new_dir = slab_alloc(&tree->arena->dirs);
+    unsigned int id = new_entry(tree, SLOT_DIR, name, len, hash);
+    
+    INODE_ENTRY(tree->inodes, id).dir = new_dir;
+    new_dir->id = id;
+    new_dir->parent_dir = dir;
+    init_contents(new_dir, hash);
+    if (image != NULL)
+    {
+        use_image(new_dir, image);
+        new_dir->counted = 1;
+    }
+    else if (origin != NULL)
+    {
+        share(files->tree, new_dir, origin);
+        new_dir->counted = 1;
+    }
+    return new_dir;
+}
+
+static void remove_file(Filesystem *files, Directory *dir, Index_slot *slot)
+{
+    Tree *tree = files->tree;
+    unsigned int id = slot->id;
+    File *file = INODE_ENTRY(tree->inodes, id).file;
+    
+    index_remove(files, &dir->index, slot);
+    children_remove(files, &dir->children, id);
+    
+    /* Only writers, holding the directory's lock, look at the contents, so 
+     * they go at once; only the ID is retired. */
+    if (file != NULL)
+    {
+        file_release(tree->blocks, file);
+        slab_free(&tree->arena->files, file);
+    }
+    epoch_retire(tree, files->session, release_inode, NULL, id);
+}
+
+static void remove_dir(Filesystem *files, Directory *dir, Index_slot *slot)
+{
+    Tree *tree = files->tree;
+    Directory *sub = INODE_ENTRY(tree->inodes, slot->id).dir;
+    
+    unshare_below(files, sub);
+    index_remove(files, &dir->index, slot);
+    children_remove(files, &dir->children, sub->id);
+    
+    /* The whole sub tree is freed at once, when no thread can be in it. */
+    epoch_retire(tree, files->session, release_dir, sub, 0);
+}
+
+static void use_image(Directory *dir, const Image_dir *record)
+{
+    dir->image = record;
+    dir->usage.files = record->files;
+    dir->usage.dirs = record->dirs;
+    dir->usage.name_bytes = record->name_bytes;
+    dir->usage.depth = record->depth;
+}
+
+static void usage_added(Tree *tree, Directory *dir, Directory *sub, 
+                        size_t len)
+{
+    if (sub == NULL)
+    {
+        add_usage(tree, dir, 1, 0, len, 0);
+        return;
+    }
+    add_usage(tree, dir, sub->usage.files, sub->usage.dirs + 1, 
+              sub->usage.name_bytes + len, 0);
+    mutex_lock(&tree->usage_lock);
+    sub->counted = 1;
+    count_depth(tree, dir, 0, sub->usage.depth + 1);
+    mutex_unlock(&tree->usage_lock);
+}
+
+static void usage_removed(Tree *tree, Directory *dir, Directory *sub, 
+                          size_t len)
+{
+    if (sub == NULL)
+    {
+        add_usage(tree, dir, 1, 0, len, 1);
+        return;
+    }
+    mutex_lock(&tree->usage_lock);
+    sub->counted = 0;
+    count_depth(tree, dir, sub->usage.depth + 1, 0);
+    mutex_unlock(&tree->usage_lock);
+    add_usage(tree, dir, sub->usage.files, sub->usage.dirs + 1, 
+              sub->usage.name_bytes + len, 1);
+}
+
+static void add_usage(Tree *tree, Directory *dir, unsigned long files, 
+                      unsigned long dirs, unsigned long name_bytes, int take)
+{
+    /* Adding the negation takes away, since the counts wrap. */
+    if (take)
+    {
+        files = 0 - files;
+        dirs = 0 - dirs;
+        name_bytes = 0 - name_bytes;
+    }
+    for (; ; dir = dir->parent_dir)
+    {
+        ADD(dir->usage.files, files);
+        ADD(dir->usage.dirs, dirs);
+        ADD(dir->usage.name_bytes, name_bytes);
+        if (dir == tree->root)
+            return;
+    }
+}
+
+static void count_depth(Tree *tree, Directory *dir, unsigned long before,
+                        unsigned long after)
+{
+    unsigned long old;
+    
+    /* Only a directory whose tallest sub directory has just got shorter 
+     * has to look at the rest of them. */
+    while (before != after)
+    {
+        old = dir->usage.depth;
+        if (before == old && before > 0)
+            dir->tallest--;
+        if (after > old)
+        {
+            PUBLISH(dir->usage.depth, after);
+            dir->tallest = 1;
+        }
+        else if (after == old && after > 0)
+            dir->tallest++;
+        else if (dir->tallest == 0)
+            measure_depth(tree, dir);
+        
+        if (dir == tree->root || !dir->counted)
+            return;
+        before = old + 1;
+        after = dir->usage.depth + 1;
+        dir = dir->parent_dir;
+    }
+}
+
+static void measure_depth(Tree *tree, Directory *dir)
+{
+    Inode_table *inodes = tree->inodes;
+    Directory *sub;
+    unsigned long depth = 0, tallest = 0;
+    unsigned int id;
+    
+    for (id = LOAD(dir->children.first); id != 0; 
+         id = LOAD(INODE_NEXT(inodes, id)))
+    {
+        if (INODE_KIND(inodes, id) != SLOT_DIR || 
+            !(sub = INODE_ENTRY(inodes, id).dir)->counted)
+            continue;
+        if (sub->usage.depth + 1 > depth)
+        {
+            depth = sub->usage.depth + 1;
+            tallest = 1;
+        }
+        else if (sub->usage.depth + 1 == depth)
+            tallest++;
+    }
+    PUBLISH(dir->usage.depth, depth);
+    dir->tallest = tallest;
+}
+
+static int is_special(const char *name, size_t len)
+{
+    return (len == 1 && (name[0] == '.' || name[0] == '/')) || 
+           (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+static size_t glob_prefix(const char *pattern, size_t len)
+{
+    size_t i;
+    
+    for (i = 0; i < len; i++)
+        if (pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '[')
+            break;
+    return i;
+}
+
+static int glob_match(const char *pattern, size_t len, const char *name)
+{
+    const char *star_name = NULL;
+    size_t i = 0, star = 0, class_len;
+    int matched;
+    
+    /* On a mismatch after a *, the * takes one more character of the name
+     * and matching starts again after it. */
+    while (*name != '\0')
+    {
+        if (i < len && pattern[i] == '*')
+        {
+            star = ++i;
+            star_name = name;
+            continue;
+        }
+        if (i < len && pattern[i] == '?')
+        {
+            i++;
+            name++;
+            continue;
+        }
+        if (i < len && pattern[i] == '[' &&
+            (class_len = glob_class(pattern + i, len - i, 
+                                    (unsigned char) *name, &matched)) > 0)
+        {
+            if (matched)
+            {
+                i += class_len;
+                name++;
+                continue;
+            }
+        }
+        else if (i < len && pattern[i] == *name)
+        {
+            i++;
+            name++;
+            continue;
+        }
+        if (star_name == NULL)
+            return 0;
+        i = star;
+        name = ++star_name;
+    }
+    
+    while (i < len && pattern[i] == '*')
+        i++;
+    return i == len;
+}
+
+static size_t glob_class(const char *pattern, size_t len, int c, 
+                         int *matched)
+{
+    size_t i = 1;
+    int negate = 0;
+    
+    *matched = 0;
+    if (i < len && (pattern[i] == '!' || pattern[i] == '^'))
+    {
+        negate = 1;
+        i++;
+    }
+    
+    /* A ] right at the start is one of the characters. */
+    do
+    {
+        if (i >= len)
+            return 0;
+        if (i + 2 < len && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+        {
+            if ((unsigned char) pattern[i] <= c && 
+                c <= (unsigned char) pattern[i + 2])
+                *matched = 1;
+            i += 3;
+        }
+        else if ((unsigned char) pattern[i++] == c)
+            *matched = 1;
+    } while (i >= len || pattern[i] != ']');
+    
+    if (negate)
+        *matched = !*matched;
+    return i + 1;
+}
+
+static unsigned long name_hash(const char *name, size_t len)
+{
+    unsigned long hash = 2166136261UL;
+    
+    /* FNV-1a. */
+    while (len-- > 0)
+    {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static Index_slot *index_lookup(Filesystem *files, const Name_index *index,
+                                const char *name, size_t len, 
+                                unsigned long hash)
+{
+    Index_table *table, *old;
+    Index_slot *slot;
+    
+    /* Search the old table, if a resize is in progress, and then the current
+     * one. An entry is placed in the current table before it is taken out of
+     * the old one, so a lookup that misses it in the old table finds it in
+     * the current one. A table is only replaced under the directory's lock,
+     * and the old table is set before the current one, so loading the 
+     * current table first gives a matching pair; should either be replaced 
+     * during the search, a name that was not found is looked for again. */
+    do
+    {
+        table = LOAD(index->table);
+        old = LOAD(index->old_table);
+        if ((slot = table_lookup(files, old, name, len, hash)) != NULL ||
+            (slot = table_lookup(files, table, name, len, hash)) != NULL)
+            return slot;
+    } while (table != LOAD(index->table) || old != LOAD(index->old_table));
+    return NULL;
+}
+
+static void index_insert(Filesystem *files, Name_index *index, 
+                         unsigned long hash, size_t len, Slot_kind kind, 
+                         unsigned int id)
+{
+    Index_table *table;
+    unsigned long capacity;
+    
+    index_migrate(files, index, INDEX_MIGRATE_STEP);
+    
+    /* Keep the current table at most three quarters used (counting
+     * tombstones) so probe chains stay short and always end. */
+    capacity = index->table != NULL ? index->table->capacity : 0;
+    if ((index->used + 1) * 4 > capacity * 3)
+    {
+        /* If the previous resize has not finished, fold everything into one
+         * table at once; otherwise start moving into a table twice the size
+         * of the live entries, a few slots per call. */
+        if (index->old_table != NULL || index->table == NULL)
+            index_rebuild(files, index, index->count + 1);
+        else
+        {
+            capacity = INDEX_MIN_CAPACITY;
+            while (capacity < (index->count + 1) * 2)
+                capacity *= 2;
+            table = table_new(files->tree->arena, capacity);
+            
+            index->migrate_pos = 0;
+            PUBLISH(index->old_table, index->table);
+            PUBLISH(index->table, table);
+            index->used = 0;
+        }
+    }
+    
+    table_place(index->table, hash, len < SLOT_LEN_MAX ? len : SLOT_LEN_MAX,
+                kind, id);
+    index->used++;
+    index->count++;
+}
+
+static void index_remove(Filesystem *files, Name_index *index, 
+                         Index_slot *slot)
+{
+    /* The slot becomes a tombstone until its table is replaced; only the old
+     * table's slots can be moved by the migration below, and a tombstone is
+     * simply dropped. */
+    PUBLISH(slot->kind, SLOT_DELETED);
+    index->count--;
+    index_migrate(files, index, INDEX_MIGRATE_STEP);
+}
+
+static void index_fill(Filesystem *files, Name_index *index, 
+                       const Child_list *list)
+{
+    Inode_table *inodes = files->tree->inodes;
+    Index_table *table;
+    const char *name;
+    unsigned long capacity = INDEX_MIN_CAPACITY;
+    size_t len;
+    unsigned int id;
+    
+    while (capacity < index->count * 2)
+        capacity *= 2;
+    table = table_new(files->tree->arena, capacity);
+    for (id = list->first; id != 0; id = INODE_NEXT(inodes, id))
+    {
+        name = INODE_NAME(inodes, id);
+        len = strlen(name);
+        table_place(table, name_hash(name, len), 
+                    len < SLOT_LEN_MAX ? len : SLOT_LEN_MAX, 
+                    INODE_KIND(inodes, id), id);
+    }
+    PUBLISH(index->table, table);
+    index->used = index->count;
+}
+
+static void index_free(Arena *arena, Name_index *index)
+{
+    if (index->table != NULL)
+        arena_free(arena, index->table, table_size(index->table->capacity));
+    if (index->old_table != NULL)
+        arena_free(arena, index->old_table, 
+                   table_size(index->old_table->capacity));
+    memset(index, 0, sizeof(Name_index));
+}
+
+static size_t table_size(unsigned long capacity)
+{
+    return offsetof(Index_table, slots) + capacity * sizeof(Index_slot);
+}
+
+static Index_table *table_new(Arena *arena, unsigned long capacity)
+{
+    Index_table *table = arena_alloc(arena, table_size(capacity));
+    
+    memset(table, 0, table_size(capacity));
+    table->capacity = capacity;
+    return table;
+}
+
+static Index_slot *table_lookup(Filesystem *files, Index_table *table, 
+                                const char *name, size_t len, 
+                                unsigned long hash)
+{
+    Tree *tree = files->tree;
+    Inode_table *inodes = tree->inodes;
+    const char *entry_name, *pooled = NULL;
+    Index_slot *slot = NULL;
+    Slot_kind kind;
+    unsigned long mask, i, scanned = 0, compares = 0;
+    unsigned int slot_len = len < SLOT_LEN_MAX ? len : SLOT_LEN_MAX;
+    int looked = 0;
+    
+    if (table == NULL)
+        return NULL;
+    
+    /* A probe chain ends at the first slot that has never been used. A 
+     * slot's hash, length and ID are only read once its kind shows that 
+     * they have been published, and never change after that. Only a slot 
+     * whose hash and length both match has its entry's name compared, which
+     * no longer changes once the ID has been handed out. A short name is
+     * then known to be as long as the one looked for. A long one is looked
+     * up in the name pool, once, and is the same name only if it is the
+     * pooled text; only names the pool missed or never held, those still in
+     * the image, have their characters compared. */
+    mask = table->capacity - 1;
+    for (i = hash & mask; (kind = LOAD(table->slots[i].kind)) != SLOT_EMPTY;
+         i = (i + 1) & mask)
+    {
+        scanned++;
+        slot = &table->slots[i];
+        if (kind == SLOT_DELETED || slot->hash != (unsigned int) hash ||
+            slot->len != slot_len)
+            continue;
+        entry_name = INODE_NAME(inodes, slot->id);
+        compares++;
+        if (len < NAME_INLINE)
+        {
+            if (memcmp(entry_name, name, len) == 0)
+                break;
+            continue;
+        }
+        if (!looked)
+        {
+            pooled = name_find(tree->names, name, len, hash);
+            looked = 1;
+        }
+        if (entry_name == pooled)
+            break;
+        if ((pooled == NULL || image_owns(tree->image, entry_name)) &&
+            strncmp(entry_name, name, len) == 0 && entry_name[len] == '\0')
+            break;
+    }
+    COUNT(files->session->counters.scanned, scanned);
+    COUNT(files->session->counters.compares, compares);
+    return kind != SLOT_EMPTY ? slot : NULL;
+}
+
+static void table_place(Index_table *table, unsigned long hash, 
+                        unsigned int len, Slot_kind kind, unsigned int id)
+{
+    unsigned long mask = table->capacity - 1, i = hash & mask;
+    Index_slot *slot;
+    
+    while (table->slots[i].kind != SLOT_EMPTY)
+        i = (i + 1) & mask;
+    
+    slot = &table->slots[i];
+    slot->hash = (unsigned int) hash;
+    slot->len = len;
+    slot->id = id;
+    PUBLISH(slot->kind, kind);
+}
+
+static void index_migrate(Filesystem *files, Name_index *index, 
+                          unsigned long steps)
+{
+    Index_table *old;
+    Index_slot *slot;
+    
+    while ((old = index->old_table) != NULL && steps-- > 0)
+    {
+        slot = &old->slots[index->migrate_pos++];
+        
+        if (slot->kind == SLOT_FILE || slot->kind == SLOT_DIR)
+        {
+            /* Never let the current table fill up during a migration. */
+            if ((index->used + 1) * 4 > index->table->capacity * 3)
+            {
+                index->migrate_pos--;
+                index_rebuild(files, index, index->count);
+                return;
+            }
+            table_place(index->table, slot->hash, slot->len, slot->kind, 
+                        slot->id);
+            index->used++;
+            
+            /* Lookups still search the old table, so the moved entry must 
+             * not be found there again once it is removed from the new 
+             * one. */
+            PUBLISH(slot->kind, SLOT_DELETED);
+        }
+        
+        if (index->migrate_pos == old->capacity)
+        {
+            PUBLISH(index->old_table, NULL);
+            epoch_retire(files->tree, files->session, release_memory, old,
+                         table_size(old->capacity));
+        }
+    }
+}
+
+static void index_rebuild(Filesystem *files, Name_index *index, 
+                          unsigned long entries)
+{
+    Index_table *tables[2], *fresh;
+    Index_slot *slot;
+    unsigned long capacity = INDEX_MIN_CAPACITY, used = 0, i;
+    int pass;
+    
+    while (capacity < entries * 2)
+        capacity *= 2;
+    fresh = table_new(files->tree->arena, capacity);
+    
+    /* Copy every live entry of both tables; the old table's slots before
+     * migrate_pos have already been moved. */
+    tables[0] = index->table;
+    tables[1] = index->old_table;
+    for (pass = 0; pass < 2; pass++)
+    {
+        if (tables[pass] == NULL)
+            continue;
+        for (i = pass == 0 ? 0 : index->migrate_pos; 
+             i < tables[pass]->capacity; i++)
+        {
+            slot = &tables[pass]->slots[i];
+            if (slot->kind == SLOT_FILE || slot->kind == SLOT_DIR)
+            {
+                table_place(fresh, slot->hash, slot->len, slot->kind, 
+                            slot->id);
+                used++;
+            }
+        }
+    }
+    
+    /* Threads without the lock may still be searching the tables replaced. */
+    PUBLISH(index->table, fresh);
+    PUBLISH(index->old_table, NULL);
+    for (pass = 0; pass < 2; pass++)
+        if (tables[pass] != NULL)
+            epoch_retire(files->tree, files->session, release_memory, 
+                         tables[pass], table_size(tables[pass]->capacity));
+    index->used = used;
+    index->migrate_pos = 0;
+}
+
+static void children_insert(Filesystem *files, Child_list *list, 
+                            unsigned int id)
+{
+    Inode_table *inodes = files->tree->inodes;
+    const char *name = INODE_NAME(inodes, id);
+    Child **update[CHILD_MAX_LEVEL - 1], **links = list->head;
+    Child *node = NULL, *before = NULL;
+    unsigned int *link;
+    unsigned long compares = 0;
+    int height = child_height(list) - 1, i;
+    
+    if (height > 0)
+    {
+        node = slab_alloc(&files->tree->arena->children[height - 1]);
+        node->id = id;
+        node->height = height;
+    }
+    
+    /* The heads above the current level are always NULL. */
+    if (list->level < height)
+        list->level = height;
+    
+    /* Find, on every level, the link that the new entry goes after. The 
+     * bottom level is searched from the last node passed over. */
+    for (i = list->level - 1; i >= 0; i--)
+    {
+        while (links[i] != NULL && 
+               (compares++, 
+                strcmp(INODE_NAME(inodes, links[i]->id), name) < 0))
+        {
+            before = links[i];
+            links = before->next;
+        }
+        update[i] = &links[i];
+    }
+    link = before != NULL ? &INODE_NEXT(inodes, before->id) : &list->first;
+    while (*link != 0 && 
+           (compares++, strcmp(INODE_NAME(inodes, *link), name) < 0))
+        link = &INODE_NEXT(inodes, *link);
+    COUNT(files->session->counters.compares, compares);
+    
+    /* The entry's own links are set before it is published on any level, 
+     * from the bottom up. */
+    INODE_NEXT(inodes, id) = *link;
+    for (i = 0; i < height; i++)
+        node->next[i] = *update[i];
+    PUBLISH(*link, id);
+    for (i = 0; i < height; i++)
+        PUBLISH(*update[i], node);
+}
+
+static void children_append(Filesystem *files, Child_list *list, 
+                            unsigned int last, unsigned int id, Child **tails)
+{
+    Inode_table *inodes = files->tree->inodes;
+    Child *node = NULL;
+    int height = child_height(list) - 1, i;
+    
+    if (height > 0)
+    {
+        node = slab_alloc(&files->tree->arena->children[height - 1]);
+        node->id = id;
+        node->height = height;
+        for (i = 0; i < height; i++)
+            node->next[i] = NULL;
+    }
+    if (list->level < height)
+        list->level = height;
+    
+    INODE_NEXT(inodes, id) = 0;
+    PUBLISH(*(last != 0 ? &INODE_NEXT(inodes, last) : &list->first), id);
+    for (i = 0; i < height; i++)
+    {
+        PUBLISH(*(tails[i] != NULL ? &tails[i]->next[i] : &list->head[i]), 
+                node);
+        tails[i] = node;
+    }
+}
+
+static void children_remove(Filesystem *files, Child_list *list, 
+                            unsigned int id)
+{
+    Inode_table *inodes = files->tree->inodes;
+    const char *name = INODE_NAME(inodes, id);
+    Child **update[CHILD_MAX_LEVEL - 1], **links = list->head;
+    Child *node, *before = NULL;
+    unsigned int *link;
+    unsigned long compares = 0;
+    int i;
+    
+    for (i = list->level - 1; i >= 0; i--)
+    {
+        while (links[i] != NULL && 
+               (compares++, 
+                strcmp(INODE_NAME(inodes, links[i]->id), name) < 0))
+        {
+            before = links[i];
+            links = before->next;
+        }
+        update[i] = &links[i];
+    }
+    COUNT(files->session->counters.compares, compares);
+    
+    /* The entries between the last node passed over and this one are told
+     * apart by their IDs alone. */
+    link = before != NULL ? &INODE_NEXT(inodes, before->id) : &list->first;
+    while (*link != id)
+        link = &INODE_NEXT(inodes, *link);
+    PUBLISH(*link, INODE_NEXT(inodes, id));
+    
+    node = list->level > 0 ? *update[0] : NULL;
+    if (node == NULL || node->id != id)
+        return;
+    for (i = 0; i < node->height; i++)
+        PUBLISH(*update[i], node->next[i]);
+    while (list->level > 0 && list->head[list->level - 1] == NULL)
+        list->level--;
+    epoch_retire(files->tree, files->session, release_child, node, 0);
+}
+
+static unsigned int children_seek(Filesystem *files, Child_list *list, 
+                                  const char *prefix, size_t len)
+{
+    Inode_table *inodes = files->tree->inodes;
+    Child **links = list->head, *next, *before = NULL;
+    unsigned long compares = 0;
+    unsigned int id;
+    int i;
+    
+    /* The heads above the current level are NULL, so every level can be
+     * searched without reading the level, which may be changing. */
+    for (i = CHILD_MAX_LEVEL - 2; i >= 0; i--)
+        while ((next = LOAD(links[i])) != NULL && 
+               (compares++, 
+                strncmp(INODE_NAME(inodes, next->id), prefix, len) < 0))
+        {
+            before = next;
+            links = next->next;
+        }
+    id = before != NULL ? LOAD(INODE_NEXT(inodes, before->id)) 
+                        : LOAD(list->first);
+    while (id != 0 && 
+           (compares++, strncmp(INODE_NAME(inodes, id), prefix, len) < 0))
+        id = LOAD(INODE_NEXT(inodes, id));
+    COUNT(files->session->counters.compares, compares);
+    return id;
+}
+
+static void child_free(Arena *arena, Child *child)
+{
+    slab_free(&arena->children[child->height - 1], child);
+}
+
+static void children_free(Arena *arena, Child_list *list)
+{
+    Child *child = list->head[0], *next;
+    
+    while (child != NULL)
+    {
+        next = child->next[0];
+        child_free(arena, child);
+        child = next;
+    }
+    list->level = 0;
+    list->first = 0;
+    memset(list->head, 0, sizeof(list->head));
+}
+
+static int child_height(Child_list *list)
+{
+    unsigned long bits;
+    int height = 1;
+    
+    /* xorshift */
+    list->seed ^= list->seed << 13;
+    list->seed ^= list->seed >> 7;
+    list->seed ^= list->seed << 17;
+    
+    bits = list->seed;
+    while (height < CHILD_MAX_LEVEL && (bits & 3) == 0)
+    {
+        height++;
+        bits >>= 2;
+    }
+    return height;
 }
 
 /*******************************************************************************
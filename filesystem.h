@@ -6,6 +6,36 @@ int mkdir(Filesystem *files, const char arg[]);
 int cd(Filesystem *files, const char arg[]);
 int ls(Filesystem files, const char arg[]);
 void pwd(Filesystem files);
+size_t pwd_path(Filesystem files, char buf[], size_t size);
+int walk(Filesystem files, const char arg[], Walk_callback callback,
+         void *context, int threads);
+int du(Filesystem files, const char arg[], Usage *usage);
+int complete(Filesystem files, const char arg[], Walk_callback callback,
+             void *context);
 void rmfs(Filesystem *files);
 int rm(Filesystem *files, const char arg[]);
 int re_name(Filesystem *files, const char arg1[], const char arg2[]);
+long write_file(Filesystem *files, const char arg[], size_t offset, 
+                const char data[], size_t len);
+long read_file(Filesystem files, const char arg[], size_t offset, char buf[],
+               size_t len);
+long append_file(Filesystem *files, const char arg[], const char data[], 
+                 size_t len);
+int truncate_file(Filesystem *files, const char arg[], size_t size);
+int copy(Filesystem *files, const char arg1[], const char arg2[]);
+int move(Filesystem *files, const char arg1[], const char arg2[]);
+int snapshot(Filesystem *files, const char arg[]);
+int open_dir(Filesystem files, const char arg[], Dir_cursor *cursor);
+size_t read_dir(Dir_cursor *cursor, Dir_entry entries[], size_t count);
+void close_dir(Dir_cursor *cursor);
+int save_fs(Filesystem files, const char path[]);
+int load_fs(Filesystem *files, const char path[]);
+int build_fs(Filesystem *files, const char path[]);
+int open_fs(Filesystem *files, const char path[], unsigned long batch,
+            unsigned long window);
+int sync_fs(Filesystem *files);
+int checkpoint_fs(Filesystem *files);
+void new_session(Filesystem files, Filesystem *session);
+void end_session(Filesystem *session);
+void fs_stats(Filesystem files, Stats *stats);
+void fs_trace(Filesystem files, struct tracer *tracer);
@@ -0,0 +1,399 @@
+/*******************************************************************************
+ *  Saving a filesystem to an image file and mapping images back in. An image *
+ *  is written breadth first: each directory's record and sorted entries,     *
+ *  with the records of its sub directories after it. Loading maps the file   *
+ *  and reads nothing else; the filesystem then works from the mapping,      *
+ *  copying a directory into memory only when it is first looked into.       *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "image.h"
+#include "block-store.h"
+#include "inode.h"
+
+/* The value of byte_order in the header of an image written on this 
+ * machine. */
+#define BYTE_ORDER_MARK 0x01020304UL
+
+/* The offset that marks the root's record, which no entry refers to. */
+#define NO_PATCH ((unsigned long) -1)
+
+/* A growable byte buffer used while an image is being written. */
+typedef struct
+{
+    char *data;
+    unsigned long len;
+    unsigned long cap;
+}Buffer;
+
+/* A directory waiting to be written, either from memory (dir) or from the
+ * image it is still in (image_dir), and where in the directory region its
+ * parent's entry needs the offset of its record. */
+typedef struct
+{
+    Directory *dir;
+    const Image_dir *image_dir;
+    unsigned long patch;
+}Pending;
+
+/* Makes room for len more bytes at the end of a buffer and returns the 
+ * offset they start at. */
+static unsigned long buffer_grow(Buffer *, unsigned long);
+
+/* Writes the records of one directory, queueing its sub directories. The
+ * directory is passed by value since the queue may move as it grows. */
+static void save_dir(Pending, const Image *, Inode_table *, 
+                     struct block_store *, Buffer *, Buffer *, Buffer *, 
+                     Buffer *);
+
+/* Appends one entry to the directory region, returning its offset there. */
+static unsigned long save_entry(Buffer *, Buffer *, const char *, 
+                                unsigned long, unsigned long, unsigned long);
+
+/* Allocates memory, exiting the program if there is none left. */
+static void *alloc_or_exit(size_t);
+
+/* Maps an image file read only. On failure NULL is returned and the error
+ * is set to -1 if the file cannot be opened or mapped, or -2 if it is not an
+ * image this machine can use. */
+Image *image_map(const char *path, int *error)
+{
+    Image *image;
+    const Image_header *header;
+    void *base;
+    off_t size;
+    int fd = open(path, O_RDONLY);
+    
+    *error = -1;
+    if (fd < 0)
+        return NULL;
+    
+    size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t) sizeof(Image_header))
+    {
+        close(fd);
+        *error = size < 0 ? -1 : -2;
+        return NULL;
+    }
+    
+    base = mmap(NULL, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    
+    header = base;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header->version != IMAGE_VERSION || 
+        header->word_size != sizeof(unsigned long) ||
+        header->byte_order != BYTE_ORDER_MARK ||
+        header->dirs_size < sizeof(Image_dir) ||
+        sizeof(Image_header) + header->dirs_size + header->names_size + 
+        header->data_size != (unsigned long) size)
+    {
+        munmap(base, (size_t) size);
+        *error = -2;
+        return NULL;
+    }
+    
+    image = alloc_or_exit(sizeof(Image));
+    image->base = base;
+    image->size = (size_t) size;
+    image->header = header;
+    image->dirs = (const char *) base + sizeof(Image_header);
+    image->names = image->dirs + header->dirs_size;
+    image->data = image->names + header->names_size;
+    *error = 0;
+    return image;
+}
+
+/* Unmaps an image. Nothing that pointed into it may be used afterwards. */
+void image_unmap(Image *image)
+{
+    if (image != NULL)
+    {
+        munmap(image->base, image->size);
+        free(image);
+    }
+}
+
+/* Returns the record of the root directory of an image. */
+const Image_dir *image_root(const Image *image)
+{
+    return (const Image_dir *) image->dirs;
+}
+
+/* Returns the entry at an index of a directory record, or NULL if the image
+ * is damaged there. Since the image is only checked as it is used, this and
+ * the functions below check the offsets they follow. */
+const Image_entry *image_entry(const Image *image, const Image_dir *dir,
+                               unsigned long i)
+{
+    unsigned long offset = dir->entries + i * sizeof(Image_entry);
+    
+    if (i >= dir->count || dir->entries % sizeof(unsigned long) != 0 ||
+        offset + sizeof(Image_entry) > image->header->dirs_size ||
+        offset < dir->entries)
+        return NULL;
+    return (const Image_entry *) (image->dirs + offset);
+}
+
+/* Returns the terminated name of an entry, or NULL if the image is 
+ * damaged. */
+const char *image_name(const Image *image, const Image_entry *entry)
+{
+    if (entry->name_len == 0 || entry->name + entry->name_len < entry->name ||
+        entry->name + entry->name_len >= image->header->names_size ||
+        image->names[entry->name + entry->name_len] != '\0' ||
+        memchr(image->names + entry->name, '\0', entry->name_len) != NULL)
+        return NULL;
+    return image->names + entry->name;
+}
+
+/* Returns the contents of a file entry, or NULL if the image is damaged. */
+const char *image_data(const Image *image, const Image_entry *entry)
+{
+    if (entry->kind != IMAGE_FILE || entry->target + entry->size < entry->target
+        || entry->target + entry->size > image->header->data_size)
+        return NULL;
+    return image->data + entry->target;
+}
+
+/* Returns the record of a sub directory entry, or NULL if the image is 
+ * damaged. Records always come after the entries that refer to them, which
+ * rules out cycles. */
+const Image_dir *image_subdir(const Image *image, const Image_entry *entry)
+{
+    if (entry->kind != IMAGE_DIR || entry->target % sizeof(unsigned long) != 0 
+        || entry->target <= (unsigned long) ((const char *) entry - image->dirs)
+        || entry->target + sizeof(Image_dir) > image->header->dirs_size)
+        return NULL;
+    return (const Image_dir *) (image->dirs + entry->target);
+}
+
+/* Returns 1 if a pointer points into the image (NULL is never in it). */
+int image_owns(const Image *image, const void *ptr)
+{
+    const char *p = ptr;
+    
+    return image != NULL && p >= (const char *) image->base && 
+           p < (const char *) image->base + image->size;
+}
+
+/* Writes an image of the tree under root, whose entries are in the given 
+ * table, with the given stamp, to path, returning 0, or -1 if it cannot be
+ * written. Directories that are still only in the given image, and files 
+ * whose contents are, are copied from it. The image is written to a
+ * temporary file which then replaces path, so path may be the very image the
+ * filesystem was loaded from. The temporary file is synced before it is 
+ * renamed, so path always holds either the old image or the whole new one. */
+int image_save(Directory *root, const Image *image, Inode_table *inodes,
+               struct block_store *store, const char *path, 
+               unsigned long stamp)
+{
+    Buffer dirs = {NULL, 0, 0}, names = {NULL, 0, 0}, data = {NULL, 0, 0};
+    Buffer queue = {NULL, 0, 0};
+    Image_header header;
+    Pending *item;
+    unsigned long next = 0;
+    char *tmp_path = alloc_or_exit(strlen(path) + 5);
+    FILE *out;
+    int ok;
+    
+    next = buffer_grow(&queue, sizeof(Pending));
+    item = (Pending *) (queue.data + next);
+    item->dir = root->image != NULL ? NULL : root;
+    item->image_dir = root->image;
+    item->patch = NO_PATCH;
+    
+    /* Breadth first, so every record follows the entry pointing to it. */
+    while (next < queue.len)
+    {
+        save_dir(*(Pending *) (queue.data + next), image, inodes, store, 
+                 &dirs, &names, &data, &queue);
+        next += sizeof(Pending);
+    }
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.word_size = sizeof(unsigned long);
+    header.byte_order = BYTE_ORDER_MARK;
+    header.stamp = stamp;
+    header.dirs_size = dirs.len;
+    header.names_size = names.len;
+    header.data_size = data.len;
+    
+    sprintf(tmp_path, "%s.tmp", path);
+    out = fopen(tmp_path, "wb");
+    ok = out != NULL &&
+         fwrite(&header, sizeof(header), 1, out) == 1 &&
+         fwrite(dirs.data, 1, dirs.len, out) == dirs.len &&
+         (names.len == 0 ||
+          fwrite(names.data, 1, names.len, out) == names.len) &&
+         (data.len == 0 || fwrite(data.data, 1, data.len, out) == data.len) &&
+         fflush(out) == 0 && fsync(fileno(out)) == 0;
+    if (out != NULL && fclose(out) != 0)
+        ok = 0;
+    if (ok && rename(tmp_path, path) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmp_path);
+    
+    free(tmp_path);
+    free(dirs.data);
+    free(names.data);
+    free(data.data);
+    free(queue.data);
+    return ok ? 0 : -1;
+}
+
+static unsigned long buffer_grow(Buffer *buffer, unsigned long len)
+{
+    unsigned long offset = buffer->len;
+    char *data;
+    
+    if (buffer->len + len > buffer->cap)
+    {
+        buffer->cap = buffer->cap * 2 + len + 4096;
+        data = realloc(buffer->data, buffer->cap);
+        if (data == NULL)
+        {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        buffer->data = data;
+    }
+    buffer->len += len;
+    return offset;
+}
+
+static void save_dir(Pending item, const Image *image, Inode_table *inodes,
+                     struct block_store *store, Buffer *dirs, Buffer *names,
+                     Buffer *data, Buffer *queue)
+{
+    Directory *dir = item.dir;
+    const Image_dir *image_dir = item.image_dir;
+    const Image_entry *entry = NULL;
+    Directory *sub;
+    File *file;
+    Pending *pending;
+    Image_dir record;
+    unsigned long offset, at, queued, i;
+    unsigned int id;
+    
+    /* A copy that has not been read in yet is saved as its origin, which has
+     * not changed since. */
+    if (dir != NULL && dir->origin != NULL)
+        dir = dir->origin;
+    
+    /* The record, and the parent's entry that refers to it. A directory in
+     * memory has its totals up to date, and one still in the image has them
+     * in its record there. */
+    offset = buffer_grow(dirs, sizeof(Image_dir));
+    record.count = 0;
+    record.entries = offset + sizeof(Image_dir);
+    record.files = dir != NULL ? dir->usage.files : image_dir->files;
+    record.dirs = dir != NULL ? dir->usage.dirs : image_dir->dirs;
+    record.name_bytes = dir != NULL ? dir->usage.name_bytes 
+                                    : image_dir->name_bytes;
+    record.depth = dir != NULL ? dir->usage.depth : image_dir->depth;
+    memcpy(dirs->data + offset, &record, sizeof(record));
+    if (item.patch != NO_PATCH)
+        memcpy(dirs->data + item.patch + offsetof(Image_entry, target), 
+               &offset, sizeof(offset));
+    
+    /* The entries, in name order: a directory in memory is walked along its
+     * ordered index, and one still in the image already has its entries
+     * sorted. A file that has never had contents is saved as empty. Damaged
+     * image entries are dropped, so the count is only known at the end. */
+    for (i = 0, id = dir != NULL ? dir->children.first : 0; 
+         dir != NULL ? id != 0 : i < image_dir->count; i++)
+    {
+        sub = NULL;
+        if (dir != NULL)
+        {
+            if (INODE_KIND(inodes, id) == SLOT_FILE)
+            {
+                file = INODE_ENTRY(inodes, id).file;
+                at = buffer_grow(data, file != NULL ? file->size : 0);
+                if (file != NULL)
+                    file_read(store, file, 0, data->data + at, file->size);
+                save_entry(dirs, names, INODE_NAME(inodes, id), IMAGE_FILE, 
+                           at, file != NULL ? file->size : 0);
+                record.count++;
+                id = INODE_NEXT(inodes, id);
+                continue;
+            }
+            sub = INODE_ENTRY(inodes, id).dir;
+            id = INODE_NEXT(inodes, id);
+        }
+        else if ((entry = image_entry(image, image_dir, i)) == NULL)
+            break;
+        else if (image_name(image, entry) == NULL ||
+                 (entry->kind == IMAGE_FILE ? image_data(image, entry) 
+                                            : (const char *) 
+                                              image_subdir(image, entry))
+                 == NULL)
+            continue;
+        else if (entry->kind == IMAGE_FILE)
+        {
+            at = buffer_grow(data, entry->size);
+            memcpy(data->data + at, image_data(image, entry), entry->size);
+            save_entry(dirs, names, image_name(image, entry), IMAGE_FILE, at,
+                       entry->size);
+            record.count++;
+            continue;
+        }
+        
+        at = save_entry(dirs, names, sub != NULL ? INODE_NAME(inodes, sub->id)
+                                                 : image_name(image, entry),
+                        IMAGE_DIR, 0, 0);
+        record.count++;
+        queued = buffer_grow(queue, sizeof(Pending));
+        pending = (Pending *) (queue->data + queued);
+        pending->dir = sub != NULL && sub->image == NULL ? sub : NULL;
+        pending->image_dir = sub != NULL ? sub->image 
+                                         : image_subdir(image, entry);
+        pending->patch = at;
+    }
+    
+    memcpy(dirs->data + offset, &record, sizeof(record));
+}
+
+static unsigned long save_entry(Buffer *dirs, Buffer *names, const char *name,
+                                unsigned long kind, unsigned long target,
+                                unsigned long size)
+{
+    Image_entry entry;
+    unsigned long len = strlen(name), offset;
+    
+    entry.name = buffer_grow(names, len + 1);
+    memcpy(names->data + entry.name, name, len + 1);
+    entry.name_len = len;
+    entry.kind = kind;
+    entry.target = target;
+    entry.size = size;
+    
+    offset = buffer_grow(dirs, sizeof(Image_entry));
+    memcpy(dirs->data + offset, &entry, sizeof(entry));
+    return offset;
+}
+
+static void *alloc_or_exit(size_t size)
+{
+    void *ptr = malloc(size);
+    
+    if (ptr == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    return ptr;
+}
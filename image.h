@@ -0,0 +1,85 @@
+#ifndef _image_h
+#define _image_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+struct block_store;
+
+/* The first bytes of every image, and the version of the format below. */
+#define IMAGE_MAGIC "UFSIMG1"
+#define IMAGE_VERSION 3
+
+/* The kinds of entry in an image directory. */
+#define IMAGE_FILE 0
+#define IMAGE_DIR 1
+
+/* An image is a header followed by three regions: directory records, a name
+ * table of terminated names, and file contents. Nothing in it is a pointer;
+ * every reference is an offset from the start of the region it points into,
+ * so an image can be mapped at any address and used in place. The header 
+ * records the word size and byte order it was written with, and an image is
+ * only loaded by a machine that agrees. The stamp is whatever number the 
+ * image was saved with; a journaled filesystem uses it to tell which of its
+ * checkpoints an image is. */
+typedef struct
+{
+    char magic[8];
+    unsigned long version;
+    unsigned long word_size;
+    unsigned long byte_order;
+    unsigned long stamp;
+    unsigned long dirs_size;
+    unsigned long names_size;
+    unsigned long data_size;
+}Image_header;
+
+/* A directory record: how many entries it has and the offset of the first
+ * one, and the totals of what is below it (see Usage), so that a directory
+ * knows them before it is read in. Its entries follow it, sorted by name. 
+ * The root's record is first. */
+typedef struct image_dir
+{
+    unsigned long count;
+    unsigned long entries;
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long name_bytes;
+    unsigned long depth;
+}Image_dir;
+
+/* An entry of a directory record. target is the offset of a sub directory's
+ * record, or of a file's contents, whose length is size. */
+typedef struct
+{
+    unsigned long name;
+    unsigned long name_len;
+    unsigned long kind;
+    unsigned long target;
+    unsigned long size;
+}Image_entry;
+
+/* A mapped image. */
+typedef struct image
+{
+    void *base;
+    size_t size;
+    const char *dirs;
+    const char *names;
+    const char *data;
+    const Image_header *header;
+}Image;
+
+Image *image_map(const char *, int *);
+void image_unmap(Image *);
+const Image_dir *image_root(const Image *);
+const Image_entry *image_entry(const Image *, const Image_dir *, 
+                               unsigned long);
+const char *image_name(const Image *, const Image_entry *);
+const char *image_data(const Image *, const Image_entry *);
+const Image_dir *image_subdir(const Image *, const Image_entry *);
+int image_owns(const Image *, const void *);
+int image_save(Directory *, const Image *, struct inode_table *, 
+               struct block_store *, const char *, unsigned long);
+
+#endif
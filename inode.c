@@ -0,0 +1,92 @@
+/*******************************************************************************
+ *  The table of every file and directory of a filesystem. An entry is a     *
+ *  32 bit ID rather than a node of its own: its fields are spread over      *
+ *  arrays that each hold one field of a page of entries, so that walking a  *
+ *  directory's entries in name order, which follows the next field and      *
+ *  reads the names, touches those arrays alone, and entries made one after  *
+ *  another sit side by side. The IDs of removed entries are handed out      *
+ *  again, once no thread can still be following them.                       *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "inode.h"
+#include "arena.h"
+
+/* Creates a table with one page, and every ID but 0 never handed out. The
+ * page table is not cleared, since only the first page_count pointers are
+ * ever read. */
+Inode_table *inodes_new(Arena *arena)
+{
+    Inode_table *table = arena_alloc(arena, sizeof(Inode_table));
+    
+    table->arena = arena;
+    table->pages[0] = arena_alloc(arena, sizeof(Inode_page));
+    table->page_count = 1;
+    table->top = 1;
+    table->free = 0;
+    table->files = 0;
+    table->dirs = 0;
+    mutex_init(&table->lock);
+    return table;
+}
+
+/* Returns an ID for a new entry of the given kind, which is set. Its other
+ * fields are for the caller to fill in before it hands the ID to any other
+ * thread. */
+unsigned int inode_alloc(Inode_table *table, Slot_kind kind)
+{
+    unsigned int id;
+    
+    mutex_lock(&table->lock);
+    if (table->free != 0)
+    {
+        id = table->free;
+        table->free = INODE_NEXT(table, id);
+    }
+    else
+    {
+        /* A page is added before any of its IDs are handed out, and the
+         * pointer to it reaches other threads along with them. */
+        if (table->top == (unsigned long) INODE_PAGES * INODE_PAGE)
+        {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        id = table->top++;
+        if (id / INODE_PAGE == table->page_count)
+            table->pages[table->page_count++] =
+                arena_alloc(table->arena, sizeof(Inode_page));
+    }
+    if (kind == SLOT_FILE)
+        table->files++;
+    else
+        table->dirs++;
+    mutex_unlock(&table->lock);
+    
+    INODE_KIND(table, id) = kind;
+    return id;
+}
+
+/* Gives an ID back, to be handed out again. No thread may still be able to
+ * reach it, and its name and entry must already have been let go of. */
+void inode_free(Inode_table *table, unsigned int id)
+{
+    mutex_lock(&table->lock);
+    if (INODE_KIND(table, id) == SLOT_FILE)
+        table->files--;
+    else
+        table->dirs--;
+    INODE_NEXT(table, id) = table->free;
+    table->free = id;
+    mutex_unlock(&table->lock);
+}
+
+/* Stores in stats how many files and directories have IDs. */
+void inodes_stats(Inode_table *table, Stats *stats)
+{
+    mutex_lock(&table->lock);
+    stats->files = table->files;
+    stats->dirs = table->dirs;
+    mutex_unlock(&table->lock);
+}
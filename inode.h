@@ -0,0 +1,70 @@
+#ifndef _inode_h
+#define _inode_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+/* Entries are numbered with 32 bit IDs, 0 meaning none. Their fields are kept
+ * in pages of INODE_PAGE entries, found through a table of INODE_PAGES page
+ * pointers which, like the chunk table of a block store, never moves. That
+ * allows for 64 million entries at a time. */
+#define INODE_PAGE 4096
+#define INODE_PAGES 16384
+
+/* The fields of INODE_PAGE entries, each in an array of its own, so that a
+ * walk along a directory's entries, which only looks at a few of them, reads
+ * nothing else: what kind of entry each is (a Slot_kind), the ID of the next
+ * entry of the directory it is in, in name order, where its name is, the
+ * file or sub directory it is, and the bytes that hold its name when it is
+ * short enough. A file that has never had any contents is only an entry,
+ * with no File. Only the next entry, and a file's File, ever change once an
+ * entry has been published; a renamed or moved entry gets a new ID. */
+typedef struct
+{
+    unsigned char kind[INODE_PAGE];
+    unsigned int next[INODE_PAGE];
+    char *name[INODE_PAGE];
+    union
+    {
+        File *file;
+        struct dir *dir;
+    } entry[INODE_PAGE];
+    char short_name[INODE_PAGE][NAME_INLINE];
+}Inode_page;
+
+/* The entries of one filesystem: its pages, page_count of them, the next ID
+ * never handed out, and the IDs given back, chained through their next
+ * fields, as well as how many files and directories have IDs. The lock
+ * guards all of them; the fields of an entry are read without it, through
+ * the macros below, by any thread that has been handed its ID. */
+typedef struct inode_table
+{
+    struct arena *arena;
+    unsigned long page_count;
+    unsigned int top;
+    unsigned int free;
+    unsigned long files;
+    unsigned long dirs;
+    Mutex lock;
+    Inode_page *pages[INODE_PAGES];
+}Inode_table;
+
+/* The fields of an entry of a table, which may be assigned to. */
+#define INODE_PAGE_OF(table, id) ((table)->pages[(id) / INODE_PAGE])
+#define INODE_KIND(table, id) \
+    (INODE_PAGE_OF(table, id)->kind[(id) % INODE_PAGE])
+#define INODE_NEXT(table, id) \
+    (INODE_PAGE_OF(table, id)->next[(id) % INODE_PAGE])
+#define INODE_NAME(table, id) \
+    (INODE_PAGE_OF(table, id)->name[(id) % INODE_PAGE])
+#define INODE_ENTRY(table, id) \
+    (INODE_PAGE_OF(table, id)->entry[(id) % INODE_PAGE])
+#define INODE_SHORT(table, id) \
+    (INODE_PAGE_OF(table, id)->short_name[(id) % INODE_PAGE])
+
+Inode_table *inodes_new(struct arena *);
+unsigned int inode_alloc(Inode_table *, Slot_kind);
+void inode_free(Inode_table *, unsigned int);
+void inodes_stats(Inode_table *, Stats *);
+
+#endif
@@ -0,0 +1,138 @@
+/*******************************************************************************
+ *  Measures how many mutations per second a journaled filesystem sustains   *
+ *  at different group commit settings, and how long replaying the journal   *
+ *  takes when the filesystem is opened again.                               *
+ *                                                                            *
+ *  Usage: journal-bench [path [mutations]]                                  *
+ *                                                                            *
+ *  The filesystem is kept at path (journal-bench by default), whose journal *
+ *  and checkpoint are removed before and after each run.                    *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+#include "journal.h"
+
+/* A group commit setting: records per group and the time window in
+ * milliseconds. */
+typedef struct
+{
+    unsigned long batch;
+    unsigned long window;
+}Setting;
+
+static const Setting settings[] = {{1, 0}, {8, 0}, {64, 0}, {512, 0},
+                                   {4096, 0}, {100000, 10}, {100000, 100}};
+
+/* Removes the files of the filesystem kept at path. */
+static void remove_files(const char *);
+
+/* Makes the given number of mutations: files and directories are created,
+ * written, renamed and removed in a few hundred directories. */
+static void mutate(Filesystem *, unsigned long);
+
+/* Returns the time in seconds since some fixed point. */
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "journal-bench";
+    unsigned long mutations = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+    Filesystem files;
+    double start, elapsed, replay;
+    unsigned long i;
+    
+    printf("%8s %8s %14s %12s\n", "batch", "window", "mutations/sec",
+           "replay (ms)");
+    for (i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+    {
+        remove_files(path);
+        if (open_fs(&files, path, settings[i].batch, settings[i].window) != 0)
+        {
+            printf("Cannot open %s\n", path);
+            return 1;
+        }
+        
+        start = now();
+        mutate(&files, mutations);
+        if (sync_fs(&files) != 0)
+        {
+            printf("Cannot write the journal of %s\n", path);
+            return 1;
+        }
+        elapsed = now() - start;
+        rmfs(&files);
+        
+        start = now();
+        open_fs(&files, path, 1, 0);
+        replay = now() - start;
+        rmfs(&files);
+        
+        printf("%8lu %6lums %14.0f %12.1f\n", settings[i].batch,
+               settings[i].window, mutations / elapsed, replay * 1000);
+    }
+    remove_files(path);
+    return 0;
+}
+
+static void remove_files(const char *path)
+{
+    char name[4096];
+    
+    sprintf(name, "%.4000s%s", path, JOURNAL_SUFFIX);
+    remove(name);
+    sprintf(name, "%.4000s%s", path, CHECKPOINT_SUFFIX);
+    remove(name);
+}
+
+static void mutate(Filesystem *files, unsigned long mutations)
+{
+    static const char data[] = "The quick brown fox jumps over the lazy dog.";
+    char name[64], other[64];
+    unsigned long i, seed = 12345;
+    
+    for (i = 0; i < mutations; i++)
+    {
+        seed = seed * 1103515245UL + 12345;
+        sprintf(name, "d%lu/f%lu", (seed >> 8) % 256, (seed >> 16) % 64);
+        
+        switch ((seed >> 24) % 8)
+        {
+            case 0:
+                sprintf(name, "d%lu", (seed >> 8) % 256);
+                mkdir(files, name);
+                break;
+            case 1:
+            case 2:
+                touch(files, name);
+                break;
+            case 3:
+            case 4:
+                append_file(files, name, data, sizeof(data) - 1);
+                break;
+            case 5:
+                write_file(files, name, 0, data, sizeof(data) - 1);
+                break;
+            case 6:
+                sprintf(other, "g%lu", (seed >> 16) % 64);
+                re_name(files, name, other);
+                break;
+            default:
+                rm(files, name);
+                break;
+        }
+    }
+}
+
+static double now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
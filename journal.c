@@ -0,0 +1,358 @@
+/*******************************************************************************
+ *  The journal of a filesystem kept on disk. Every mutation is appended to   *
+ *  the journal as a record; records are written out and synced in groups,   *
+ *  so that many mutations share the cost of one sync. The journal follows a *
+ *  checkpoint image, and at startup its records are replayed on top of it.  *
+ *  Each record carries a checksum, so a record torn by a crash ends the     *
+ *  journal instead of being replayed.                                       *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "journal.h"
+
+/* The first bytes of every journal. */
+#define JOURNAL_MAGIC "UFSJRN1"
+
+/* The value of byte_order in the header of a journal written on this
+ * machine. */
+#define BYTE_ORDER_MARK 0x01020304UL
+
+/* The number of words before the strings of a record's payload. */
+#define RECORD_WORDS 6
+
+/* The start of a journal file. epoch is the stamp of the checkpoint that the
+ * journal's records are to be replayed on. */
+typedef struct
+{
+    char magic[8];
+    unsigned long word_size;
+    unsigned long byte_order;
+    unsigned long epoch;
+}Journal_header;
+
+/* Makes room for len more pending bytes and returns where they start. */
+static char *pending_grow(Journal *, size_t);
+
+/* Writes all of a buffer to a file, returning 0, or -1 on an error. */
+static int write_all(int, const char *, size_t);
+
+/* Returns a checksum of a record's payload. */
+static unsigned long checksum(const char *, size_t);
+
+/* Returns the time in milliseconds since some fixed point. */
+static unsigned long now_ms(void);
+
+/* Allocates memory, exiting the program if there is none left. */
+static void *alloc_or_exit(size_t);
+
+/* Opens (creating it if need be) the journal of the filesystem at path, which
+ * commits after batch records or window milliseconds (0 for no limit). It
+ * must be replayed before anything is appended. On failure NULL is returned
+ * and the error is set to -1. */
+Journal *journal_open(const char *path, unsigned long batch,
+                      unsigned long window, int *error)
+{
+    Journal *journal = alloc_or_exit(sizeof(Journal));
+    
+    journal->path = alloc_or_exit(strlen(path) + sizeof(JOURNAL_SUFFIX));
+    sprintf(journal->path, "%s%s", path, JOURNAL_SUFFIX);
+    journal->checkpoint = alloc_or_exit(strlen(path) +
+                                        sizeof(CHECKPOINT_SUFFIX));
+    sprintf(journal->checkpoint, "%s%s", path, CHECKPOINT_SUFFIX);
+    
+    journal->fd = open(journal->path, O_RDWR | O_CREAT, 0666);
+    if (journal->fd < 0)
+    {
+        free(journal->path);
+        free(journal->checkpoint);
+        free(journal);
+        *error = -1;
+        return NULL;
+    }
+    
+    journal->epoch = 0;
+    journal->batch = batch > 0 ? batch : 1;
+    journal->window = window;
+    journal->pending = NULL;
+    journal->pending_len = 0;
+    journal->pending_cap = 0;
+    journal->pending_count = 0;
+    journal->first_pending = 0;
+    journal->size = 0;
+    journal->failed = 0;
+    *error = 0;
+    return journal;
+}
+
+/* Passes every intact record of a journal that follows the checkpoint with
+ * the given epoch to apply, along with context, and leaves the journal ready
+ * for new records after them. A journal that follows an earlier checkpoint
+ * has already been compacted into this one and is emptied instead. Returns
+ * 0, -1 if the journal cannot be read or written, or -2 if it is not a
+ * journal this machine wrote or follows a later checkpoint than this one. */
+int journal_replay(Journal *journal, unsigned long epoch,
+                   void (*apply)(void *, const Journal_record *),
+                   void *context)
+{
+    Journal_header header;
+    Journal_record record;
+    unsigned long words[RECORD_WORDS], len, check;
+    off_t size = lseek(journal->fd, 0, SEEK_END);
+    size_t pos = 0, got = 0, end;
+    ssize_t n;
+    char *data;
+    
+    if (size < 0)
+        return -1;
+    data = alloc_or_exit((size_t) size + 1);
+    if (lseek(journal->fd, 0, SEEK_SET) != 0)
+    {
+        free(data);
+        return -1;
+    }
+    while (got < (size_t) size)
+    {
+        n = read(journal->fd, data + got, (size_t) size - got);
+        if (n <= 0)
+        {
+            free(data);
+            return -1;
+        }
+        got += (size_t) n;
+    }
+    
+    /* A header cut short can only come from a crash while the journal was
+     * being started, so it holds no records. */
+    if (got >= sizeof(header))
+    {
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+            header.word_size != sizeof(unsigned long) ||
+            header.byte_order != BYTE_ORDER_MARK || header.epoch > epoch)
+        {
+            free(data);
+            return -2;
+        }
+        if (header.epoch == epoch)
+            pos = sizeof(header);
+    }
+    
+    /* Apply records up to the first one that is incomplete or damaged. */
+    while (pos > 0 && got - pos >= 2 * sizeof(unsigned long))
+    {
+        memcpy(&len, data + pos, sizeof(len));
+        memcpy(&check, data + pos + sizeof(len), sizeof(check));
+        end = pos + 2 * sizeof(unsigned long) + len;
+        if (len < sizeof(words) + 3 || end > got || end < pos ||
+            checksum(data + pos + 2 * sizeof(unsigned long), len) != check)
+            break;
+        
+        memcpy(words, data + pos + 2 * sizeof(unsigned long), sizeof(words));
+        record.op = (Journal_op) words[0];
+        record.offset = words[1];
+        record.cwd_len = words[2];
+        record.arg1_len = words[3];
+        record.arg2_len = words[4];
+        record.data_len = words[5];
+        if (record.cwd_len + record.arg1_len + record.arg2_len +
+            record.data_len + 3 != len - sizeof(words))
+            break;
+        
+        record.cwd = data + pos + 2 * sizeof(unsigned long) + sizeof(words);
+        record.arg1 = record.cwd + record.cwd_len + 1;
+        record.arg2 = record.arg1 + record.arg1_len + 1;
+        record.data = record.arg2 + record.arg2_len + 1;
+        apply(context, &record);
+        pos = end;
+    }
+    free(data);
+    
+    if (pos == 0)
+        return journal_reset(journal, epoch);
+    
+    /* Drop whatever follows the last intact record. */
+    if (ftruncate(journal->fd, (off_t) pos) != 0 || fsync(journal->fd) != 0 ||
+        lseek(journal->fd, (off_t) pos, SEEK_SET) != (off_t) pos)
+        return -1;
+    journal->epoch = epoch;
+    journal->size = pos;
+    return 0;
+}
+
+/* Adds a record to a journal, committing it if its group is complete.
+ * Returns 0, or -1 if the journal could not be written, now or before. */
+int journal_append(Journal *journal, const Journal_record *record)
+{
+    unsigned long words[RECORD_WORDS], len, check;
+    char *out, *payload;
+    
+    if (journal->failed)
+        return -1;
+    
+    words[0] = (unsigned long) record->op;
+    words[1] = record->offset;
+    words[2] = record->cwd_len;
+    words[3] = record->arg1_len;
+    words[4] = record->arg2_len;
+    words[5] = record->data_len;
+    len = sizeof(words) + record->cwd_len + record->arg1_len +
+          record->arg2_len + record->data_len + 3;
+    
+    out = pending_grow(journal, 2 * sizeof(unsigned long) + len);
+    payload = out + 2 * sizeof(unsigned long);
+    memcpy(payload, words, sizeof(words));
+    payload += sizeof(words);
+    memcpy(payload, record->cwd, record->cwd_len);
+    payload += record->cwd_len;
+    *payload++ = '\0';
+    memcpy(payload, record->arg1, record->arg1_len);
+    payload += record->arg1_len;
+    *payload++ = '\0';
+    memcpy(payload, record->arg2, record->arg2_len);
+    payload += record->arg2_len;
+    *payload++ = '\0';
+    memcpy(payload, record->data, record->data_len);
+    
+    check = checksum(out + 2 * sizeof(unsigned long), len);
+    memcpy(out, &len, sizeof(len));
+    memcpy(out + sizeof(len), &check, sizeof(check));
+    
+    if (journal->pending_count++ == 0 && journal->window > 0)
+        journal->first_pending = now_ms();
+    journal->size += 2 * sizeof(unsigned long) + len;
+    
+    if (journal->pending_count >= journal->batch ||
+        (journal->window > 0 &&
+         now_ms() - journal->first_pending >= journal->window))
+        return journal_commit(journal);
+    return 0;
+}
+
+/* Writes out and syncs every pending record of a journal. Returns 0, or -1
+ * if the journal could not be written, now or before. */
+int journal_commit(Journal *journal)
+{
+    if (!journal->failed && journal->pending_len > 0 &&
+        (write_all(journal->fd, journal->pending, journal->pending_len) != 0 ||
+         fsync(journal->fd) != 0))
+        journal->failed = 1;
+    
+    journal->pending_len = 0;
+    journal->pending_count = 0;
+    return journal->failed ? -1 : 0;
+}
+
+/* Empties a journal, dropping any pending records, to follow the checkpoint
+ * with the given epoch. Returns 0, or -1 if the journal cannot be written. */
+int journal_reset(Journal *journal, unsigned long epoch)
+{
+    Journal_header header;
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    header.word_size = sizeof(unsigned long);
+    header.byte_order = BYTE_ORDER_MARK;
+    header.epoch = epoch;
+    
+    journal->pending_len = 0;
+    journal->pending_count = 0;
+    if (ftruncate(journal->fd, 0) != 0 || lseek(journal->fd, 0, SEEK_SET) != 0
+        || write_all(journal->fd, (char *) &header, sizeof(header)) != 0 ||
+        fsync(journal->fd) != 0)
+    {
+        journal->failed = 1;
+        return -1;
+    }
+    journal->failed = 0;
+    journal->epoch = epoch;
+    journal->size = sizeof(header);
+    return 0;
+}
+
+/* Commits and closes a journal, returning like journal_commit(). */
+int journal_close(Journal *journal)
+{
+    int result = journal_commit(journal);
+    
+    if (close(journal->fd) != 0)
+        result = -1;
+    free(journal->pending);
+    free(journal->path);
+    free(journal->checkpoint);
+    free(journal);
+    return result;
+}
+
+static char *pending_grow(Journal *journal, size_t len)
+{
+    char *pending;
+    
+    if (journal->pending_len + len > journal->pending_cap)
+    {
+        journal->pending_cap = journal->pending_cap * 2 + len + 4096;
+        pending = realloc(journal->pending, journal->pending_cap);
+        if (pending == NULL)
+        {
+            printf("Memory allocation failed!\n");
+            exit(1);
+        }
+        journal->pending = pending;
+    }
+    journal->pending_len += len;
+    return journal->pending + journal->pending_len - len;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+    
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static unsigned long checksum(const char *data, size_t len)
+{
+    unsigned long hash = 2166136261UL;
+    
+    /* FNV-1a. */
+    while (len-- > 0)
+    {
+        hash ^= (unsigned char) *data++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static unsigned long now_ms(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void *alloc_or_exit(size_t size)
+{
+    void *ptr = malloc(size);
+    
+    if (ptr == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    return ptr;
+}
@@ -0,0 +1,71 @@
+#ifndef _journal_h
+#define _journal_h
+
+#include <stddef.h>
+
+/* The files a journaled filesystem keeps, named by adding these to the path
+ * it was opened with: the journal itself and the checkpoint image the journal
+ * is replayed on top of. */
+#define JOURNAL_SUFFIX ".journal"
+#define CHECKPOINT_SUFFIX ".image"
+
+/* A journal that grows past this many bytes is compacted into a new
+ * checkpoint. */
+#define JOURNAL_CHECKPOINT_SIZE (16UL * 1024 * 1024)
+
+/* The kinds of mutation a journal records. */
+typedef enum {JOURNAL_TOUCH, JOURNAL_MKDIR, JOURNAL_RM, JOURNAL_RENAME,
+              JOURNAL_WRITE, JOURNAL_TRUNCATE, JOURNAL_COPY, 
+              JOURNAL_MOVE, JOURNAL_SNAPSHOT} Journal_op;
+
+/* One mutation: the current directory it was made in (empty for an absolute
+ * path), its arguments and, for a write, where and what was written. A
+ * truncation keeps its new size in offset. Strings handed to a replay
+ * function are terminated. */
+typedef struct
+{
+    Journal_op op;
+    const char *cwd;
+    size_t cwd_len;
+    const char *arg1;
+    size_t arg1_len;
+    const char *arg2;
+    size_t arg2_len;
+    unsigned long offset;
+    const char *data;
+    size_t data_len;
+}Journal_record;
+
+/* An open journal. Records are appended to pending and written out, and the
+ * file synced, once batch of them are waiting or window milliseconds have
+ * passed since the first of them was, whichever comes first. Since nothing
+ * runs in the background, the window is only checked when another record is
+ * added or the journal is committed. size counts every byte of the journal,
+ * pending ones included, and epoch is the stamp of the checkpoint it
+ * follows. */
+typedef struct journal
+{
+    int fd;
+    char *path;
+    char *checkpoint;
+    unsigned long epoch;
+    unsigned long batch;
+    unsigned long window;
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    unsigned long pending_count;
+    unsigned long first_pending;
+    unsigned long size;
+    int failed;
+}Journal;
+
+Journal *journal_open(const char *, unsigned long, unsigned long, int *);
+int journal_replay(Journal *, unsigned long,
+                   void (*)(void *, const Journal_record *), void *);
+int journal_append(Journal *, const Journal_record *);
+int journal_commit(Journal *);
+int journal_reset(Journal *, unsigned long);
+int journal_close(Journal *);
+
+#endif
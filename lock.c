@@ -0,0 +1,78 @@
+/*******************************************************************************
+ *  The locks of a filesystem shared between threads, on top of POSIX         *
+ *  threads. A lock that cannot be taken or released means the program has    *
+ *  a bug that nothing could recover from, so it exits like a failed          *
+ *  allocation does.                                                           *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "lock.h"
+
+#define RWLOCK(lock) ((pthread_rwlock_t *) (lock)->words)
+#define MUTEX(lock) ((pthread_mutex_t *) (lock)->words)
+
+/* Compilation fails here if the storage in lock.h is too small for this
+ * system's locks. */
+typedef char rwlock_fits[sizeof(pthread_rwlock_t) <= sizeof(Rwlock) ? 1 : -1];
+typedef char mutex_fits[sizeof(pthread_mutex_t) <= sizeof(Mutex) ? 1 : -1];
+
+/* Exits the program if a pthreads call did not succeed. */
+static void check(int);
+
+void rwlock_init(Rwlock *lock)
+{
+    check(pthread_rwlock_init(RWLOCK(lock), NULL));
+}
+
+void rwlock_read(Rwlock *lock)
+{
+    check(pthread_rwlock_rdlock(RWLOCK(lock)));
+}
+
+void rwlock_write(Rwlock *lock)
+{
+    check(pthread_rwlock_wrlock(RWLOCK(lock)));
+}
+
+void rwlock_unlock(Rwlock *lock)
+{
+    check(pthread_rwlock_unlock(RWLOCK(lock)));
+}
+
+void rwlock_destroy(Rwlock *lock)
+{
+    check(pthread_rwlock_destroy(RWLOCK(lock)));
+}
+
+void mutex_init(Mutex *lock)
+{
+    check(pthread_mutex_init(MUTEX(lock), NULL));
+}
+
+void mutex_lock(Mutex *lock)
+{
+    check(pthread_mutex_lock(MUTEX(lock)));
+}
+
+void mutex_unlock(Mutex *lock)
+{
+    check(pthread_mutex_unlock(MUTEX(lock)));
+}
+
+void mutex_destroy(Mutex *lock)
+{
+    check(pthread_mutex_destroy(MUTEX(lock)));
+}
+
+static void check(int error)
+{
+    if (error != 0)
+    {
+        printf("Locking failed!\n");
+        exit(1);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef _lock_h
+#define _lock_h
+
+/* Storage for the locks that make a filesystem safe to share between threads.
+ * The system's lock types are only visible with POSIX extensions turned on,
+ * which the filesystem's own headers cannot be compiled with (mkdir() would
+ * clash with the system's), so locks are kept in opaque storage that lock.c
+ * checks is big enough. A lock embedded in a node that is freed along with a
+ * whole arena is never destroyed; on the systems this builds on, destroying a
+ * lock releases nothing. */
+#define RWLOCK_WORDS 8
+#define MUTEX_WORDS 6
+
+/* A reader-writer lock: any number of readers, or one writer. */
+typedef struct
+{
+    unsigned long words[RWLOCK_WORDS];
+}Rwlock;
+
+/* A mutual exclusion lock, for short critical sections. */
+typedef struct
+{
+    unsigned long words[MUTEX_WORDS];
+}Mutex;
+
+void rwlock_init(Rwlock *);
+void rwlock_read(Rwlock *);
+void rwlock_write(Rwlock *);
+void rwlock_unlock(Rwlock *);
+void rwlock_destroy(Rwlock *);
+void mutex_init(Mutex *);
+void mutex_lock(Mutex *);
+void mutex_unlock(Mutex *);
+void mutex_destroy(Mutex *);
+
+#endif
@@ -0,0 +1,206 @@
+/*******************************************************************************
+ *  The pool of long names of a filesystem. A name too long to be kept       *
+ *  inside a file or directory is stored once, however many entries have     *
+ *  it, and counted by reference: adding an entry with a name already in the *
+ *  pool only bumps its count, and the name is freed with the last entry     *
+ *  holding it. Entries point straight at the characters, so nothing that    *
+ *  reads a name knows whether it is pooled, and a name looked up once in    *
+ *  the pool is told apart from the names of entries by their addresses.     *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "names.h"
+#include "arena.h"
+#include "epoch.h"
+
+/* Returns the pooled name whose characters are at text. */
+static Pooled_name *name_of(char *);
+
+/* Returns the number of bytes allocated for a pooled name of the given
+ * length. */
+static size_t name_size(size_t);
+
+/* Returns buckets for the given capacity, all empty. */
+static Name_buckets *buckets_new(Arena *, unsigned long);
+
+/* Returns the number of bytes allocated for buckets of the given capacity. */
+static size_t buckets_size(unsigned long);
+
+/* Replaces the buckets of a pool, whose lock is held, with twice as many. */
+static void names_grow(Name_pool *);
+
+/* Frees a name or buckets taken out of the pool of a tree. */
+static void release_name(Tree *, void *, size_t);
+
+/* Creates an empty name pool of a tree, whose memory comes from the given
+ * arena. */
+Name_pool *names_new(Arena *arena, Tree *tree)
+{
+    Name_pool *pool = arena_alloc(arena, sizeof(Name_pool));
+    
+    pool->arena = arena;
+    pool->tree = tree;
+    pool->buckets = buckets_new(arena, NAMES_MIN_CAPACITY);
+    pool->count = 0;
+    pool->refs = 0;
+    pool->bytes = 0;
+    pool->copy_bytes = 0;
+    mutex_init(&pool->lock);
+    return pool;
+}
+
+/* Returns the pooled copy of a name of the given length and hash, adding it
+ * to the pool if it is not there yet, for one more entry to hold. A name
+ * that is already the text of a pooled name, as when an entry is copied or
+ * moved, is found without comparing its characters. */
+char *name_intern(Name_pool *pool, const char *name, size_t len,
+                  unsigned long hash)
+{
+    Name_buckets *buckets;
+    Pooled_name *pooled;
+    
+    mutex_lock(&pool->lock);
+    buckets = pool->buckets;
+    for (pooled = buckets->heads[hash & (buckets->capacity - 1)];
+         pooled != NULL; pooled = pooled->next)
+        if (pooled->text == name ||
+            (pooled->hash == hash && pooled->len == len &&
+             memcmp(pooled->text, name, len) == 0))
+            break;
+    
+    /* A new name is filled in before it is published at the head of its
+     * chain, for name_find() to see. */
+    if (pooled == NULL)
+    {
+        if (pool->count >= buckets->capacity)
+            names_grow(pool);
+        buckets = pool->buckets;
+        pooled = arena_alloc(pool->arena, name_size(len));
+        pooled->hash = hash;
+        pooled->refs = 0;
+        pooled->len = len;
+        memcpy(pooled->text, name, len);
+        pooled->text[len] = '\0';
+        pooled->next = buckets->heads[hash & (buckets->capacity - 1)];
+        PUBLISH(buckets->heads[hash & (buckets->capacity - 1)], pooled);
+        pool->count++;
+        pool->bytes += name_size(len);
+    }
+    pooled->refs++;
+    pool->refs++;
+    pool->copy_bytes += len + 1;
+    mutex_unlock(&pool->lock);
+    return pooled->text;
+}
+
+/* Returns the text of a name of the given length and hash if it is in the
+ * pool, or NULL, without taking the lock. The caller must be inside an epoch
+ * of the pool's tree. A name is never mistaken for another, but one may be
+ * missed while the buckets are being replaced, so on NULL the caller still
+ * has to compare characters. */
+const char *name_find(Name_pool *pool, const char *name, size_t len,
+                      unsigned long hash)
+{
+    Name_buckets *buckets = LOAD(pool->buckets);
+    Pooled_name *pooled;
+    
+    for (pooled = LOAD(buckets->heads[hash & (buckets->capacity - 1)]);
+         pooled != NULL; pooled = LOAD(pooled->next))
+        if (pooled->hash == hash && pooled->len == len &&
+            memcmp(pooled->text, name, len) == 0)
+            return pooled->text;
+    return NULL;
+}
+
+/* Lets go of a name from the pool for one entry that held it, taking it out
+ * of the pool if that was the last one. No thread may still be reading the
+ * name through that entry; threads that found it with name_find() may still
+ * be reading it, so it is only freed once they have all left. */
+void name_release(Name_pool *pool, char *text)
+{
+    Pooled_name *pooled = name_of(text), **link;
+    Name_buckets *buckets;
+    
+    mutex_lock(&pool->lock);
+    pool->refs--;
+    pool->copy_bytes -= pooled->len + 1;
+    if (--pooled->refs == 0)
+    {
+        buckets = pool->buckets;
+        for (link = &buckets->heads[pooled->hash & (buckets->capacity - 1)];
+             *link != pooled; link = &(*link)->next)
+            ;
+        PUBLISH(*link, pooled->next);
+        pool->count--;
+        pool->bytes -= name_size(pooled->len);
+        epoch_defer(pool->tree, release_name, pooled, 
+                    name_size(pooled->len));
+    }
+    mutex_unlock(&pool->lock);
+}
+
+/* Stores in stats how many names are in the pool, how many entries hold
+ * them, the bytes the names take up, and the bytes they would take with a
+ * copy for each entry holding them. */
+void names_stats(Name_pool *pool, Stats *stats)
+{
+    mutex_lock(&pool->lock);
+    stats->names = pool->count;
+    stats->name_refs = pool->refs;
+    stats->name_bytes = pool->bytes;
+    stats->name_copy_bytes = pool->copy_bytes;
+    mutex_unlock(&pool->lock);
+}
+
+static Pooled_name *name_of(char *text)
+{
+    return (Pooled_name *) (text - offsetof(Pooled_name, text));
+}
+
+static size_t name_size(size_t len)
+{
+    return offsetof(Pooled_name, text) + len + 1;
+}
+
+static Name_buckets *buckets_new(Arena *arena, unsigned long capacity)
+{
+    Name_buckets *buckets = arena_alloc(arena, buckets_size(capacity));
+    
+    memset(buckets, 0, buckets_size(capacity));
+    buckets->capacity = capacity;
+    return buckets;
+}
+
+static size_t buckets_size(unsigned long capacity)
+{
+    return offsetof(Name_buckets, heads) + capacity * sizeof(Pooled_name *);
+}
+
+/* Each name is moved to the head of its new chain, which only ever holds
+ * names already moved, so a thread walking an old chain meanwhile may end up
+ * on a new one, and miss its name, but always reaches the end. */
+static void names_grow(Name_pool *pool)
+{
+    Name_buckets *old = pool->buckets;
+    Name_buckets *buckets = buckets_new(pool->arena, old->capacity * 2);
+    Pooled_name *pooled, *next;
+    unsigned long i, mask = buckets->capacity - 1;
+    
+    for (i = 0; i < old->capacity; i++)
+        for (pooled = old->heads[i]; pooled != NULL; pooled = next)
+        {
+            next = pooled->next;
+            PUBLISH(pooled->next, buckets->heads[pooled->hash & mask]);
+            buckets->heads[pooled->hash & mask] = pooled;
+        }
+    
+    PUBLISH(pool->buckets, buckets);
+    epoch_defer(pool->tree, release_name, old, buckets_size(old->capacity));
+}
+
+static void release_name(Tree *tree, void *memory, size_t size)
+{
+    arena_free(tree->arena, memory, size);
+}
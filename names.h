@@ -0,0 +1,59 @@
+#ifndef _names_h
+#define _names_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+/* The number of buckets a name pool starts with. */
+#define NAMES_MIN_CAPACITY 64
+
+/* A name kept once for every file and directory that has it: the hash it is
+ * filed under, how many entries hold it, its length, and its characters,
+ * allocated along with it. Entries point at text, which never changes, so
+ * two entries holding a pooled name have the same name exactly when they
+ * point at the same text. */
+typedef struct pooled_name
+{
+    struct pooled_name *next;
+    unsigned long hash;
+    unsigned long refs;
+    size_t len;
+    char text[1];
+}Pooled_name;
+
+/* The buckets of a name pool, capacity of them (a power of two), allocated
+ * along with their count so that a thread reading them without the lock
+ * never pairs one with the other's count. */
+typedef struct
+{
+    unsigned long capacity;
+    Pooled_name *heads[1];
+}Name_buckets;
+
+/* The names of one filesystem that are too long to keep inside a file or
+ * directory, in a chained hash table whose buckets are replaced by twice as
+ * many when it holds more names than buckets. refs counts the entries
+ * holding any of the names, bytes is the memory the names take up, and
+ * copy_bytes what the names would take with a copy for each entry holding
+ * them. The lock guards all of them; name_find() reads the buckets without
+ * it, and names and buckets taken out of the pool are only freed once the
+ * tree's epoch has moved on (see epoch.c). */
+typedef struct name_pool
+{
+    struct arena *arena;
+    struct tree *tree;
+    Name_buckets *buckets;
+    unsigned long count;
+    unsigned long refs;
+    unsigned long bytes;
+    unsigned long copy_bytes;
+    Mutex lock;
+}Name_pool;
+
+Name_pool *names_new(struct arena *, struct tree *);
+char *name_intern(Name_pool *, const char *, size_t, unsigned long);
+const char *name_find(Name_pool *, const char *, size_t, unsigned long);
+void name_release(Name_pool *, char *);
+void names_stats(Name_pool *, Stats *);
+
+#endif
@@ -0,0 +1,217 @@
+/*******************************************************************************
+ *  A work stealing pool of threads. Each worker keeps a deque of tasks: it    *
+ *  pushes the tasks it makes onto the bottom of its own and takes them back   *
+ *  from there, so it works depth first through what it has found, while a     *
+ *  worker that runs out takes the oldest task from the top of another's,      *
+ *  which in a tree walk is the biggest piece of work left there. The pool     *
+ *  is done once no task is waiting or running, which a count of them          *
+ *  tells, since a task pushes whatever it makes before it finishes.           *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pool.h"
+#include "lock.h"
+
+/* The number of tasks a deque first makes room for. */
+#define DEQUE_MIN_CAPACITY 64
+
+/* One worker of a pool, and its deque: the tasks from top up to bottom of
+ * the cap allocated, newest last. Its lock is taken by the worker and by
+ * any worker stealing from it. */
+typedef struct
+{
+    struct pool *pool;
+    int id;
+    pthread_t thread;
+    int started;
+    Mutex lock;
+    void **tasks;
+    unsigned long top;
+    unsigned long bottom;
+    unsigned long cap;
+}Worker;
+
+/* A pool: its workers, the number of tasks pushed that have not yet been
+ * run to the end, and what runs them. */
+struct pool
+{
+    Worker *workers;
+    int count;
+    unsigned long pending;
+    Task_handler handler;
+    void *context;
+};
+
+/* Runs tasks, its own first and then stolen ones, until there are none left
+ * anywhere. */
+static void *work(void *);
+
+/* Takes the newest task of a worker's own deque, or NULL if it is empty. */
+static void *take(Worker *);
+
+/* Takes the oldest task of another worker's deque, or NULL if every other
+ * deque is empty. */
+static void *steal(Worker *);
+
+/* Allocates memory, or resizes an allocation if the pointer is not NULL,
+ * exiting the program if there is none left. */
+static void *alloc_or_exit(void *, size_t);
+
+/* Creates a pool of the given number of workers (at least one), whose tasks
+ * are run by handler, which is given context each time. */
+Pool *pool_new(int count, Task_handler handler, void *context)
+{
+    Pool *pool = alloc_or_exit(NULL, sizeof(Pool));
+    int i;
+    
+    if (count < 1)
+        count = 1;
+    pool->workers = alloc_or_exit(NULL, count * sizeof(Worker));
+    pool->count = count;
+    pool->pending = 0;
+    pool->handler = handler;
+    pool->context = context;
+    for (i = 0; i < count; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pool->workers[i].started = 0;
+        mutex_init(&pool->workers[i].lock);
+        pool->workers[i].tasks = NULL;
+        pool->workers[i].top = 0;
+        pool->workers[i].bottom = 0;
+        pool->workers[i].cap = 0;
+    }
+    return pool;
+}
+
+/* Pushes a task onto the bottom of the deque of the given worker (counted
+ * modulo the number of workers). Tasks are pushed before the pool runs, to
+ * give each worker something to start on, or by the tasks themselves. */
+void pool_push(Pool *pool, int id, void *task)
+{
+    Worker *worker = &pool->workers[(unsigned int) id % pool->count];
+    
+    /* The task pushing this one is still counted, so the count cannot reach
+     * zero before this one is. */
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+    mutex_lock(&worker->lock);
+    if (worker->bottom == worker->cap)
+    {
+        if (worker->top > 0)
+            memmove(worker->tasks, worker->tasks + worker->top,
+                    (worker->bottom - worker->top) * sizeof(void *));
+        else
+        {
+            worker->cap = worker->cap == 0 ? DEQUE_MIN_CAPACITY
+                                           : worker->cap * 2;
+            worker->tasks = alloc_or_exit(worker->tasks,
+                                          worker->cap * sizeof(void *));
+        }
+        worker->bottom -= worker->top;
+        worker->top = 0;
+    }
+    worker->tasks[worker->bottom++] = task;
+    mutex_unlock(&worker->lock);
+}
+
+/* Runs every task pushed, and every task those push, returning once all of
+ * them have finished. The calling thread is worker 0; every other worker is
+ * a thread of its own. If a thread cannot be started, the others do its
+ * share of the work. */
+void pool_run(Pool *pool)
+{
+    int i;
+    
+    for (i = 1; i < pool->count; i++)
+        pool->workers[i].started =
+            pthread_create(&pool->workers[i].thread, NULL, work,
+                           &pool->workers[i]) == 0;
+    work(&pool->workers[0]);
+    for (i = 1; i < pool->count; i++)
+        if (pool->workers[i].started)
+            pthread_join(pool->workers[i].thread, NULL);
+}
+
+/* Frees a pool, which must not be running. */
+void pool_free(Pool *pool)
+{
+    int i;
+    
+    for (i = 0; i < pool->count; i++)
+    {
+        mutex_destroy(&pool->workers[i].lock);
+        free(pool->workers[i].tasks);
+    }
+    free(pool->workers);
+    free(pool);
+}
+
+static void *work(void *arg)
+{
+    Worker *worker = arg;
+    Pool *pool = worker->pool;
+    void *task;
+    
+    while (1)
+    {
+        if ((task = take(worker)) != NULL || (task = steal(worker)) != NULL)
+        {
+            pool->handler(pool->context, worker->id, task);
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+        }
+        else if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0)
+            return NULL;
+        
+        /* Whatever is left is still being run by other workers, and may
+         * push more. */
+        else
+            sched_yield();
+    }
+}
+
+static void *take(Worker *worker)
+{
+    void *task = NULL;
+    
+    mutex_lock(&worker->lock);
+    if (worker->bottom > worker->top)
+        task = worker->tasks[--worker->bottom];
+    mutex_unlock(&worker->lock);
+    return task;
+}
+
+static void *steal(Worker *thief)
+{
+    Pool *pool = thief->pool;
+    Worker *victim;
+    void *task = NULL;
+    int i;
+    
+    for (i = 1; i < pool->count && task == NULL; i++)
+    {
+        victim = &pool->workers[(thief->id + i) % pool->count];
+        mutex_lock(&victim->lock);
+        if (victim->bottom > victim->top)
+            task = victim->tasks[victim->top++];
+        mutex_unlock(&victim->lock);
+    }
+    return task;
+}
+
+static void *alloc_or_exit(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    return ptr;
+}
@@ -0,0 +1,18 @@
+#ifndef _pool_h
+#define _pool_h
+
+/* Runs one task, given the context the pool was made with and the number of
+ * the worker running it (0 being the thread that runs the pool). A task may
+ * push more tasks, normally onto its own worker. */
+typedef void (*Task_handler)(void *, int, void *);
+
+/* A pool of worker threads, each with a deque of tasks of its own; see
+ * pool.c. */
+typedef struct pool Pool;
+
+Pool *pool_new(int, Task_handler, void *);
+void pool_push(Pool *, int, void *);
+void pool_run(Pool *);
+void pool_free(Pool *);
+
+#endif
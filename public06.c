@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "filesystem.h"
+
+/* Tests that copies made by copy() and snapshot() stay as they were when they
+ * were made, whatever later happens to what they were copied from, and the
+ * other way round, and that they survive save_fs() and load_fs() and the
+ * replay of a journal.
+ */
+
+#define IMAGE "public06.image"
+#define DISK "public06.fs"
+
+/* The entries found by a walk, one line each: the path below the directory
+ * walked, ending in / for a directory and followed by = and the contents for
+ * a file. */
+typedef struct
+{
+    Filesystem files;
+    size_t prefix;
+    char **lines;
+    size_t count;
+}Listing;
+
+static void add_line(void *context, const char *path, int is_dir)
+{
+    Listing *listing = context;
+    const char *name = path + listing->prefix;
+    char contents[64], *line;
+    long len = 0;
+    
+    if (!is_dir)
+    {
+        len = read_file(listing->files, path, 0, contents,
+                        sizeof(contents) - 1);
+        assert(len >= 0);
+    }
+    contents[len] = '\0';
+    line = malloc(strlen(path) + strlen(contents) + 3);
+    assert(line != NULL);
+    if (is_dir)
+        sprintf(line, "%s%s", name,
+                name[0] != '\0' && name[strlen(name) - 1] == '/' ? "" : "/");
+    else
+        sprintf(line, "%s=%s", name, contents);
+    listing->lines = realloc(listing->lines,
+                             (listing->count + 1) * sizeof(char *));
+    assert(listing->lines != NULL);
+    listing->lines[listing->count++] = line;
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Returns everything at and below path, sorted, one entry to a line, in a
+ * string that the caller frees. */
+static char *tree(Filesystem files, const char path[])
+{
+    Listing listing;
+    size_t i, size = 1;
+    char *result;
+    
+    listing.files = files;
+    listing.prefix = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    listing.lines = NULL;
+    listing.count = 0;
+    assert(walk(files, path, add_line, &listing, 1) == 0);
+    qsort(listing.lines, listing.count, sizeof(char *), compare_lines);
+    for (i = 0; i < listing.count; i++)
+        size += strlen(listing.lines[i]) + 1;
+    result = malloc(size);
+    assert(result != NULL);
+    result[0] = '\0';
+    for (i = 0; i < listing.count; i++)
+    {
+        strcat(result, listing.lines[i]);
+        strcat(result, " ");
+        free(listing.lines[i]);
+    }
+    free(listing.lines);
+    return result;
+}
+
+static void check_tree(Filesystem files, const char path[],
+                       const char expected[])
+{
+    char *found = tree(files, path);
+    
+    if (strcmp(found, expected) != 0)
+    {
+        printf("%s is: %s\n  expected: %s\n", path, found, expected);
+        fflush(stdout);
+        assert(0);
+    }
+    free(found);
+}
+
+static void write_text(Filesystem *files, const char path[],
+                       const char text[])
+{
+    assert(truncate_file(files, path, 0) == 0);
+    assert(write_file(files, path, 0, text, strlen(text)) ==
+           (long) strlen(text));
+}
+
+/* Makes /a with a file, a sub directory holding a file, and an empty
+ * directory below that. */
+static void make_original(Filesystem *files)
+{
+    assert(mkdir(files, "/a") == 0);
+    assert(mkdir(files, "/a/b") == 0);
+    assert(mkdir(files, "/a/b/c") == 0);
+    assert(touch(files, "/a/f") == 0);
+    assert(touch(files, "/a/b/g") == 0);
+    write_text(files, "/a/f", "one");
+    write_text(files, "/a/b/g", "two");
+}
+
+#define ORIGINAL "/ /b/ /b/c/ /b/g=two /f=one "
+
+/* Changes everything that a copy of /a could see change. */
+static void change_original(Filesystem *files)
+{
+    write_text(files, "/a/f", "ONE");
+    assert(append_file(files, "/a/b/g", "!", 1) == 1);
+    assert(re_name(files, "/a/b/c", "d") == 0);
+    assert(move(files, "/a/b/g", "/a/g") == 0);
+    assert(touch(files, "/a/b/d/h") == 0);
+    assert(mkdir(files, "/a/e") == 0);
+}
+
+#define CHANGED "/ /b/ /b/d/ /b/d/h= /e/ /f=ONE /g=two! "
+
+static void test_copy_of_changed_original(void)
+{
+    Filesystem files;
+    
+    mkfs(&files);
+    make_original(&files);
+    assert(copy(&files, "/a", "/x") == 0);
+    assert(copy(&files, "/a/f", "/xf") == 0);
+    assert(snapshot(&files, "/s") == 0);
+    change_original(&files);
+    check_tree(files, "/a", CHANGED);
+    check_tree(files, "/x", ORIGINAL);
+    check_tree(files, "/s/a", ORIGINAL);
+    check_tree(files, "/xf", "=one ");
+    
+    /* the copies stay when the original goes */
+    assert(rm(&files, "/a") == 0);
+    check_tree(files, "/x", ORIGINAL);
+    check_tree(files, "/s/a", ORIGINAL);
+    check_tree(files, "/", "/ /s/ /s/a/ /s/a/b/ /s/a/b/c/ /s/a/b/g=two "
+               "/s/a/f=one /s/x/ /s/x/b/ /s/x/b/c/ /s/x/b/g=two /s/x/f=one "
+               "/s/xf=one /x/ /x/b/ /x/b/c/ /x/b/g=two /x/f=one /xf=one ");
+    rmfs(&files);
+}
+
+static void test_changed_copy(void)
+{
+    Filesystem files;
+    
+    mkfs(&files);
+    make_original(&files);
+    assert(copy(&files, "/a", "/x") == 0);
+    assert(copy(&files, "/x", "/y") == 0);
+    
+    /* a copy of a copy is read in from the first copy before it changes */
+    write_text(&files, "/x/b/g", "TWO");
+    assert(rm(&files, "/x/b/c") == 0);
+    assert(touch(&files, "/x/b/i") == 0);
+    assert(move(&files, "/x/f", "/x/b/f") == 0);
+    check_tree(files, "/x", "/ /b/ /b/f=one /b/g=TWO /b/i= ");
+    check_tree(files, "/a", ORIGINAL);
+    check_tree(files, "/y", ORIGINAL);
+    
+    /* so is the original's, when it changes first */
+    assert(copy(&files, "/a", "/z") == 0);
+    change_original(&files);
+    write_text(&files, "/z/b/g", "2");
+    check_tree(files, "/a", CHANGED);
+    check_tree(files, "/z", "/ /b/ /b/c/ /b/g=2 /f=one ");
+    check_tree(files, "/y", ORIGINAL);
+    rmfs(&files);
+}
+
+static void test_saved_copies(void)
+{
+    Filesystem files, loaded;
+    char *before;
+    
+    mkfs(&files);
+    make_original(&files);
+    assert(copy(&files, "/a", "/x") == 0);
+    assert(snapshot(&files, "/s") == 0);
+    write_text(&files, "/x/f", "uno");
+    
+    /* /y is still waiting to be read in when the image is saved */
+    assert(copy(&files, "/x", "/y") == 0);
+    before = tree(files, "/");
+    assert(save_fs(files, IMAGE) == 0);
+    rmfs(&files);
+    
+    assert(load_fs(&loaded, IMAGE) == 0);
+    check_tree(loaded, "/", before);
+    change_original(&loaded);
+    write_text(&loaded, "/x/b/g", "dos");
+    check_tree(loaded, "/a", CHANGED);
+    check_tree(loaded, "/x", "/ /b/ /b/c/ /b/g=dos /f=uno ");
+    check_tree(loaded, "/y", "/ /b/ /b/c/ /b/g=two /f=uno ");
+    check_tree(loaded, "/s/a", ORIGINAL);
+    free(before);
+    rmfs(&loaded);
+    remove(IMAGE);
+}
+
+static void test_replayed_copies(void)
+{
+    Filesystem files;
+    char *before;
+    
+    remove(DISK ".image");
+    remove(DISK ".journal");
+    assert(open_fs(&files, DISK, 1, 0) == 0);
+    make_original(&files);
+    assert(copy(&files, "/a", "/x") == 0);
+    assert(snapshot(&files, "/s") == 0);
+    change_original(&files);
+    write_text(&files, "/x/b/g", "deux");
+    assert(copy(&files, "/x", "/y") == 0);
+    assert(rm(&files, "/x/f") == 0);
+    before = tree(files, "/");
+    rmfs(&files);
+    
+    assert(open_fs(&files, DISK, 1, 0) == 0);
+    check_tree(files, "/", before);
+    check_tree(files, "/a", CHANGED);
+    check_tree(files, "/s/a", ORIGINAL);
+    check_tree(files, "/y", "/ /b/ /b/c/ /b/g=deux /f=one ");
+    free(before);
+    rmfs(&files);
+    remove(DISK ".image");
+    remove(DISK ".journal");
+}
+
+int main(void)
+{
+    test_copy_of_changed_original();
+    test_changed_copy();
+    test_saved_copies();
+    test_replayed_copies();
+    
+    printf("Every assertion succeeded!\n");
+    
+    return 0;
+}
@@ -0,0 +1,482 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <pthread.h>
+#include "filesystem.h"
+
+/* Tests sessions used from several threads at once: writers adding, moving,
+ * renaming and removing files and directories in sibling directories and in
+ * directories nested inside each other, and in directories as soon as they
+ * are made, whose final tree, and its usage, must be what every thread did,
+ * and sessions changing into directories while another thread removes them,
+ * which must never leave a session in a removed directory.
+ */
+
+#define SIBLINGS 4
+#define DIRS 8
+#define FILES 6
+#define LEVELS 3
+#define STEPS 30
+#define MADE 2000
+#define ROUNDS 5
+#define CHANGERS 2
+#define REMOVALS 2000
+
+/* Entries, one line each: a path, ending in / for a directory and followed
+ * by = and the contents for a file. */
+typedef struct
+{
+    Filesystem files;
+    char **lines;
+    size_t count;
+}Listing;
+
+static void add(Listing *listing, const char format[], ...)
+{
+    char line[128];
+    va_list args;
+    
+    va_start(args, format);
+    vsprintf(line, format, args);
+    va_end(args);
+    listing->lines = realloc(listing->lines,
+                             (listing->count + 1) * sizeof(char *));
+    assert(listing->lines != NULL);
+    listing->lines[listing->count] = malloc(strlen(line) + 1);
+    assert(listing->lines[listing->count] != NULL);
+    strcpy(listing->lines[listing->count++], line);
+}
+
+static void add_walked(void *context, const char *path, int is_dir)
+{
+    Listing *listing = context;
+    char contents[64];
+    long len;
+    
+    if (is_dir)
+        add(listing, strcmp(path, "/") == 0 ? "%s" : "%s/", path);
+    else
+    {
+        len = read_file(listing->files, path, 0, contents,
+                        sizeof(contents) - 1);
+        assert(len >= 0);
+        contents[len] = '\0';
+        add(listing, "%s=%s", path, contents);
+    }
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Sorts the entries, joins them in a string that the caller frees, and
+ * empties the listing. */
+static char *joined(Listing *listing)
+{
+    size_t i, size = 1;
+    char *result;
+    
+    qsort(listing->lines, listing->count, sizeof(char *), compare_lines);
+    for (i = 0; i < listing->count; i++)
+        size += strlen(listing->lines[i]) + 1;
+    result = malloc(size);
+    assert(result != NULL);
+    result[0] = '\0';
+    for (i = 0; i < listing->count; i++)
+    {
+        strcat(result, listing->lines[i]);
+        strcat(result, " ");
+        free(listing->lines[i]);
+    }
+    free(listing->lines);
+    listing->lines = NULL;
+    listing->count = 0;
+    return result;
+}
+
+/* Checks that the whole tree is what expected lists, and that du() of the
+ * root counts everything in it. */
+static void check_tree(Filesystem files, Listing *expected)
+{
+    Listing found;
+    Usage usage;
+    unsigned long dirs = 0;
+    size_t i;
+    char *want, *have;
+    
+    found.files = files;
+    found.lines = NULL;
+    found.count = 0;
+    assert(walk(files, "/", add_walked, &found, 1) == 0);
+    for (i = 0; i < found.count; i++)
+        if (strchr(found.lines[i], '=') == NULL)
+            dirs++;
+    assert(du(files, "/", &usage) == 0);
+    assert(usage.dirs == dirs - 1);
+    assert(usage.files == found.count - dirs);
+    want = joined(expected);
+    have = joined(&found);
+    if (strcmp(want, have) != 0)
+    {
+        printf("tree is: %s\n  expected: %s\n", have, want);
+        fflush(stdout);
+        assert(0);
+    }
+    free(want);
+    free(have);
+}
+
+static void write_text(Filesystem *files, const char path[],
+                       const char text[])
+{
+    assert(write_file(files, path, 0, text, strlen(text)) ==
+           (long) strlen(text));
+}
+
+/* A thread's own session, and which directory it works in. */
+typedef struct
+{
+    Filesystem files;
+    int number;
+}Worker;
+
+static const char *levels[LEVELS] = {"/n", "/n/m", "/n/m/k"};
+
+/* Fills the directories of its own sibling, then moves the first file of
+ * each into the next one, removes the second, renames the third and finally
+ * removes the last directory. */
+static void *sibling(void *arg)
+{
+    Worker *worker = arg;
+    Filesystem *files = &worker->files;
+    char path[64], to[64];
+    int i = worker->number, j, k;
+    
+    sprintf(path, "/s%d", i);
+    assert(mkdir(files, path) == 0);
+    for (j = 0; j < DIRS; j++)
+    {
+        sprintf(path, "/s%d/d%d", i, j);
+        assert(mkdir(files, path) == 0);
+        for (k = 0; k < FILES; k++)
+        {
+            sprintf(path, "/s%d/d%d/f%d", i, j, k);
+            assert(touch(files, path) == 0);
+            write_text(files, path, path);
+        }
+    }
+    for (j = 0; j < DIRS; j++)
+    {
+        sprintf(path, "/s%d/d%d/f0", i, j);
+        sprintf(to, "/s%d/d%d/m%d", i, (j + 1) % DIRS, j);
+        assert(move(files, path, to) == 0);
+        sprintf(path, "/s%d/d%d/f1", i, j);
+        assert(rm(files, path) == 0);
+        sprintf(path, "/s%d/d%d/f2", i, j);
+        assert(re_name(files, path, "r2") == 0);
+    }
+    sprintf(path, "/s%d/d%d", i, DIRS - 1);
+    assert(rm(files, path) == 0);
+    return NULL;
+}
+
+static void expect_sibling(Listing *expected, int i)
+{
+    int j, k, from;
+    
+    add(expected, "/s%d/", i);
+    for (j = 0; j < DIRS - 1; j++)
+    {
+        from = (j + DIRS - 1) % DIRS;
+        add(expected, "/s%d/d%d/", i, j);
+        for (k = 3; k < FILES; k++)
+            add(expected, "/s%d/d%d/f%d=/s%d/d%d/f%d", i, j, k, i, j, k);
+        add(expected, "/s%d/d%d/r2=/s%d/d%d/f2", i, j, i, j);
+        add(expected, "/s%d/d%d/m%d=/s%d/d%d/f0", i, j, from, i, from);
+    }
+}
+
+/* Works in one of the nested directories, from the current directory: adds
+ * a directory with a file in it and a file at each step, removes every other
+ * directory, and moves every third file up to the outermost one. */
+static void *nested(void *arg)
+{
+    Worker *worker = arg;
+    Filesystem *files = &worker->files;
+    char path[64], to[64];
+    int i = worker->number, j;
+    
+    assert(cd(files, levels[i]) == 0);
+    for (j = 0; j < STEPS; j++)
+    {
+        sprintf(path, "e%d_%d", i, j);
+        assert(mkdir(files, path) == 0);
+        sprintf(path, "e%d_%d/g", i, j);
+        assert(touch(files, path) == 0);
+        sprintf(path, "h%d_%d", i, j);
+        assert(touch(files, path) == 0);
+        if (j % 2 == 1)
+        {
+            sprintf(path, "e%d_%d", i, j);
+            assert(rm(files, path) == 0);
+        }
+        if (j % 3 == 0)
+        {
+            sprintf(path, "h%d_%d", i, j);
+            sprintf(to, "/n/up%d_%d", i, j);
+            assert(move(files, path, to) == 0);
+        }
+    }
+    assert(cd(files, "/") == 0);
+    return NULL;
+}
+
+static void expect_nested(Listing *expected, int i)
+{
+    int j;
+    
+    for (j = 0; j < STEPS; j++)
+    {
+        if (j % 2 == 0)
+        {
+            add(expected, "%s/e%d_%d/", levels[i], i, j);
+            add(expected, "%s/e%d_%d/g=", levels[i], i, j);
+        }
+        if (j % 3 == 0)
+            add(expected, "/n/up%d_%d=", i, j);
+        else
+            add(expected, "%s/h%d_%d=", levels[i], i, j);
+    }
+}
+
+static void test_writers(void)
+{
+    Filesystem files;
+    Worker siblings[SIBLINGS], levelled[LEVELS];
+    pthread_t threads[SIBLINGS + LEVELS];
+    Listing expected;
+    int i;
+    
+    mkfs(&files);
+    for (i = 0; i < LEVELS; i++)
+        assert(mkdir(&files, levels[i]) == 0);
+    for (i = 0; i < SIBLINGS; i++)
+    {
+        new_session(files, &siblings[i].files);
+        siblings[i].number = i;
+        assert(pthread_create(&threads[i], NULL, sibling, &siblings[i]) == 0);
+    }
+    for (i = 0; i < LEVELS; i++)
+    {
+        new_session(files, &levelled[i].files);
+        levelled[i].number = i;
+        assert(pthread_create(&threads[SIBLINGS + i], NULL, nested,
+                              &levelled[i]) == 0);
+    }
+    for (i = 0; i < SIBLINGS + LEVELS; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    for (i = 0; i < SIBLINGS; i++)
+        end_session(&siblings[i].files);
+    for (i = 0; i < LEVELS; i++)
+        end_session(&levelled[i].files);
+    
+    expected.lines = NULL;
+    expected.count = 0;
+    add(&expected, "/");
+    for (i = 0; i < LEVELS; i++)
+        add(&expected, "%s/", levels[i]);
+    for (i = 0; i < SIBLINGS; i++)
+        expect_sibling(&expected, i);
+    for (i = 0; i < LEVELS; i++)
+        expect_nested(&expected, i);
+    check_tree(files, &expected);
+    rmfs(&files);
+}
+
+/* Makes new directories one after another. */
+static void *maker(void *arg)
+{
+    Filesystem *files = &((Worker *) arg)->files;
+    char path[16];
+    int j;
+    
+    for (j = 0; j < MADE; j++)
+    {
+        sprintf(path, "/w/d%d", j);
+        assert(mkdir(files, path) == 0);
+    }
+    return NULL;
+}
+
+/* Adds a file to each directory that maker() makes, as soon as it can. */
+static void *filler(void *arg)
+{
+    Filesystem *files = &((Worker *) arg)->files;
+    char path[16];
+    int j, result;
+    
+    for (j = 0; j < MADE; j++)
+    {
+        sprintf(path, "/w/d%d/f", j);
+        while ((result = touch(files, path)) == -1)
+            ;
+        assert(result == 0);
+    }
+    return NULL;
+}
+
+static void test_filled_as_made(void)
+{
+    Filesystem files;
+    Worker workers[2];
+    pthread_t threads[2];
+    Listing expected;
+    int i;
+    
+    mkfs(&files);
+    assert(mkdir(&files, "/w") == 0);
+    for (i = 0; i < 2; i++)
+    {
+        new_session(files, &workers[i].files);
+        workers[i].number = i;
+        assert(pthread_create(&threads[i], NULL, i == 0 ? maker : filler,
+                              &workers[i]) == 0);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        assert(pthread_join(threads[i], NULL) == 0);
+        end_session(&workers[i].files);
+    }
+    
+    expected.lines = NULL;
+    expected.count = 0;
+    add(&expected, "/");
+    add(&expected, "/w/");
+    for (i = 0; i < MADE; i++)
+    {
+        add(&expected, "/w/d%d/", i);
+        add(&expected, "/w/d%d/f=", i);
+    }
+    check_tree(files, &expected);
+    rmfs(&files);
+}
+
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stop;
+
+static int stopped(void)
+{
+    int result;
+    
+    pthread_mutex_lock(&stop_lock);
+    result = stop;
+    pthread_mutex_unlock(&stop_lock);
+    return result;
+}
+
+/* Makes and removes the same directories over and over, waiting for a
+ * session that is in one of them to leave, and makes them once more at the
+ * end. */
+static void *remover(void *arg)
+{
+    Filesystem *files = &((Worker *) arg)->files;
+    const char *paths[3] = {"/r", "/r/x", "/r/x/y"};
+    int i, j, result;
+    
+    for (i = 0; i <= REMOVALS; i++)
+    {
+        for (j = 0; j < 3; j++)
+            assert(mkdir(files, paths[j]) == 0);
+        for (j = 2; j >= 0 && i < REMOVALS; j--)
+        {
+            while ((result = rm(files, paths[j])) == -2)
+                ;
+            assert(result == 0);
+        }
+    }
+    pthread_mutex_lock(&stop_lock);
+    stop = 1;
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+/* Changes into the innermost directory whenever it is there, and checks
+ * that it stays there, and usable, until the session leaves, adding a file
+ * and removing it again. */
+static void *changer(void *arg)
+{
+    Filesystem *files = &((Worker *) arg)->files;
+    char path[16];
+    int result;
+    
+    while (!stopped())
+    {
+        result = cd(files, "/r/x/y");
+        assert(result == 0 || result == -1);
+        if (result == 0)
+        {
+            assert(pwd_path(*files, path, sizeof(path)) == 6);
+            assert(strcmp(path, "/r/x/y") == 0);
+            sprintf(path, "f%d", ((Worker *) arg)->number);
+            assert(touch(files, path) == 0);
+            assert(read_file(*files, path, 0, path, 1) == 0);
+            assert(rm(files, path) == 0);
+            assert(cd(files, "/") == 0);
+        }
+    }
+    return NULL;
+}
+
+static void test_cd_racing_rm(void)
+{
+    Filesystem files;
+    Worker workers[CHANGERS + 1];
+    pthread_t threads[CHANGERS + 1];
+    Listing expected;
+    int i;
+    
+    mkfs(&files);
+    stop = 0;
+    for (i = 0; i <= CHANGERS; i++)
+    {
+        new_session(files, &workers[i].files);
+        workers[i].number = i;
+        assert(pthread_create(&threads[i], NULL, i == 0 ? remover : changer,
+                              &workers[i]) == 0);
+    }
+    for (i = 0; i <= CHANGERS; i++)
+    {
+        assert(pthread_join(threads[i], NULL) == 0);
+        end_session(&workers[i].files);
+    }
+    
+    expected.lines = NULL;
+    expected.count = 0;
+    add(&expected, "/");
+    add(&expected, "/r/");
+    add(&expected, "/r/x/");
+    add(&expected, "/r/x/y/");
+    check_tree(files, &expected);
+    rmfs(&files);
+}
+
+int main(void)
+{
+    int i;
+    
+    for (i = 0; i < ROUNDS; i++)
+    {
+        test_writers();
+        test_filled_as_made();
+        test_cd_racing_rm();
+    }
+    
+    printf("Every assertion succeeded!\n");
+    
+    return 0;
+}
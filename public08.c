@@ -0,0 +1,332 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "filesystem.h"
+#include "journal.h"
+
+/* Tests a filesystem kept on disk with open_fs(): that reopening it replays
+ * every mutation in its journal, that a record torn or damaged by a crash
+ * ends the journal and is cut off, that checkpoint_fs() and the compaction
+ * of a journal that grows too large lose nothing, and that a journal left
+ * over from an older checkpoint is not replayed again.
+ */
+
+#define DISK "public08.fs"
+#define JOURNAL DISK JOURNAL_SUFFIX
+#define IMAGE DISK CHECKPOINT_SUFFIX
+#define SAVED "public08.saved"
+#define BATCH 8
+#define BIG (1024 * 1024)
+
+/* The entries found by a walk, one line each: the path, ending in / for a
+ * directory and followed by = and the start of the contents for a file. */
+typedef struct
+{
+    Filesystem files;
+    char **lines;
+    size_t count;
+}Listing;
+
+static void add_line(void *context, const char *path, int is_dir)
+{
+    Listing *listing = context;
+    char contents[64], *line;
+    long len = 0;
+    
+    if (!is_dir)
+    {
+        len = read_file(listing->files, path, 0, contents,
+                        sizeof(contents) - 1);
+        assert(len >= 0);
+    }
+    contents[len] = '\0';
+    line = malloc(strlen(path) + strlen(contents) + 3);
+    assert(line != NULL);
+    if (is_dir)
+        sprintf(line, strcmp(path, "/") == 0 ? "%s" : "%s/", path);
+    else
+        sprintf(line, "%s=%s", path, contents);
+    listing->lines = realloc(listing->lines,
+                             (listing->count + 1) * sizeof(char *));
+    assert(listing->lines != NULL);
+    listing->lines[listing->count++] = line;
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Returns the whole tree, sorted, one entry to a line, in a string that the
+ * caller frees. */
+static char *tree(Filesystem files)
+{
+    Listing listing;
+    size_t i, size = 1;
+    char *result;
+    
+    listing.files = files;
+    listing.lines = NULL;
+    listing.count = 0;
+    assert(walk(files, "/", add_line, &listing, 1) == 0);
+    qsort(listing.lines, listing.count, sizeof(char *), compare_lines);
+    for (i = 0; i < listing.count; i++)
+        size += strlen(listing.lines[i]) + 1;
+    result = malloc(size);
+    assert(result != NULL);
+    result[0] = '\0';
+    for (i = 0; i < listing.count; i++)
+    {
+        strcat(result, listing.lines[i]);
+        strcat(result, " ");
+        free(listing.lines[i]);
+    }
+    free(listing.lines);
+    return result;
+}
+
+/* Checks that the tree is the one expected, which is freed. */
+static void check_tree(Filesystem files, char *expected)
+{
+    char *found = tree(files);
+    
+    if (strcmp(found, expected) != 0)
+    {
+        printf("tree is: %s\n  expected: %s\n", found, expected);
+        fflush(stdout);
+        assert(0);
+    }
+    free(found);
+    free(expected);
+}
+
+static void remove_disk(void)
+{
+    remove(JOURNAL);
+    remove(IMAGE);
+    remove(SAVED);
+}
+
+static long file_size(const char path[])
+{
+    FILE *file = fopen(path, "rb");
+    long size;
+    
+    assert(file != NULL);
+    assert(fseek(file, 0, SEEK_END) == 0);
+    size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+static void copy_file(const char from[], const char to[])
+{
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    char buf[4096];
+    size_t n;
+    
+    assert(in != NULL && out != NULL);
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        assert(fwrite(buf, 1, n, out) == n);
+    fclose(in);
+    assert(fclose(out) == 0);
+}
+
+/* Cuts a file short, as a crash while it was being written might. */
+static void cut(const char path[], long size)
+{
+    int fd = open(path, O_WRONLY);
+    
+    assert(fd >= 0);
+    assert(ftruncate(fd, (off_t) size) == 0);
+    assert(close(fd) == 0);
+}
+
+/* Overwrites one byte of a file. */
+static void damage(const char path[], long offset)
+{
+    FILE *file = fopen(path, "r+b");
+    int c;
+    
+    assert(file != NULL);
+    assert(fseek(file, offset, SEEK_SET) == 0);
+    c = getc(file);
+    assert(c != EOF);
+    assert(fseek(file, offset, SEEK_SET) == 0);
+    assert(putc(c ^ 0xff, file) != EOF);
+    assert(fclose(file) == 0);
+}
+
+/* Makes every kind of mutation a journal records, some of them from a
+ * current directory other than the root. */
+static void mutate(Filesystem *files)
+{
+    assert(mkdir(files, "/a") == 0);
+    assert(mkdir(files, "/a/b") == 0);
+    assert(touch(files, "/a/f") == 0);
+    assert(write_file(files, "/a/f", 0, "hello", 5) == 5);
+    assert(append_file(files, "/a/f", " world", 6) == 6);
+    assert(write_file(files, "/a/f", 1, "E", 1) == 1);
+    assert(cd(files, "/a/b") == 0);
+    assert(touch(files, "g") == 0);
+    assert(write_file(files, "g", 0, "0123456789", 10) == 10);
+    assert(truncate_file(files, "g", 4) == 0);
+    assert(touch(files, "gone") == 0);
+    assert(rm(files, "gone") == 0);
+    assert(re_name(files, "g", "h") == 0);
+    assert(cd(files, "..") == 0);
+    assert(copy(files, "b", "/c") == 0);
+    assert(move(files, "/a/f", "/c/f") == 0);
+    assert(snapshot(files, "/s") == 0);
+    assert(append_file(files, "/c/h", "!", 1) == 1);
+    assert(cd(files, "/") == 0);
+}
+
+static void test_replay(void)
+{
+    Filesystem files;
+    char *before;
+    
+    remove_disk();
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    mutate(&files);
+    before = tree(files);
+    rmfs(&files);
+    
+    /* The last group is committed when the filesystem is closed. */
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    check_tree(files, before);
+    rmfs(&files);
+    remove_disk();
+}
+
+static void test_cut_tail(int torn)
+{
+    Filesystem files;
+    char *before, *after;
+    long intact;
+    
+    remove_disk();
+    assert(open_fs(&files, DISK, 1, 0) == 0);
+    mutate(&files);
+    before = tree(files);
+    intact = file_size(JOURNAL);
+    assert(append_file(&files, "/c/h", "lost", 4) == 4);
+    rmfs(&files);
+    assert(file_size(JOURNAL) > intact + 8);
+    
+    /* A crash in the middle of writing the last record, or one that wrote
+     * it wrong, loses that record alone, and the journal goes on from the
+     * last one that is intact. */
+    if (torn)
+        cut(JOURNAL, intact + 8);
+    else
+        damage(JOURNAL, file_size(JOURNAL) - 2);
+    assert(open_fs(&files, DISK, 1, 0) == 0);
+    check_tree(files, before);
+    assert(file_size(JOURNAL) == intact);
+    assert(touch(&files, "/after") == 0);
+    after = tree(files);
+    rmfs(&files);
+    
+    assert(open_fs(&files, DISK, 1, 0) == 0);
+    check_tree(files, after);
+    rmfs(&files);
+    remove_disk();
+}
+
+static void test_checkpoint(void)
+{
+    Filesystem files;
+    char *before, *checkpointed;
+    long size;
+    
+    remove_disk();
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    assert(checkpoint_fs(&files) == 0);
+    mutate(&files);
+    assert(sync_fs(&files) == 0);
+    size = file_size(JOURNAL);
+    copy_file(JOURNAL, SAVED);
+    
+    /* The checkpoint empties the journal, and what follows it is replayed
+     * on top of it. */
+    assert(checkpoint_fs(&files) == 0);
+    checkpointed = tree(files);
+    assert(file_size(JOURNAL) < size);
+    assert(append_file(&files, "/c/h", "?", 1) == 1);
+    assert(rm(&files, "/s") == 0);
+    before = tree(files);
+    rmfs(&files);
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    check_tree(files, before);
+    rmfs(&files);
+    
+    /* A crash after the checkpoint was written but before the journal was
+     * emptied leaves the older journal, which is not replayed again. */
+    copy_file(SAVED, JOURNAL);
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    check_tree(files, checkpointed);
+    rmfs(&files);
+    
+    /* A journal that follows a later checkpoint than the image is not this
+     * filesystem's. */
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    assert(touch(&files, "/later") == 0);
+    copy_file(IMAGE, SAVED);
+    assert(checkpoint_fs(&files) == 0);
+    rmfs(&files);
+    copy_file(SAVED, IMAGE);
+    assert(open_fs(&files, DISK, BATCH, 0) == -2);
+    remove_disk();
+}
+
+static void test_compaction(void)
+{
+    Filesystem files;
+    char *data = malloc(BIG), *before, end[4];
+    unsigned long i, writes = JOURNAL_CHECKPOINT_SIZE / BIG + 2;
+    
+    assert(data != NULL);
+    remove_disk();
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    assert(touch(&files, "/big") == 0);
+    for (i = 0; i < writes; i++)
+    {
+        memset(data, 'a' + (int) i, BIG);
+        assert(write_file(&files, "/big", i * BIG, data, BIG) == BIG);
+    }
+    assert(sync_fs(&files) == 0);
+    
+    /* The journal was compacted into a checkpoint on the way. */
+    assert(file_size(JOURNAL) < (long) JOURNAL_CHECKPOINT_SIZE);
+    assert(file_size(IMAGE) > (long) JOURNAL_CHECKPOINT_SIZE);
+    before = tree(files);
+    rmfs(&files);
+    
+    assert(open_fs(&files, DISK, BATCH, 0) == 0);
+    check_tree(files, before);
+    assert(read_file(files, "/big", writes * BIG - 1, end, 4) == 1);
+    assert(end[0] == 'a' + (int) writes - 1);
+    rmfs(&files);
+    free(data);
+    remove_disk();
+}
+
+int main(void)
+{
+    test_replay();
+    test_cut_tail(1);
+    test_cut_tail(0);
+    test_checkpoint();
+    test_compaction();
+    
+    printf("Every assertion succeeded!\n");
+    
+    return 0;
+}
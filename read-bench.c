@@ -0,0 +1,242 @@
+/*******************************************************************************
+ *  Measures how the lock free read path scales: how many cd, pwd and ls     *
+ *  operations per second a filesystem serves as the number of threads       *
+ *  reading it doubles from 1, optionally while other threads change it.     *
+ *                                                                            *
+ *  Usage: read-bench [threads [operations [writers]]]                       *
+ *                                                                            *
+ *  Each reader has a session of its own and makes operations operations     *
+ *  (200000 by default), up to threads readers (8 by default). The writers   *
+ *  (none by default) create and remove files until the readers are done.    *
+ *  Listings go to /dev/null through stdout, whose lock the readers share,   *
+ *  so ls is only one operation in eight; the results go to stderr.          *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "filesystem.h"
+
+/* The tree read: FANOUT directories at each of DEPTH levels below the root,
+ * with FILES files in each directory at the bottom. */
+#define FANOUT 8
+#define DEPTH 3
+#define FILES 8
+
+/* What a reader or writer thread works on. */
+typedef struct
+{
+    Filesystem files;
+    unsigned long operations;
+    unsigned long seed;
+}Work;
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static int done;
+
+/* Creates the directories and files read. */
+static void build(Filesystem *);
+
+/* Writes a random absolute path of the given number of levels into a 
+ * buffer, returning the next random number. */
+static unsigned long random_path(char *, int, unsigned long);
+
+/* Makes a reader's operations: cd down absolute and relative paths and back
+ * up, pwd, and ls of a bottom directory. */
+static void *read_tree(void *);
+
+/* Creates and removes files in the bottom directories until the readers are
+ * done. */
+static void *change_tree(void *);
+
+/* Returns 1 once the readers are done. */
+static int readers_done(void);
+
+/* Returns the time in seconds since some fixed point. */
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    unsigned long operations = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                        : 200000;
+    int writers = argc > 3 ? atoi(argv[3]) : 0, threads, i;
+    Filesystem files;
+    Work *work;
+    pthread_t *ids;
+    double start, elapsed, single = 0;
+    
+    if (max_threads < 1 || writers < 0 ||
+        freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    work = malloc((max_threads + writers) * sizeof(Work));
+    ids = malloc((max_threads + writers) * sizeof(pthread_t));
+    if (work == NULL || ids == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+    
+    mkfs(&files);
+    build(&files);
+    fprintf(stderr, "%8s %8s %14s %8s\n", "readers", "writers",
+            "operations/sec", "speedup");
+    for (threads = 1; threads <= max_threads; threads *= 2)
+    {
+        done = 0;
+        for (i = 0; i < threads + writers; i++)
+        {
+            new_session(files, &work[i].files);
+            work[i].operations = operations;
+            work[i].seed = i * 7919 + 1;
+        }
+        
+        start = now();
+        for (i = 0; i < threads + writers; i++)
+            pthread_create(&ids[i], NULL, i < threads ? read_tree
+                                                      : change_tree,
+                           &work[i]);
+        for (i = 0; i < threads; i++)
+            pthread_join(ids[i], NULL);
+        elapsed = now() - start;
+        
+        pthread_mutex_lock(&done_lock);
+        done = 1;
+        pthread_mutex_unlock(&done_lock);
+        for (i = threads; i < threads + writers; i++)
+            pthread_join(ids[i], NULL);
+        for (i = 0; i < threads + writers; i++)
+            end_session(&work[i].files);
+        
+        if (threads == 1)
+            single = operations / elapsed;
+        fprintf(stderr, "%8d %8d %14.0f %7.2fx\n", threads, writers,
+                threads * operations / elapsed,
+                threads * operations / elapsed / single);
+    }
+    rmfs(&files);
+    free(work);
+    free(ids);
+    return 0;
+}
+
+static void build(Filesystem *files)
+{
+    char path[256];
+    unsigned long i, j, count = 1, n;
+    int level;
+    
+    /* Every directory of a level is named by its number in that level. */
+    for (level = 1; level <= DEPTH; level++)
+    {
+        count *= FANOUT;
+        for (i = 0; i < count; i++)
+        {
+            path[0] = '\0';
+            for (j = 0, n = i; j < (unsigned long) level; j++, n /= FANOUT)
+                sprintf(path + j * 3, "/%c%c", 'a' + (int) j,
+                        '0' + (int) (n % FANOUT));
+            mkdir(files, path);
+            for (j = 0; level == DEPTH && j < FILES; j++)
+            {
+                sprintf(path + level * 3, "/f%lu", j);
+                touch(files, path);
+                path[level * 3] = '\0';
+            }
+        }
+    }
+}
+
+static unsigned long random_path(char *path, int levels, unsigned long seed)
+{
+    int j;
+    
+    for (j = 0; j < levels; j++)
+    {
+        seed = seed * 1103515245UL + 12345;
+        sprintf(path + j * 3, "/%c%c", 'a' + j,
+                '0' + (int) ((seed >> 16) % FANOUT));
+    }
+    return seed;
+}
+
+static void *read_tree(void *arg)
+{
+    Work *work = arg;
+    char path[256], buf[256];
+    unsigned long i, seed = work->seed;
+    
+    for (i = 0; i < work->operations; i++)
+    {
+        switch (i % 8)
+        {
+            case 0:
+                seed = random_path(path, DEPTH, seed);
+                cd(&work->files, path);
+                break;
+            case 1:
+            case 5:
+                pwd_path(work->files, buf, sizeof(buf));
+                break;
+            case 2:
+                cd(&work->files, "..");
+                break;
+            case 3:
+                seed = seed * 1103515245UL + 12345;
+                sprintf(path, "%c%lu", 'a' + DEPTH - 1, 
+                        (seed >> 16) % FANOUT);
+                cd(&work->files, path);
+                break;
+            case 4:
+                ls(work->files, "");
+                break;
+            case 6:
+                cd(&work->files, "/");
+                break;
+            default:
+                seed = random_path(path, DEPTH - 1, seed);
+                cd(&work->files, path);
+                break;
+        }
+    }
+    return NULL;
+}
+
+static void *change_tree(void *arg)
+{
+    Work *work = arg;
+    char path[256];
+    unsigned long seed = work->seed;
+    
+    while (!readers_done())
+    {
+        seed = random_path(path, DEPTH, seed);
+        sprintf(path + DEPTH * 3, "/w%lu", (seed >> 8) % 64);
+        if ((seed >> 20) % 2 == 0)
+            touch(&work->files, path);
+        else
+            rm(&work->files, path);
+    }
+    return NULL;
+}
+
+static int readers_done(void)
+{
+    int result;
+    
+    pthread_mutex_lock(&done_lock);
+    result = done;
+    pthread_mutex_unlock(&done_lock);
+    return result;
+}
+
+static double now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,133 @@
+/*******************************************************************************
+ *  A tracer that records each call into a filesystem it is attached to      *
+ *  (see fs_trace()) in a ring of fixed size, keeping the most recent ones,  *
+ *  and writes them out in the Chrome trace event format, so that a slow     *
+ *  run can be opened in a trace viewer and its spikes looked at one by      *
+ *  one. Recording an event takes one atomic addition to claim its slot;     *
+ *  a filesystem with no tracer attached only checks that it has none.      *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "trace.h"
+
+/* The names events are given, for each Stat_op and then rmfs. */
+static const char *const op_names[STAT_OPS + 1] = {"touch", "mkdir", "cd",
+                                                   "ls", "pwd", "walk",
+                                                   "du", "complete", "rm",
+                                                   "re_name", "write_file",
+                                                   "read_file",
+                                                   "append_file",
+                                                   "truncate_file", "copy",
+                                                   "move", "open_dir",
+                                                   "read_dir", "snapshot",
+                                                   "rmfs"};
+
+/* Allocates memory, exiting the program if there is none left. */
+static void *alloc_or_exit(size_t);
+
+/* Creates a tracer that keeps the given number of most recent events (at
+ * least one). */
+Tracer *trace_new(unsigned long capacity)
+{
+    Tracer *tracer = alloc_or_exit(sizeof(Tracer));
+    unsigned long i;
+    
+    if (capacity < 1)
+        capacity = 1;
+    tracer->slots = alloc_or_exit(capacity * sizeof(Trace_slot));
+    for (i = 0; i < capacity; i++)
+        tracer->slots[i].done = 0;
+    tracer->capacity = capacity;
+    tracer->next = 0;
+    return tracer;
+}
+
+/* Frees a tracer, which no filesystem may still have attached. */
+void trace_free(Tracer *tracer)
+{
+    if (tracer != NULL)
+    {
+        free(tracer->slots);
+        free(tracer);
+    }
+}
+
+/* Returns the time in microseconds since some fixed point, which is the same
+ * for every thread. */
+double trace_now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/* Records an event, in place of the oldest one once the ring is full. Threads
+ * recording at once each claim a slot of their own. A thread that has come
+ * a whole ring after another waits for that one to finish with the slot, so 
+ * no event is ever made of two. */
+void trace_record(Tracer *tracer, const Trace_event *event)
+{
+    unsigned long ticket = __atomic_fetch_add(&tracer->next, 1, 
+                                              __ATOMIC_RELAXED);
+    unsigned long before = ticket >= tracer->capacity 
+                           ? ticket - tracer->capacity + 1 : 0;
+    Trace_slot *slot = &tracer->slots[ticket % tracer->capacity];
+    
+    while (__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE) != before)
+        ;
+    slot->event = *event;
+    __atomic_store_n(&slot->done, ticket + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the events in the ring, oldest first, to the file at path as a
+ * Chrome trace: each is a complete event named after its operation, on a
+ * thread of its own for each session, with the argument length, entries
+ * looked at and result as its arguments. No call being traced may be running
+ * at the time. It returns 0, or -1 if the file cannot be written. */
+int trace_dump(Tracer *tracer, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    const Trace_event *event;
+    unsigned long i, count;
+    int failed;
+    
+    if (file == NULL)
+        return -1;
+    
+    count = tracer->next < tracer->capacity ? tracer->next
+                                            : tracer->capacity;
+    fprintf(file, "{\"traceEvents\":[");
+    for (i = tracer->next - count; i < tracer->next; i++)
+    {
+        event = &tracer->slots[i % tracer->capacity].event;
+        fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"fs\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%lu,"
+                "\"args\":{\"arg_len\":%lu,\"scanned\":%lu,\"result\":%d}}",
+                i > tracer->next - count ? "," : "", op_names[event->op],
+                event->begin, event->end - event->begin, event->session,
+                (unsigned long) event->arg_len, event->scanned,
+                event->result);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    failed = ferror(file);
+    if (fclose(file) != 0 || failed)
+        return -1;
+    return 0;
+}
+
+static void *alloc_or_exit(size_t size)
+{
+    void *ptr = malloc(size);
+    
+    if (ptr == NULL)
+    {
+        printf("Memory allocation failed!\n");
+        exit(1);
+    }
+    return ptr;
+}
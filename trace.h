@@ -0,0 +1,49 @@
+#ifndef _trace_h
+#define _trace_h
+
+#include <stddef.h>
+#include "file-system-internals.h"
+
+/* The operation a trace event records for rmfs(), which is not counted
+ * along with the others. */
+#define TRACE_RMFS STAT_OPS
+
+/* One call traced: the operation (a Stat_op, or TRACE_RMFS), what it
+ * returned, the session that called it, the length of its argument, how
+ * many entries it looked at, and when it began and ended, in microseconds
+ * since some fixed point. */
+typedef struct
+{
+    int op;
+    int result;
+    unsigned long session;
+    size_t arg_len;
+    unsigned long scanned;
+    double begin;
+    double end;
+}Trace_event;
+
+/* A slot of a tracer's ring: the event in it, and how many events have been
+ * recorded in the ring up to and including it (0 if none has been). */
+typedef struct
+{
+    Trace_event event;
+    unsigned long done;
+}Trace_slot;
+
+/* A ring of the last capacity events traced. next counts every event ever
+ * recorded, and the next one goes into slot next modulo capacity. */
+typedef struct tracer
+{
+    Trace_slot *slots;
+    unsigned long capacity;
+    unsigned long next;
+}Tracer;
+
+Tracer *trace_new(unsigned long);
+void trace_free(Tracer *);
+double trace_now(void);
+void trace_record(Tracer *, const Trace_event *);
+int trace_dump(Tracer *, const char *);
+
+#endif
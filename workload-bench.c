@@ -0,0 +1,353 @@
+/*******************************************************************************
+ *  Runs synthetic workloads against the filesystem API and reports, for     *
+ *  each kind of operation in each workload, how many operations per second  *
+ *  it served and the 50th, 99th and 99.9th percentile of their latencies,   *
+ *  so that a change to filesystem.c can be compared against the last one.   *
+ *                                                                            *
+ *  Usage: workload-bench [operations [seed]]                                *
+ *                                                                            *
+ *  The workloads are a wide directory of operations files (100000 by        *
+ *  default), a chain of directories an eighth as deep, operations random    *
+ *  touch, mkdir, cd, ls, pwd, rm and re_name calls over a small tree, and   *
+ *  rmfs of trees of about operations entries. The random choices follow     *
+ *  seed (1 by default), so runs with the same arguments do the same work.   *
+ *  Listings go to /dev/null through stdout; the results go to stderr.       *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+/* The kinds of operation timed. */
+typedef enum {OP_TOUCH, OP_MKDIR, OP_CD, OP_LS, OP_PWD, OP_RM, OP_RENAME,
+              OP_RMFS, OP_KINDS} Op;
+
+static const char *const op_names[OP_KINDS] = {"touch", "mkdir", "cd", "ls",
+                                               "pwd", "rm", "re_name",
+                                               "rmfs"};
+
+/* The latencies, in seconds, of the operations of one kind made so far in a
+ * workload: count of the cap allocated. */
+typedef struct
+{
+    double *times;
+    unsigned long count;
+    unsigned long cap;
+}Samples;
+
+static Samples samples[OP_KINDS];
+
+/* The names the mixed workload picks from at each level, and its levels. */
+#define MIXED_NAMES 8
+#define MIXED_DEPTH 3
+
+/* How many trees the rmfs workload builds and frees. */
+#define TEARDOWNS 8
+
+/* Creates files in one directory, renames some of them, lists it now and
+ * then, and removes them all. */
+static void wide(unsigned long);
+
+/* Creates a chain of directories, each inside the last, printing the path
+ * of some of them, climbs back up and removes the whole chain. */
+static void deep(unsigned long);
+
+/* Makes random operations of every kind over a small tree. */
+static void mixed(unsigned long, unsigned long);
+
+/* Builds trees of about the given number of entries and frees each with
+ * rmfs. */
+static void teardown(unsigned long);
+
+/* Writes a random absolute path of the given number of levels into a
+ * buffer, returning the next random number. */
+static unsigned long random_path(char *, int, unsigned long);
+
+/* Returns the next of a sequence of random numbers. */
+static unsigned long next_random(unsigned long);
+
+/* Records the latency of an operation of a kind that started at the given
+ * time. */
+static void record(Op, double);
+
+/* Prints the operations per second and latency percentiles of every kind of
+ * operation made in a workload, and forgets them for the next. */
+static void report(const char *);
+
+/* Orders latencies from shortest to longest for qsort(). */
+static int compare_times(const void *, const void *);
+
+/* Returns the time in seconds since some fixed point. */
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    unsigned long operations = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                        : 100000;
+    unsigned long seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    int i;
+    
+    if (operations < 8 || freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    
+    fprintf(stderr, "%-8s %-8s %10s %14s %10s %10s %10s\n", "workload", "op",
+            "count", "operations/sec", "p50 us", "p99 us", "p999 us");
+    wide(operations);
+    report("wide");
+    deep(operations / 8);
+    report("deep");
+    mixed(operations, seed);
+    report("mixed");
+    teardown(operations);
+    report("rmfs");
+    
+    for (i = 0; i < OP_KINDS; i++)
+        free(samples[i].times);
+    return 0;
+}
+
+static void wide(unsigned long count)
+{
+    Filesystem files;
+    char path[64], name[32];
+    unsigned long i;
+    double start;
+    
+    mkfs(&files);
+    mkdir(&files, "/w");
+    for (i = 0; i < count; i++)
+    {
+        sprintf(path, "/w/f%lu", i);
+        start = now();
+        touch(&files, path);
+        record(OP_TOUCH, start);
+        
+        /* A listing costs as much as the directory is big, so there are
+         * only a few, at sizes spread across the run. */
+        if ((i + 1) % (count / 8) == 0)
+        {
+            start = now();
+            ls(files, "/w");
+            record(OP_LS, start);
+        }
+    }
+    for (i = 0; i < count; i += 4)
+    {
+        sprintf(path, "/w/f%lu", i);
+        sprintf(name, "g%lu", i);
+        start = now();
+        re_name(&files, path, name);
+        record(OP_RENAME, start);
+    }
+    for (i = 0; i < count; i++)
+    {
+        sprintf(path, i % 4 == 0 ? "/w/g%lu" : "/w/f%lu", i);
+        start = now();
+        rm(&files, path);
+        record(OP_RM, start);
+    }
+    rmfs(&files);
+}
+
+static void deep(unsigned long levels)
+{
+    Filesystem files;
+    unsigned long i;
+    double start;
+    
+    mkfs(&files);
+    for (i = 0; i < levels; i++)
+    {
+        start = now();
+        mkdir(&files, "d");
+        record(OP_MKDIR, start);
+        start = now();
+        cd(&files, "d");
+        record(OP_CD, start);
+        if (i % 64 == 0)
+        {
+            start = now();
+            pwd(files);
+            record(OP_PWD, start);
+        }
+    }
+    for (i = 0; i < levels; i++)
+    {
+        start = now();
+        cd(&files, "..");
+        record(OP_CD, start);
+    }
+    start = now();
+    rm(&files, "d");
+    record(OP_RM, start);
+    rmfs(&files);
+}
+
+static void mixed(unsigned long count, unsigned long seed)
+{
+    Filesystem files;
+    char path[64], name[8];
+    unsigned long i;
+    double start;
+    
+    mkfs(&files);
+    for (i = 0; i < count; i++)
+    {
+        seed = next_random(seed);
+        
+        /* Paths have at least one level, so none is the root, which rm and
+         * re_name refuse outright. */
+        seed = random_path(path, 1 + (int) ((seed >> 8) % MIXED_DEPTH), seed);
+        start = now();
+        switch ((seed >> 24) % 20)
+        {
+            case 0: case 1: case 2: case 3: case 4:
+                touch(&files, path);
+                record(OP_TOUCH, start);
+                break;
+            case 5: case 6: case 7:
+                mkdir(&files, path);
+                record(OP_MKDIR, start);
+                break;
+            case 8: case 9: case 10:
+                cd(&files, path);
+                record(OP_CD, start);
+                break;
+            case 11: case 12:
+                ls(files, path);
+                record(OP_LS, start);
+                break;
+            case 13:
+                pwd(files);
+                record(OP_PWD, start);
+                break;
+            case 14: case 15: case 16: case 17:
+                rm(&files, path);
+                record(OP_RM, start);
+                break;
+                
+            /* The new name is one that paths at the same level use. */
+            default:
+                sprintf(name, "%c%lu", path[strlen(path) - 2],
+                        (seed >> 32) % MIXED_NAMES);
+                re_name(&files, path, name);
+                record(OP_RENAME, start);
+                break;
+        }
+    }
+    rmfs(&files);
+}
+
+static void teardown(unsigned long entries)
+{
+    Filesystem files;
+    char path[64];
+    unsigned long i, j;
+    double start;
+    int round;
+    
+    for (round = 0; round < TEARDOWNS; round++)
+    {
+        /* Directories of sixteen files each, spread over sixteen top level
+         * directories. */
+        mkfs(&files);
+        for (i = 0; i < 16; i++)
+        {
+            sprintf(path, "/t%lu", i);
+            mkdir(&files, path);
+        }
+        for (i = 0; i * 17 < entries; i++)
+        {
+            sprintf(path, "/t%lu/d%lu", i % 16, i);
+            mkdir(&files, path);
+            for (j = 0; j < 16; j++)
+            {
+                sprintf(path, "/t%lu/d%lu/f%lu", i % 16, i, j);
+                touch(&files, path);
+            }
+        }
+        start = now();
+        rmfs(&files);
+        record(OP_RMFS, start);
+    }
+}
+
+static unsigned long random_path(char *path, int levels, unsigned long seed)
+{
+    int j;
+    
+    for (j = 0; j < levels; j++)
+    {
+        seed = next_random(seed);
+        sprintf(path + j * 3, "/%c%c", 'a' + j,
+                '0' + (int) ((seed >> 16) % MIXED_NAMES));
+    }
+    return seed;
+}
+
+static unsigned long next_random(unsigned long seed)
+{
+    return seed * 6364136223846793005UL + 1442695040888963407UL;
+}
+
+static void record(Op op, double start)
+{
+    double elapsed = now() - start;
+    Samples *kind = &samples[op];
+    
+    if (kind->count == kind->cap)
+    {
+        kind->cap = kind->cap == 0 ? 1024 : kind->cap * 2;
+        kind->times = realloc(kind->times, kind->cap * sizeof(double));
+        if (kind->times == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+    kind->times[kind->count++] = elapsed;
+}
+
+static void report(const char *workload)
+{
+    Samples *kind;
+    double total;
+    unsigned long i;
+    int op;
+    
+    for (op = 0; op < OP_KINDS; op++)
+    {
+        kind = &samples[op];
+        if (kind->count == 0)
+            continue;
+        for (i = 0, total = 0; i < kind->count; i++)
+            total += kind->times[i];
+        qsort(kind->times, kind->count, sizeof(double), compare_times);
+        fprintf(stderr, "%-8s %-8s %10lu %14.0f %10.2f %10.2f %10.2f\n",
+                workload, op_names[op], kind->count,
+                total > 0 ? kind->count / total : 0,
+                kind->times[(kind->count - 1) / 2] * 1e6,
+                kind->times[(kind->count - 1) * 99 / 100] * 1e6,
+                kind->times[(kind->count - 1) * 999 / 1000] * 1e6);
+        kind->count = 0;
+    }
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    
+    return x < y ? -1 : x > y;
+}
+
+static double now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}